@@ -0,0 +1,240 @@
+#pragma once
+#ifndef GRAPHICS_ASYNC_READBACK_H_
+#define GRAPHICS_ASYNC_READBACK_H_
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl_includes.h"
+#include "texture.h"
+
+namespace graphics
+{
+
+// Pixel pack buffers a readback can be spread over
+const int default_readback_slots = 3;
+
+// Reads an RGBA32F texture back to the CPU without stalling. request()
+// queues a copy into a pixel pack buffer guarded by a fence; poll()
+// hands back the oldest copy once the GPU has finished it, normally one
+// or two frames later.
+class AsyncTextureReadback
+{
+public:
+	AsyncTextureReadback(int width, int height, int slot_count = default_readback_slots) :
+		_width(width),
+		_height(height),
+		_slots(slot_count),
+		_next(0),
+		_in_flight(0)
+	{
+		for (auto& slot : _slots)
+		{
+			glCreateBuffers(1, &slot.buffer);
+			glNamedBufferStorage(slot.buffer, byte_count(), NULL, GL_MAP_READ_BIT);
+			slot.fence = 0;
+		}
+	}
+
+	~AsyncTextureReadback()
+	{
+		for (auto& slot : _slots)
+		{
+			if (slot.fence)
+			{
+				glDeleteSync(slot.fence);
+			}
+			glDeleteBuffers(1, &slot.buffer);
+		}
+	}
+
+	AsyncTextureReadback(const AsyncTextureReadback&) = delete;
+	AsyncTextureReadback& operator=(const AsyncTextureReadback&) = delete;
+
+	// Queues a copy of tex. Returns false, dropping the request, if every
+	// slot is still waiting to be polled.
+	bool request(std::shared_ptr<Texture2D> tex)
+	{
+		if (_in_flight >= _slots.size())
+		{
+			return false;
+		}
+		Slot& slot = _slots[_next];
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		glGetTextureImage(tex->get_texture_name(), 0, GL_RGBA, GL_FLOAT, byte_count(), 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_next = (_next + 1) % _slots.size();
+		_in_flight += 1;
+		return true;
+	}
+
+	// Copies out the oldest finished request. Returns false if nothing
+	// has finished yet. Never blocks.
+	bool poll(std::vector<glm::vec4>& out)
+	{
+		if (!_in_flight)
+		{
+			return false;
+		}
+		Slot& slot = _slots[(_next + _slots.size() - _in_flight) % _slots.size()];
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		{
+			return false;
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		_in_flight -= 1;
+
+		out.resize(_width * _height);
+		const void* data = glMapNamedBufferRange(slot.buffer, 0, byte_count(), GL_MAP_READ_BIT);
+		memcpy(out.data(), data, byte_count());
+		glUnmapNamedBuffer(slot.buffer);
+		return true;
+	}
+
+	int pending() const
+	{
+		return _in_flight;
+	}
+
+private:
+	struct Slot
+	{
+		GLuint buffer;
+		GLsync fence;
+	};
+
+	size_t byte_count() const
+	{
+		return sizeof(glm::vec4) * _width * _height;
+	}
+
+	int _width;
+	int _height;
+	std::vector<Slot> _slots;
+	int _next;
+	int _in_flight;
+};
+
+// Reads count elements of a buffer back the same way: request() copies
+// them into a slot buffer guarded by a fence and poll() hands back the
+// oldest copy once the GPU has finished it. Copies are polled in the
+// order they were requested.
+template <class T>
+class AsyncBufferReadback
+{
+public:
+	AsyncBufferReadback(int count, int slot_count = default_readback_slots) :
+		_count(count),
+		_slots(slot_count),
+		_next(0),
+		_in_flight(0)
+	{
+		for (auto& slot : _slots)
+		{
+			glCreateBuffers(1, &slot.buffer);
+			glNamedBufferStorage(slot.buffer, byte_count(), NULL, GL_MAP_READ_BIT);
+			slot.fence = 0;
+		}
+	}
+
+	~AsyncBufferReadback()
+	{
+		clear();
+		for (auto& slot : _slots)
+		{
+			glDeleteBuffers(1, &slot.buffer);
+		}
+	}
+
+	AsyncBufferReadback(const AsyncBufferReadback&) = delete;
+	AsyncBufferReadback& operator=(const AsyncBufferReadback&) = delete;
+
+	// Queues a copy of the elements of buffer starting at offset, after
+	// any shader writes to it. Returns false, dropping the request, if
+	// every slot is still waiting to be polled.
+	bool request(GLuint buffer, int offset)
+	{
+		if (_in_flight >= _slots.size())
+		{
+			return false;
+		}
+		Slot& slot = _slots[_next];
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glCopyNamedBufferSubData(buffer, slot.buffer, sizeof(T) * offset, 0, byte_count());
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_next = (_next + 1) % _slots.size();
+		_in_flight += 1;
+		return true;
+	}
+
+	// Copies out the oldest finished request. Returns false if nothing
+	// has finished yet. Never blocks.
+	bool poll(std::vector<T>& out)
+	{
+		if (!_in_flight)
+		{
+			return false;
+		}
+		Slot& slot = _slots[(_next + _slots.size() - _in_flight) % _slots.size()];
+		GLenum status = glClientWaitSync(slot.fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		{
+			return false;
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		_in_flight -= 1;
+
+		out.resize(_count);
+		const void* data = glMapNamedBufferRange(slot.buffer, 0, byte_count(), GL_MAP_READ_BIT);
+		memcpy(out.data(), data, byte_count());
+		glUnmapNamedBuffer(slot.buffer);
+		return true;
+	}
+
+	// Drops every request still in flight
+	void clear()
+	{
+		for (auto& slot : _slots)
+		{
+			if (slot.fence)
+			{
+				glDeleteSync(slot.fence);
+				slot.fence = 0;
+			}
+		}
+		_in_flight = 0;
+	}
+
+	int pending() const
+	{
+		return _in_flight;
+	}
+
+private:
+	struct Slot
+	{
+		GLuint buffer;
+		GLsync fence;
+	};
+
+	size_t byte_count() const
+	{
+		return sizeof(T) * _count;
+	}
+
+	int _count;
+	std::vector<Slot> _slots;
+	int _next;
+	int _in_flight;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_ASYNC_READBACK_H_
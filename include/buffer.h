@@ -1,6 +1,7 @@
 #ifndef GRAPHICS_GRAPHICS_BUFFER_H_
 #define GRAPHICS_GRAPHICS_BUFFER_H_
 
+#include <algorithm>
 #include <vector>
 #include "GLFW/glfw3.h"
 
@@ -81,7 +82,7 @@ public:
 		}
 	}
 
-	void set_data(int offset, std::vector<T>& data, int count=-1)
+	void set_data(int offset, const std::vector<T>& data, int count=-1)
 	{
 		bind();
 		if (count == -1)
@@ -90,7 +91,15 @@ public:
 		}
 		glBufferSubData(_type, sizeof(T) * offset,
 			sizeof(T) * count,
-			reinterpret_cast<GLvoid*>(data.data()));
+			reinterpret_cast<const GLvoid*>(data.data()));
+	}
+
+	void set_data(int offset, const T* data, int count)
+	{
+		bind();
+		glBufferSubData(_type, sizeof(T) * offset,
+			sizeof(T) * count,
+			reinterpret_cast<const GLvoid*>(data));
 	}
 
 	void get_data(int offset, int count, std::vector<T>& data)
@@ -173,6 +182,12 @@ public:
 		return _max_count;
 	}
 
+	// For when the GPU appends elements itself
+	void set_count(int count)
+	{
+		_count = std::min(count, _max_count);
+	}
+
 	T* map_memory()
 	{
 		bind();
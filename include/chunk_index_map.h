@@ -5,6 +5,21 @@
 #include <vector>
 #include <glm/glm.hpp>
 
+// Floor division/modulo that behave for negative chunk coordinates
+inline int floor_div(int a, int b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+inline int wrap_index(int a, int size)
+{
+	return a - floor_div(a, size) * size;
+}
+
+// Toroidal map from chunk coordinate to chunk memory index.
+// A chunk's slot is its coordinate modulo the map size, so the
+// window of chunks covered can slide with the reference point
+// without moving anything already resident.
 class ChunkIndexMap
 {
 public:
@@ -12,31 +27,80 @@ public:
 		_x_size(x_size),
 		_y_size(y_size),
 		_z_size(z_size),
-		_data(x_size*y_size*z_size, -1)
+		_data(x_size*y_size*z_size, -1),
+		_coords(x_size*y_size*z_size, glm::ivec3(0))
 	{
 
 	}
 
-	GLint set(int ref_x, int ref_y, int ref_z, 
-		int x, int y, int z, 
-		int val)
+	int slot(int x, int y, int z) const
+	{
+		int adj_x = wrap_index(x, _x_size);
+		int adj_y = wrap_index(y, _y_size);
+		int adj_z = wrap_index(z, _z_size);
+		return adj_x + adj_y * _x_size + adj_z * _x_size * _y_size;
+	}
+
+	// ref_x/y/z is the lowest chunk coordinate of the window
+	bool in_window(int ref_x, int ref_y, int ref_z,
+		int x, int y, int z) const
 	{
 		int rel_x = x - ref_x;
 		int rel_y = y - ref_y;
 		int rel_z = z - ref_z;
-		int adj_x = x;// % _x_size;
-		int adj_y = y;// % _y_size;
-		int adj_z = z;// % _z_size;
-		int out_index = adj_x + adj_y * _x_size + adj_z * _x_size * _y_size;
+		return rel_x >= 0 && rel_x < _x_size &&
+			rel_y >= 0 && rel_y < _y_size &&
+			rel_z >= 0 && rel_z < _z_size;
+	}
+
+	// Returns the slot written, or -1 if the chunk is outside the window
+	GLint set(int ref_x, int ref_y, int ref_z,
+		int x, int y, int z,
+		int val)
+	{
+		if (!in_window(ref_x, ref_y, ref_z, x, y, z))
+		{
+			return -1;
+		}
+		int out_index = slot(x, y, z);
 		_data[out_index] = val;
+		_coords[out_index] = glm::ivec3(x, y, z);
 		return out_index;
 	}
 
+	// Memory index of the chunk at x/y/z, or -1 if the slot
+	// is empty or holds a different chunk
+	int get(int x, int y, int z) const
+	{
+		int index = slot(x, y, z);
+		if (_data[index] < 0 || _coords[index] != glm::ivec3(x, y, z))
+		{
+			return -1;
+		}
+		return _data[index];
+	}
+
+	void clear(int index)
+	{
+		_data[index] = -1;
+	}
+
+	glm::ivec3 coord(int index) const
+	{
+		return _coords[index];
+	}
+
+	glm::ivec3 size() const
+	{
+		return glm::ivec3(_x_size, _y_size, _z_size);
+	}
+
 	std::vector<GLint> _data;
 private:
 	int _x_size;
 	int _y_size;
 	int _z_size;
+	std::vector<glm::ivec3> _coords;
 };
 
-#endif  // CHUNK_INDEX_MAP_H_
\ No newline at end of file
+#endif  // CHUNK_INDEX_MAP_H_
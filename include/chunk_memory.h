@@ -3,6 +3,7 @@
 #define CHUNK_MEMORY_H_
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -11,6 +12,34 @@
 #include "buffer.h"
 #include "chunk_index_map.h"
 
+// Dirty blocks closer together than this are uploaded as one range
+const int default_edit_merge_gap = 16;
+
+// Coarse copies kept per chunk, at 2x, 4x and 8x block size
+const int max_chunk_lod_levels = 3;
+
+// Most common of 8 block types. Ties go to a solid block so thin
+// features don't vanish at a distance.
+inline int majority_block(const int* types)
+{
+	int best = types[0];
+	int best_count = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		int count = 0;
+		for (int j = 0; j < 8; ++j)
+		{
+			count += int(types[j] == types[i]);
+		}
+		if (count > best_count || (count == best_count && best == 0 && types[i] != 0))
+		{
+			best = types[i];
+			best_count = count;
+		}
+	}
+	return best;
+}
+
 struct chunk_alloc
 {
 	glm::vec4 coord;
@@ -36,43 +65,347 @@ public:
 		_max_chunks(max_chunks),
 		_chunk_block_count(chunk_size_x*_chunk_size_y*_chunk_size_z),
 		_index_map(map_size_x,map_size_y,map_size_z),
-		_local_index(_max_chunks, { glm::vec4(0.0),  _max_chunks + 1})  // Init all _local_index values to invalid (mem_index = -1)
+		_local_index(_max_chunks, { glm::vec4(0.0),  _max_chunks + 1}),  // Init all _local_index values to invalid (mem_index = -1)
+		_ref_x(0),
+		_ref_y(0),
+		_ref_z(0)
 	{
-		_full_chunk_buffer_size = _chunk_block_count * _max_chunks; // Why do I have to initialize this here?
+		// Each chunk's full resolution blocks are followed by its LOD levels.
+		// Only levels that divide the chunk evenly are kept.
+		_lod_levels = 0;
+		_chunk_stride = _chunk_block_count;
+		while (_lod_levels < max_chunk_lod_levels &&
+			_chunk_size_x % (2 << _lod_levels) == 0 &&
+			_chunk_size_y % (2 << _lod_levels) == 0 &&
+			_chunk_size_z % (2 << _lod_levels) == 0)
+		{
+			_lod_levels += 1;
+			_chunk_stride += lod_block_count(_lod_levels);
+		}
+		_full_chunk_buffer_size = _chunk_stride * _max_chunks; // Why do I have to initialize this here?
         std::vector<int> temp_vec;
 		_chunk_buffer->load_data(temp_vec, _full_chunk_buffer_size);
+		_block_mirror.resize(_full_chunk_buffer_size, 0);
+		_unsaved.resize(_max_chunks, false);
 		_index_buffer->load_data(_local_index);
 		_spatial_chunk_buffer->load_data(_index_map._data);
 		_local_index.clear();
 	}
 
 	void add_chunk(int x, int y, int z, 
-		std::vector<int> blocks)
+		const std::vector<int>& blocks)
 	{
-		int index = get_free_index();
-		if (index >= _max_chunks)
+		int index = reserve_chunk(x, y, z);
+		if (index == -2)
+		{
+			std::cout << "Chunk outside map window!" << "\n";
+			return;
+		}
+		if (index < 0)
 		{
 			std::cout << "Chunk buffer full!" << "\n";
 			return;
 		}
-		chunk_alloc new_alloc;
-		new_alloc.coord = glm::vec4(x, y, z, 0.0);
-		new_alloc.mem_index = index;
-		_local_index.push_back(new_alloc);
-		std::sort(_local_index.begin(), _local_index.end(), cmp);
-		_index_buffer->set_data(0, _local_index);
-		_chunk_buffer->set_data(_chunk_block_count * index, blocks);
-
-		int chunk_coord_x = floor(x / _chunk_size_x);
-		int chunk_coord_y = floor(y / _chunk_size_y);
-		int chunk_coord_z = floor(z / _chunk_size_z);
+		mirror_chunk(index, blocks);
+		_chunk_buffer->set_data(chunk_offset(index), chunk_data(index), _chunk_stride);
+	}
+
+	// Copies a chunk's blocks into the CPU mirror and builds its LOD
+	// levels there. The mirror is what gets uploaded for the chunk.
+	void mirror_chunk(int index, const std::vector<int>& blocks)
+	{
+		std::copy(blocks.begin(),
+			blocks.begin() + std::min<size_t>(blocks.size(), _chunk_block_count),
+			_block_mirror.begin() + chunk_offset(index));
+		for (int level = 1; level <= _lod_levels; ++level)
+		{
+			glm::ivec3 dims = lod_size(level);
+			for (int z = 0; z < dims.z; ++z)
+			{
+				for (int y = 0; y < dims.y; ++y)
+				{
+					for (int x = 0; x < dims.x; ++x)
+					{
+						update_lod_cell(index, level, x, y, z);
+					}
+				}
+			}
+		}
+		_unsaved[index] = true;
+		if (_load_callback)
+		{
+			_load_callback(chunk_coord(index), chunk_data(index));
+		}
+	}
+
+	// Full resolution blocks followed by every LOD level, chunk_stride() ints
+	const int* chunk_data(int index) const
+	{
+		return _block_mirror.data() + chunk_offset(index);
+	}
+
+	// Called with the chunk coordinate and blocks of any chunk that is
+	// evicted while it has changes that haven't been saved
+	void set_evict_callback(std::function<void(glm::ivec3, const int*)> callback)
+	{
+		_evict_callback = callback;
+	}
+
+	// Called with the chunk coordinate and blocks of every chunk that is
+	// added or paged in, once its blocks are in the CPU mirror
+	void set_load_callback(std::function<void(glm::ivec3, const int*)> callback)
+	{
+		_load_callback = callback;
+	}
+
+	// Flags a chunk as matching its saved copy, e.g. after paging it in
+	void mark_saved(int index)
+	{
+		_unsaved[index] = false;
+	}
+
+	// Hands every resident chunk with unsaved changes to save_func
+	// and marks them saved. Returns the number of chunks saved.
+	int save_unsaved(std::function<void(glm::ivec3, const int*)> save_func)
+	{
+		int count = 0;
+		for (auto& alloc : _local_index)
+		{
+			if (_unsaved[alloc.mem_index])
+			{
+				glm::ivec3 chunk_coord(floor_div(int(alloc.coord.x), _chunk_size_x),
+					floor_div(int(alloc.coord.y), _chunk_size_y),
+					floor_div(int(alloc.coord.z), _chunk_size_z));
+				save_func(chunk_coord, _block_mirror.data() + chunk_offset(alloc.mem_index));
+				_unsaved[alloc.mem_index] = false;
+				count += 1;
+			}
+		}
+		return count;
+	}
+
+	// Hands every resident chunk to func with its chunk coordinates and
+	// full resolution blocks
+	void for_each_resident(std::function<void(glm::ivec3, const int*)> func) const
+	{
+		for (auto& alloc : _local_index)
+		{
+			glm::ivec3 chunk_coord(floor_div(int(alloc.coord.x), _chunk_size_x),
+				floor_div(int(alloc.coord.y), _chunk_size_y),
+				floor_div(int(alloc.coord.z), _chunk_size_z));
+			func(chunk_coord, _block_mirror.data() + chunk_offset(alloc.mem_index));
+		}
+	}
+
+	// Full resolution blocks of the resident chunk at chunk coordinates
+	// chunk_coord, or nullptr if it isn't resident
+	const int* resident_chunk_data(glm::ivec3 chunk_coord) const
+	{
+		int index = _index_map.get(chunk_coord.x, chunk_coord.y, chunk_coord.z);
+		return index < 0 ? nullptr : chunk_data(index);
+	}
+
+	// Changes a single block in world block coordinates. The edit goes to
+	// the CPU mirror and reaches the GPU on the next flush_edits().
+	// Returns false if the block's chunk isn't resident.
+	bool set_block(int x, int y, int z, int type)
+	{
+		int chunk_x = floor_div(x, _chunk_size_x);
+		int chunk_y = floor_div(y, _chunk_size_y);
+		int chunk_z = floor_div(z, _chunk_size_z);
+		int index = _index_map.get(chunk_x, chunk_y, chunk_z);
+		if (index < 0)
+		{
+			return false;
+		}
+		glm::ivec3 local(x - chunk_x * _chunk_size_x,
+			y - chunk_y * _chunk_size_y,
+			z - chunk_z * _chunk_size_z);
+		int block_index = chunk_offset(index) + lod_block_index(0, local);
+		if (_block_mirror[block_index] != type)
+		{
+			_block_mirror[block_index] = type;
+			_unsaved[index] = true;
+			_dirty_blocks.push_back(block_index);
+
+			// Walk up the LOD levels until a cell's vote doesn't change
+			for (int level = 1; level <= _lod_levels; ++level)
+			{
+				glm::ivec3 cell = local >> level;
+				int cell_index = update_lod_cell(index, level, cell.x, cell.y, cell.z);
+				if (cell_index < 0)
+				{
+					break;
+				}
+				_dirty_blocks.push_back(cell_index);
+			}
+		}
+		return true;
+	}
+
+	// Sets every block from min_corner to max_corner inclusive. Blocks in
+	// chunks that aren't resident are skipped. Returns the number set.
+	int fill_region(glm::ivec3 min_corner, glm::ivec3 max_corner, int type)
+	{
+		int count = 0;
+		for (int z = min_corner.z; z <= max_corner.z; ++z)
+		{
+			for (int y = min_corner.y; y <= max_corner.y; ++y)
+			{
+				for (int x = min_corner.x; x <= max_corner.x; ++x)
+				{
+					count += int(set_block(x, y, z, type));
+				}
+			}
+		}
+		return count;
+	}
+
+	int get_block(int x, int y, int z) const
+	{
+		int chunk_x = floor_div(x, _chunk_size_x);
+		int chunk_y = floor_div(y, _chunk_size_y);
+		int chunk_z = floor_div(z, _chunk_size_z);
+		int index = _index_map.get(chunk_x, chunk_y, chunk_z);
+		if (index < 0)
+		{
+			return -1;
+		}
+		return _block_mirror[chunk_offset(index) +
+			(x - chunk_x * _chunk_size_x) +
+			(y - chunk_y * _chunk_size_y) * _chunk_size_x +
+			(z - chunk_z * _chunk_size_z) * _chunk_size_x * _chunk_size_y];
+	}
+
+	// Uploads all edits since the last flush. Nearby dirty blocks are
+	// coalesced so each run costs one glBufferSubData. Returns the
+	// number of ranges uploaded.
+	int flush_edits(int merge_gap = default_edit_merge_gap)
+	{
+		if (!_dirty_blocks.size())
+		{
+			return 0;
+		}
+		std::sort(_dirty_blocks.begin(), _dirty_blocks.end());
+		int range_count = 0;
+		int start = _dirty_blocks[0];
+		int end = start;
+		for (int i = 1; i <= _dirty_blocks.size(); ++i)
+		{
+			if (i < _dirty_blocks.size() && _dirty_blocks[i] - end <= merge_gap)
+			{
+				end = _dirty_blocks[i];
+				continue;
+			}
+			_chunk_buffer->set_data(start, _block_mirror.data() + start, end - start + 1);
+			range_count += 1;
+			if (i < _dirty_blocks.size())
+			{
+				start = _dirty_blocks[i];
+				end = start;
+			}
+		}
+		_dirty_blocks.clear();
+		return range_count;
+	}
+
+	// Claims memory and a map slot for the chunk at x/y/z without
+	// uploading any blocks. Returns the memory index, -1 if the buffer
+	// is full or -2 if the chunk is outside the map window.
+	int reserve_chunk(int x, int y, int z)
+	{
+		int chunk_coord_x = floor_div(x, _chunk_size_x);
+		int chunk_coord_y = floor_div(y, _chunk_size_y);
+		int chunk_coord_z = floor_div(z, _chunk_size_z);
+		if (!_index_map.in_window(_ref_x, _ref_y, _ref_z, chunk_coord_x, chunk_coord_y, chunk_coord_z))
+		{
+			return -2;
+		}
+
+		// Re-adding a resident chunk overwrites it in place
+		int index = _index_map.get(chunk_coord_x, chunk_coord_y, chunk_coord_z);
+		if (index < 0)
+		{
+			index = get_free_index();
+			if (index < 0 || index >= _max_chunks)
+			{
+				return -1;
+			}
+			chunk_alloc new_alloc;
+			new_alloc.coord = glm::vec4(x, y, z, 0.0);
+			new_alloc.mem_index = index;
+			_local_index.push_back(new_alloc);
+			std::sort(_local_index.begin(), _local_index.end(), cmp);
+			_index_buffer->set_data(0, _local_index);
+		}
+
 		GLint new_index = _index_map.set(_ref_x, _ref_y, _ref_z, chunk_coord_x, chunk_coord_y, chunk_coord_z, index);
 		_spatial_chunk_buffer->set_data(new_index, index);
-		//std::vector<GLint> test_vec;
-		//_spatial_chunk_buffer->get_data(0, 2 * 2 * 2, test_vec);
-		//printf("TEST\n");
+		return index;
+	}
+
+	// True if the chunk at world block coordinates x/y/z is inside the
+	// map window, so reserve_chunk() can place it
+	bool in_window(int x, int y, int z) const
+	{
+		return _index_map.in_window(_ref_x, _ref_y, _ref_z,
+			floor_div(x, _chunk_size_x),
+			floor_div(y, _chunk_size_y),
+			floor_div(z, _chunk_size_z));
 	}
 
+	bool is_resident(int x, int y, int z) const
+	{
+		return _index_map.get(floor_div(x, _chunk_size_x),
+			floor_div(y, _chunk_size_y),
+			floor_div(z, _chunk_size_z)) >= 0;
+	}
+
+	// Finds the resident chunk farthest from pos. Returns false if
+	// nothing is resident.
+	bool farthest_chunk(glm::vec3 pos, glm::vec4& out_coord, float& out_dist) const
+	{
+		glm::vec3 half_chunk = glm::vec3(_chunk_size_x, _chunk_size_y, _chunk_size_z) / 2.0f;
+		out_dist = -1;
+		for (auto& alloc : _local_index)
+		{
+			float dist = glm::length(glm::vec3(alloc.coord) + half_chunk - pos);
+			if (dist > out_dist)
+			{
+				out_dist = dist;
+				out_coord = alloc.coord;
+			}
+		}
+		return out_dist >= 0;
+	}
+
+	// Offset in blocks of a chunk's data in the chunk buffer
+	int chunk_offset(int index) const
+	{
+		return _chunk_stride * index;
+	}
+
+	// Full resolution blocks per chunk
+	int chunk_block_count() const
+	{
+		return _chunk_block_count;
+	}
+
+	// Ints per chunk in the chunk buffer, including LOD levels
+	int chunk_stride() const
+	{
+		return _chunk_stride;
+	}
+
+	int lod_levels() const
+	{
+		return _lod_levels;
+	}
+
+	int resident_count() const
+	{
+		return _local_index.size();
+	}
 
 	void remove_chunk(int x, int y, int z)
 	{
@@ -81,6 +414,16 @@ public:
 		{
 			if (glm::length(_local_index[i].coord - coord) < 0.1)
 			{
+				glm::ivec3 chunk_coord(floor_div(x, _chunk_size_x),
+					floor_div(y, _chunk_size_y),
+					floor_div(z, _chunk_size_z));
+				int slot = _index_map.slot(chunk_coord.x, chunk_coord.y, chunk_coord.z);
+				save_before_evict(_local_index[i].mem_index, chunk_coord);
+				if (_index_map._data[slot] == _local_index[i].mem_index)
+				{
+					_index_map.clear(slot);
+					_spatial_chunk_buffer->set_data(slot, -1);
+				}
 				_local_index.erase(_local_index.begin() + i);
 				_index_buffer->set_data(0, _local_index);
 				return;
@@ -113,17 +456,149 @@ public:
 		return _max_chunks;
 	}
 
-	void set_ref(glm::vec3 in_ref)
+	// Slides the map window so it is centered on in_ref. Chunks in the
+	// slab that leaves the window are evicted, and the chunk coordinates
+	// of the newly exposed slab are returned so the caller can load them.
+	std::vector<glm::ivec3> set_ref(glm::vec3 in_ref)
+	{
+		glm::ivec3 map_size = _index_map.size();
+		int new_ref_x = int(floor(in_ref.x / _chunk_size_x)) - map_size.x / 2;
+		int new_ref_y = int(floor(in_ref.y / _chunk_size_y)) - map_size.y / 2;
+		int new_ref_z = int(floor(in_ref.z / _chunk_size_z)) - map_size.z / 2;
+
+		std::vector<glm::ivec3> exposed;
+		if (new_ref_x == _ref_x && new_ref_y == _ref_y && new_ref_z == _ref_z)
+		{
+			return exposed;
+		}
+
+		bool evicted = false;
+		for (int z = new_ref_z; z < new_ref_z + map_size.z; ++z)
+		{
+			for (int y = new_ref_y; y < new_ref_y + map_size.y; ++y)
+			{
+				for (int x = new_ref_x; x < new_ref_x + map_size.x; ++x)
+				{
+					if (_index_map.in_window(_ref_x, _ref_y, _ref_z, x, y, z))
+					{
+						continue;
+					}
+					exposed.push_back(glm::ivec3(x, y, z));
+
+					// Whatever held this slot has wrapped out of the window
+					int slot = _index_map.slot(x, y, z);
+					if (_index_map._data[slot] >= 0)
+					{
+						evict_slot(slot);
+						evicted = true;
+					}
+				}
+			}
+		}
+		if (evicted)
+		{
+			_index_buffer->set_data(0, _local_index);
+		}
+
+		_ref_x = new_ref_x;
+		_ref_y = new_ref_y;
+		_ref_z = new_ref_z;
+		return exposed;
+	}
+
+	// Lowest chunk coordinate covered by the map window
+	glm::ivec3 get_ref() const
 	{
-		_ref_x = floor(in_ref.x / _chunk_size_x);
-		_ref_y = floor(in_ref.y / _chunk_size_y);
-		_ref_z = floor(in_ref.z / _chunk_size_z);
+		return glm::ivec3(_ref_x, _ref_y, _ref_z);
 	}
 
 	ChunkIndexMap _index_map;
 
 private:
 
+	// Chunk coordinate of the resident chunk at memory index
+	glm::ivec3 chunk_coord(int index) const
+	{
+		for (auto& alloc : _local_index)
+		{
+			if (alloc.mem_index == index)
+			{
+				return glm::ivec3(floor_div(int(alloc.coord.x), _chunk_size_x),
+					floor_div(int(alloc.coord.y), _chunk_size_y),
+					floor_div(int(alloc.coord.z), _chunk_size_z));
+			}
+		}
+		return glm::ivec3(0);
+	}
+
+	void save_before_evict(int mem_index, glm::ivec3 chunk_coord)
+	{
+		if (_unsaved[mem_index] && _evict_callback)
+		{
+			_evict_callback(chunk_coord, _block_mirror.data() + chunk_offset(mem_index));
+		}
+		_unsaved[mem_index] = false;
+	}
+
+	glm::ivec3 lod_size(int level) const
+	{
+		return glm::ivec3(_chunk_size_x, _chunk_size_y, _chunk_size_z) >> level;
+	}
+
+	int lod_block_count(int level) const
+	{
+		glm::ivec3 dims = lod_size(level);
+		return dims.x * dims.y * dims.z;
+	}
+
+	// Index of a cell within a chunk's data, level 0 being full resolution
+	int lod_block_index(int level, glm::ivec3 cell) const
+	{
+		int offset = 0;
+		for (int i = 0; i < level; ++i)
+		{
+			offset += lod_block_count(i);
+		}
+		glm::ivec3 dims = lod_size(level);
+		return offset + cell.x + cell.y * dims.x + cell.z * dims.x * dims.y;
+	}
+
+	// Recomputes one LOD cell from the 8 cells under it. Returns the
+	// cell's index in the chunk buffer if it changed, otherwise -1.
+	int update_lod_cell(int index, int level, int x, int y, int z)
+	{
+		int types[8];
+		for (int i = 0; i < 8; ++i)
+		{
+			glm::ivec3 child(2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2));
+			types[i] = _block_mirror[chunk_offset(index) + lod_block_index(level - 1, child)];
+		}
+		int cell_index = chunk_offset(index) + lod_block_index(level, glm::ivec3(x, y, z));
+		int type = majority_block(types);
+		if (_block_mirror[cell_index] == type)
+		{
+			return -1;
+		}
+		_block_mirror[cell_index] = type;
+		return cell_index;
+	}
+
+	void evict_slot(int slot)
+	{
+		int mem_index = _index_map._data[slot];
+		save_before_evict(mem_index, _index_map.coord(slot));
+		for (int i = 0; i < _local_index.size(); ++i)
+		{
+			if (_local_index[i].mem_index == mem_index)
+			{
+				_local_index.erase(_local_index.begin() + i);
+				break;
+			}
+		}
+		_index_map.clear(slot);
+		_spatial_chunk_buffer->set_data(slot, -1);
+	}
+
 	int get_free_index()
 	{
 		//if (_local_index.size() > 1)
@@ -156,7 +631,14 @@ private:
 	int _ref_y;
 	int _ref_z;
 	int _chunk_block_count;
+	int _chunk_stride;
+	int _lod_levels;
 	std::vector<chunk_alloc> _local_index;
+	std::vector<int> _block_mirror;
+	std::vector<int> _dirty_blocks;
+	std::vector<bool> _unsaved;
+	std::function<void(glm::ivec3, const int*)> _evict_callback;
+	std::function<void(glm::ivec3, const int*)> _load_callback;
 	std::shared_ptr<graphics::Buffer<int>> _chunk_buffer;
 	std::shared_ptr<graphics::Buffer<GLint>> _spatial_chunk_buffer;
 	std::shared_ptr<graphics::Buffer<chunk_alloc>> _index_buffer;
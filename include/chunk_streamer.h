@@ -0,0 +1,209 @@
+#pragma once
+#ifndef CHUNK_STREAMER_H_
+#define CHUNK_STREAMER_H_
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "chunk_memory.h"
+#include "staging_ring.h"
+
+const size_t default_staging_ring_size = 16 * 1024 * 1024;
+const size_t default_frame_upload_budget = 4 * 1024 * 1024;
+
+// Residency manager for chunk data. Chunks can be requested from any
+// thread; the render thread calls update() once per frame, which uploads
+// the closest pending chunks through a staging ring up to a byte budget
+// and evicts the farthest resident chunks when the chunk buffer is full.
+class ChunkStreamer
+{
+public:
+	ChunkStreamer(ChunkBufferManager& manager,
+		size_t staging_size = default_staging_ring_size,
+		size_t frame_budget = default_frame_upload_budget) :
+		_manager(manager),
+		_staging(staging_size),
+		_frame_budget(frame_budget),
+		_focus(0)
+	{
+
+	}
+
+	// Thread safe. A later request for the same chunk replaces an
+	// earlier one that hasn't been uploaded yet. from_disk marks the
+	// blocks as already matching their saved copy.
+	void request_chunk(int x, int y, int z, std::vector<int>&& blocks, bool from_disk=false)
+	{
+		std::lock_guard<std::mutex> lock(_request_mutex);
+		_requests[std::make_tuple(x, y, z)] = { std::move(blocks), from_disk };
+	}
+
+	// Thread safe. Position distances are measured from.
+	void set_focus(glm::vec3 pos)
+	{
+		std::lock_guard<std::mutex> lock(_request_mutex);
+		_focus = pos;
+	}
+
+	size_t pending_count()
+	{
+		std::lock_guard<std::mutex> lock(_request_mutex);
+		return _requests.size() + _queue.size();
+	}
+
+	void set_frame_budget(size_t bytes)
+	{
+		_frame_budget = bytes;
+	}
+
+	// Render thread only. Returns the number of chunks uploaded.
+	int update()
+	{
+		glm::vec3 focus;
+		{
+			std::lock_guard<std::mutex> lock(_request_mutex);
+			for (auto& request : _requests)
+			{
+				_queue.push_back({ std::get<0>(request.first),
+					std::get<1>(request.first),
+					std::get<2>(request.first),
+					std::move(request.second.first),
+					request.second.second });
+			}
+			_requests.clear();
+			focus = _focus;
+		}
+		if (!_queue.size())
+		{
+			return 0;
+		}
+
+		// Drop queued requests that have been superseded by a newer one
+		std::stable_sort(_queue.begin(), _queue.end(),
+			[](const ChunkRequest& a, const ChunkRequest& b) { return a.key() < b.key(); });
+		for (int i = int(_queue.size()) - 2; i >= 0; --i)
+		{
+			if (_queue[i].key() == _queue[i + 1].key())
+			{
+				_queue.erase(_queue.begin() + i);
+			}
+		}
+
+		// Closest first
+		glm::vec3 half_chunk = glm::vec3(_manager.get_chunk_size()[0],
+			_manager.get_chunk_size()[1],
+			_manager.get_chunk_size()[2]) / 2.0f;
+		for (auto& request : _queue)
+		{
+			request.dist = glm::length(glm::vec3(request.x, request.y, request.z) + half_chunk - focus);
+		}
+		std::sort(_queue.begin(), _queue.end(),
+			[](const ChunkRequest& a, const ChunkRequest& b) { return a.dist < b.dist; });
+
+		size_t chunk_bytes = sizeof(int) * _manager.chunk_stride();
+		size_t budget = _frame_budget;
+		int uploaded = 0;
+		// Requests that can't be placed yet stay queued and are sorted
+		// again on later frames. Only chunks outside the map window are
+		// dropped.
+		std::vector<ChunkRequest> deferred;
+		int next = 0;
+		for (; next < _queue.size(); ++next)
+		{
+			ChunkRequest& request = _queue[next];
+			if (!_manager.in_window(request.x, request.y, request.z))
+			{
+				continue;
+			}
+			// Chunks too big for the ring go through a plain buffer update
+			bool direct = chunk_bytes > _staging.capacity();
+			if ((uploaded && chunk_bytes > budget) ||
+				(!direct && !_staging.fits(chunk_bytes)))
+			{
+				break;
+			}
+			if (!_manager.is_resident(request.x, request.y, request.z) &&
+				_manager.resident_count() >= _manager.get_max_chunks())
+			{
+				// Only make room if the request is closer than what it replaces
+				glm::vec4 far_coord;
+				float far_dist;
+				if (!_manager.farthest_chunk(focus, far_coord, far_dist) || far_dist <= request.dist)
+				{
+					deferred.push_back(std::move(request));
+					continue;
+				}
+				_manager.remove_chunk(far_coord.x, far_coord.y, far_coord.z);
+			}
+			int index = _manager.reserve_chunk(request.x, request.y, request.z);
+			if (index < 0)
+			{
+				// No free memory index, try again later
+				deferred.push_back(std::move(request));
+				continue;
+			}
+			_manager.mirror_chunk(index, request.blocks);
+			if (request.from_disk)
+			{
+				_manager.mark_saved(index);
+			}
+			if (direct)
+			{
+				_manager.get_chunk_buffer()->set_data(_manager.chunk_offset(index),
+					_manager.chunk_data(index),
+					_manager.chunk_stride());
+			}
+			else if (!_staging.upload(_manager.get_chunk_buffer()->get_buffer_name(),
+				sizeof(int) * _manager.chunk_offset(index),
+				_manager.chunk_data(index),
+				chunk_bytes))
+			{
+				// fits() said there was room. The chunk is already reserved and
+				// mirrored, so it must not be left without its data on the GPU.
+				_manager.get_chunk_buffer()->set_data(_manager.chunk_offset(index),
+					_manager.chunk_data(index),
+					_manager.chunk_stride());
+			}
+			budget -= std::min(budget, chunk_bytes);
+			uploaded += 1;
+		}
+		// What the budget didn't reach waits for the next frame
+		deferred.insert(deferred.end(), std::make_move_iterator(_queue.begin() + next),
+			std::make_move_iterator(_queue.end()));
+		_queue = std::move(deferred);
+		_staging.fence();
+		return uploaded;
+	}
+
+private:
+	struct ChunkRequest
+	{
+		int x;
+		int y;
+		int z;
+		std::vector<int> blocks;
+		bool from_disk;
+		float dist;
+
+		std::tuple<int, int, int> key() const
+		{
+			return std::make_tuple(x, y, z);
+		}
+	};
+
+	ChunkBufferManager& _manager;
+	graphics::StagingRing _staging;
+	size_t _frame_budget;
+	std::mutex _request_mutex;
+	std::map<std::tuple<int, int, int>, std::pair<std::vector<int>, bool>> _requests;
+	std::vector<ChunkRequest> _queue;
+	glm::vec3 _focus;
+};
+
+#endif  // CHUNK_STREAMER_H_
@@ -0,0 +1,124 @@
+#pragma once
+#ifndef GRAPHICS_FRAME_SYNC_H_
+#define GRAPHICS_FRAME_SYNC_H_
+
+#include <vector>
+
+#include "gl_includes.h"
+
+namespace graphics
+{
+
+// Frames the CPU may queue before it waits on the GPU
+const int default_frames_in_flight = 2;
+
+// Lets the CPU run up to frames_in_flight frames ahead of the GPU. Each
+// frame ends with a fence; begin_frame() waits on the fence of the frame
+// that last used the same slot, so a resource kept per slot is never
+// touched while a frame using it is still running.
+class FrameSync
+{
+public:
+	FrameSync(int frames_in_flight = default_frames_in_flight) :
+		_fences(frames_in_flight, nullptr),
+		_frame(0)
+	{
+	}
+
+	~FrameSync()
+	{
+		for (auto fence : _fences)
+		{
+			if (fence)
+			{
+				glDeleteSync(fence);
+			}
+		}
+	}
+
+	FrameSync(const FrameSync&) = delete;
+	FrameSync& operator=(const FrameSync&) = delete;
+
+	// Returns the slot of the new frame
+	int begin_frame()
+	{
+		wait(slot());
+		return slot();
+	}
+
+	void end_frame()
+	{
+		_fences[slot()] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		_frame += 1;
+	}
+
+	// Waits for every frame in flight, for CPU work on memory the GPU
+	// writes every frame
+	void wait_all()
+	{
+		for (int i = 0; i < int(_fences.size()); ++i)
+		{
+			wait(i);
+		}
+	}
+
+	// Whether frame has finished on the GPU, without waiting. Frames are
+	// numbered from 0 by begin_frame(); the current one hasn't finished.
+	bool finished(int frame)
+	{
+		if (frame < 0 || frame < _frame - frames_in_flight())
+		{
+			return true;
+		}
+		if (frame >= _frame)
+		{
+			return false;
+		}
+		GLsync fence = _fences[frame % _fences.size()];
+		if (!fence)
+		{
+			return true;
+		}
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+	}
+
+	int frame() const
+	{
+		return _frame;
+	}
+
+	int slot() const
+	{
+		return _frame % _fences.size();
+	}
+
+	int frames_in_flight() const
+	{
+		return _fences.size();
+	}
+
+private:
+	void wait(int index)
+	{
+		if (!_fences[index])
+		{
+			return;
+		}
+		// Only the first wait needs to flush the fence to the GPU
+		GLenum status = glClientWaitSync(_fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (status == GL_TIMEOUT_EXPIRED)
+		{
+			status = glClientWaitSync(_fences[index], 0, 1000000);
+		}
+		glDeleteSync(_fences[index]);
+		_fences[index] = nullptr;
+	}
+
+	std::vector<GLsync> _fences;
+	int _frame;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_FRAME_SYNC_H_
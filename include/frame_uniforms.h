@@ -0,0 +1,19 @@
+#pragma once
+#ifndef GRAPHICS_FRAME_UNIFORMS_H_
+#define GRAPHICS_FRAME_UNIFORMS_H_
+
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+// Shared with the shaders, like octree_node.h
+#include "../shaders/frame_uniforms.glsl"
+
+static_assert(offsetof(FrameUniforms, chunk_map_origin) == 144, "FrameUniforms must match its std140 layout");
+static_assert(offsetof(FrameUniforms, render_size) == 160, "FrameUniforms must match its std140 layout");
+static_assert(offsetof(FrameUniforms, prev_render_size) == 176, "FrameUniforms must match its std140 layout");
+static_assert(offsetof(FrameUniforms, ttime) == 192, "FrameUniforms must match its std140 layout");
+static_assert(offsetof(FrameUniforms, max_bounces) == 200, "FrameUniforms must match its std140 layout");
+static_assert(sizeof(FrameUniforms) == 224, "FrameUniforms must match its std140 layout");
+
+#endif  // GRAPHICS_FRAME_UNIFORMS_H_
\ No newline at end of file
@@ -0,0 +1,308 @@
+#pragma once
+#ifndef GRAPHICS_GPU_TIMER_H_
+#define GRAPHICS_GPU_TIMER_H_
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gl_includes.h"
+
+namespace graphics
+{
+
+// Frames a timer's queries stay in flight before they are reused
+const int gpu_timer_latency = 3;
+// Measurements a timer keeps for its statistics
+const int gpu_timer_history = 256;
+
+struct GpuTimerStats
+{
+	int samples;
+	double last_ms;
+	double min_ms;
+	double avg_ms;
+	double p99_ms;
+};
+
+// GPU time between start() and stop() from a pair of timestamp
+// queries. Results are picked up a few frames late so reading them
+// never stalls the pipeline. Timestamps rather than GL_TIME_ELAPSED so
+// timers can nest.
+class GpuTimer
+{
+public:
+	GpuTimer() :
+		_frame(0),
+		_last_ms(0),
+		_history_next(0),
+		_dropped(0)
+	{
+		glGenQueries(2 * gpu_timer_latency, _queries);
+		for (int i = 0; i < gpu_timer_latency; ++i)
+		{
+			_pending[i] = false;
+		}
+	}
+
+	~GpuTimer()
+	{
+		glDeleteQueries(2 * gpu_timer_latency, _queries);
+	}
+
+	GpuTimer(const GpuTimer&) = delete;
+	GpuTimer& operator=(const GpuTimer&) = delete;
+
+	void start()
+	{
+		collect();
+		// Still not back after a full ring; the GPU is far behind, so give
+		// up on that measurement rather than wait for it
+		if (_pending[slot()])
+		{
+			_pending[slot()] = false;
+			_dropped += 1;
+		}
+		glQueryCounter(_queries[2 * slot()], GL_TIMESTAMP);
+	}
+
+	void stop()
+	{
+		glQueryCounter(_queries[2 * slot() + 1], GL_TIMESTAMP);
+		_pending[slot()] = true;
+		_frame += 1;
+	}
+
+	// Most recent finished measurement in milliseconds
+	double last_ms()
+	{
+		collect();
+		return _last_ms;
+	}
+
+	// Over the last gpu_timer_history finished measurements
+	GpuTimerStats stats()
+	{
+		collect();
+		GpuTimerStats result = { int(_history.size()), _last_ms, 0, 0, 0 };
+		if (_history.empty())
+		{
+			return result;
+		}
+		std::vector<double> sorted = _history;
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0;
+		for (double ms : sorted)
+		{
+			sum += ms;
+		}
+		result.min_ms = sorted.front();
+		result.avg_ms = sum / sorted.size();
+		result.p99_ms = sorted[std::min(sorted.size() - 1, size_t(0.99 * sorted.size()))];
+		return result;
+	}
+
+	// Measurements given up on because the GPU fell a whole ring behind
+	int dropped() const
+	{
+		return _dropped;
+	}
+
+	void reset_stats()
+	{
+		_history.clear();
+		_history_next = 0;
+		_dropped = 0;
+	}
+
+private:
+	int slot() const
+	{
+		return _frame % gpu_timer_latency;
+	}
+
+	// Reads back finished queries, oldest first
+	void collect()
+	{
+		for (int i = 0; i < gpu_timer_latency; ++i)
+		{
+			int index = (_frame + i) % gpu_timer_latency;
+			if (!_pending[index])
+			{
+				continue;
+			}
+			GLint available = 0;
+			glGetQueryObjectiv(_queries[2 * index + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+			{
+				continue;
+			}
+			GLuint64 start_time;
+			GLuint64 stop_time;
+			glGetQueryObjectui64v(_queries[2 * index], GL_QUERY_RESULT, &start_time);
+			glGetQueryObjectui64v(_queries[2 * index + 1], GL_QUERY_RESULT, &stop_time);
+			_last_ms = (stop_time - start_time) / 1.0e6;
+			_pending[index] = false;
+			record(_last_ms);
+		}
+	}
+
+	void record(double ms)
+	{
+		if (_history.size() < gpu_timer_history)
+		{
+			_history.push_back(ms);
+			return;
+		}
+		_history[_history_next] = ms;
+		_history_next = (_history_next + 1) % gpu_timer_history;
+	}
+
+	GLuint _queries[2 * gpu_timer_latency];
+	bool _pending[gpu_timer_latency];
+	int _frame;
+	double _last_ms;
+	std::vector<double> _history;
+	int _history_next;
+	int _dropped;
+};
+
+// Named GpuTimers for the passes of a frame. Passes are created on
+// their first begin() and listed in that order.
+class GpuProfiler
+{
+public:
+	GpuProfiler() :
+		_enabled(true)
+	{
+	}
+
+	GpuProfiler(const GpuProfiler&) = delete;
+	GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+	void begin(const std::string& pass)
+	{
+		if (_enabled)
+		{
+			timer(pass).start();
+		}
+	}
+
+	void end(const std::string& pass)
+	{
+		if (_enabled)
+		{
+			timer(pass).stop();
+		}
+	}
+
+	// Stops issuing queries. Measurements already in flight are still
+	// collected.
+	void set_enabled(bool enabled)
+	{
+		_enabled = enabled;
+	}
+
+	bool enabled() const
+	{
+		return _enabled;
+	}
+
+	const std::vector<std::string>& passes() const
+	{
+		return _passes;
+	}
+
+	// 0 until a measurement of pass is available
+	double last_ms(const std::string& pass)
+	{
+		auto found = _timers.find(pass);
+		if (found == _timers.end())
+		{
+			return 0;
+		}
+		return found->second.last_ms();
+	}
+
+	GpuTimerStats stats(const std::string& pass)
+	{
+		auto found = _timers.find(pass);
+		if (found == _timers.end())
+		{
+			return GpuTimerStats{ 0, 0, 0, 0, 0 };
+		}
+		return found->second.stats();
+	}
+
+	void reset_stats()
+	{
+		for (auto& timer : _timers)
+		{
+			timer.second.reset_stats();
+		}
+	}
+
+	// One line per pass, in milliseconds
+	bool write_csv(const std::string& path)
+	{
+		std::ofstream file(path);
+		if (!file)
+		{
+			return false;
+		}
+		file << "pass,samples,dropped,last_ms,min_ms,avg_ms,p99_ms\n";
+		for (auto& pass : _passes)
+		{
+			GpuTimerStats s = stats(pass);
+			file << pass << "," << s.samples << "," << _timers.at(pass).dropped() << "," <<
+				s.last_ms << "," << s.min_ms << "," << s.avg_ms << "," << s.p99_ms << "\n";
+		}
+		return bool(file);
+	}
+
+	// {"passes": [{"name": ..., "samples": ..., ...}, ...]}
+	bool write_json(const std::string& path)
+	{
+		std::ofstream file(path);
+		if (!file)
+		{
+			return false;
+		}
+		file << "{\n  \"passes\": [";
+		for (size_t i = 0; i < _passes.size(); ++i)
+		{
+			GpuTimerStats s = stats(_passes[i]);
+			file << (i ? "," : "") << "\n    {\"name\": \"" << _passes[i] << "\"" <<
+				", \"samples\": " << s.samples <<
+				", \"dropped\": " << _timers.at(_passes[i]).dropped() <<
+				", \"last_ms\": " << s.last_ms <<
+				", \"min_ms\": " << s.min_ms <<
+				", \"avg_ms\": " << s.avg_ms <<
+				", \"p99_ms\": " << s.p99_ms << "}";
+		}
+		file << "\n  ]\n}\n";
+		return bool(file);
+	}
+
+private:
+	GpuTimer& timer(const std::string& pass)
+	{
+		auto found = _timers.find(pass);
+		if (found != _timers.end())
+		{
+			return found->second;
+		}
+		_passes.push_back(pass);
+		return _timers[pass];
+	}
+
+	bool _enabled;
+	std::map<std::string, GpuTimer> _timers;
+	std::vector<std::string> _passes;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_GPU_TIMER_H_
@@ -0,0 +1,76 @@
+#pragma once
+#ifndef LIGHT_CACHE_FILE_H_
+#define LIGHT_CACHE_FILE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "octree_node.h"
+
+const char light_cache_magic[4] = { 'U', 'G', 'L', 'C' };
+const uint32_t light_cache_version = 1;
+
+// On disk layout of a light cache file:
+//   LightCacheHeader
+//   LightCacheChunk[chunk_count]   chunks resident when it was saved
+//   OctreeNode[node_count]         the light octree's node buffer
+struct LightCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t world_id;  // chosen by the application, a cache only loads into the same world
+	uint32_t node_bytes;
+	int32_t node_count;
+	int32_t chunk_size[3];
+	int32_t chunk_count;
+};
+
+// The light around a chunk is only trusted while its blocks still hash
+// to the saved value
+struct LightCacheChunk
+{
+	int32_t coord[3];
+	uint32_t hash;
+};
+
+// FNV-1a over a chunk's blocks
+inline uint32_t chunk_content_hash(const int* blocks, int count)
+{
+	uint32_t hash = 2166136261u;
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(blocks);
+	for (size_t i = 0; i < sizeof(int) * count; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+inline bool write_light_cache(const std::string& path, uint64_t world_id, const int* chunk_size,
+	const std::vector<LightCacheChunk>& chunks, const OctreeNode* nodes, int node_count)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+	LightCacheHeader header;
+	memcpy(header.magic, light_cache_magic, 4);
+	header.version = light_cache_version;
+	header.world_id = world_id;
+	header.node_bytes = sizeof(OctreeNode);
+	header.node_count = node_count;
+	for (int i = 0; i < 3; ++i)
+	{
+		header.chunk_size[i] = chunk_size[i];
+	}
+	header.chunk_count = int32_t(chunks.size());
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(chunks.data()), sizeof(LightCacheChunk) * chunks.size());
+	file.write(reinterpret_cast<const char*>(nodes), sizeof(OctreeNode) * node_count);
+	return bool(file);
+}
+
+#endif  // LIGHT_CACHE_FILE_H_
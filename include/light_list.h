@@ -0,0 +1,191 @@
+#pragma once
+#ifndef GRAPHICS_LIGHT_LIST_H_
+#define GRAPHICS_LIGHT_LIST_H_
+
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl_includes.h"
+#include "buffer.h"
+
+#include "../shaders/light_source.glsl"
+
+static_assert(sizeof(LightSource) == LIGHT_SOURCE_BYTES, "LightSource must match its std430 layout");
+
+// Block type that glows, and the light each such block gives off
+const int emissive_block_type = 21;
+const glm::vec3 default_emissive_color(1.0f, 0.85f, 0.6f);
+const float default_emissive_intensity = 20.0f;
+// Shadow rays towards an emissive block stop this far from its center,
+// half its diagonal, so they never hit the block itself
+const float emissive_block_radius = 0.87f;
+
+// Lights for shading, in one SSBO: lights added from the CPU and one per
+// emissive block of each resident chunk. Rebuilt and uploaded only when
+// something changed.
+class LightList
+{
+public:
+    LightList() :
+        _buf(std::make_shared<graphics::Buffer<LightSource>>(GL_SHADER_STORAGE_BUFFER)),
+        _emissive_color(default_emissive_color),
+        _emissive_intensity(default_emissive_intensity),
+        _next_id(0),
+        _count(0),
+        _dirty(true)
+    {
+    }
+
+    // Point light; radius > 0 makes shadow rays stop that far short of
+    // it. Returns an id for remove_light().
+    int add_light(glm::vec3 position, glm::vec3 color, float intensity, float radius = 0)
+    {
+        _lights[_next_id] = LightSource{ glm::vec4(position, radius), glm::vec4(color, intensity), glm::vec4(0) };
+        _dirty = true;
+        return _next_id++;
+    }
+
+    bool remove_light(int id)
+    {
+        _dirty = true;
+        return _lights.erase(id) > 0;
+    }
+
+    void clear_lights()
+    {
+        _lights.clear();
+        _dirty = true;
+    }
+
+    void set_emissive_light(glm::vec3 color, float intensity)
+    {
+        _emissive_color = color;
+        _emissive_intensity = intensity;
+        _dirty = true;
+    }
+
+    // Replaces the emissive blocks of a chunk, by block center
+    void set_chunk_emitters(glm::ivec3 chunk_coord, std::vector<glm::vec3>&& centers)
+    {
+        auto key = std::make_tuple(chunk_coord.x, chunk_coord.y, chunk_coord.z);
+        auto found = _emitters.find(key);
+        if (centers.empty())
+        {
+            if (found != _emitters.end())
+            {
+                _emitters.erase(found);
+                _dirty = true;
+            }
+            return;
+        }
+        _emitters[key] = std::move(centers);
+        _dirty = true;
+    }
+
+    // Adds or removes a single emissive block after an edit
+    void set_emitter(glm::ivec3 chunk_coord, glm::vec3 center, bool emissive)
+    {
+        auto key = std::make_tuple(chunk_coord.x, chunk_coord.y, chunk_coord.z);
+        std::vector<glm::vec3>& centers = _emitters[key];
+        for (size_t i = 0; i < centers.size(); ++i)
+        {
+            if (centers[i] == center)
+            {
+                if (!emissive)
+                {
+                    centers.erase(centers.begin() + i);
+                    _dirty = true;
+                }
+                return;
+            }
+        }
+        if (emissive)
+        {
+            centers.push_back(center);
+            _dirty = true;
+        }
+    }
+
+    // Drops the emitters of every chunk is_resident(chunk_coord) says
+    // is gone
+    template <class F>
+    void remove_unloaded_chunks(F is_resident)
+    {
+        for (auto it = _emitters.begin(); it != _emitters.end();)
+        {
+            glm::ivec3 chunk_coord(std::get<0>(it->first), std::get<1>(it->first), std::get<2>(it->first));
+            if (it->second.empty() || !is_resident(chunk_coord))
+            {
+                _dirty = _dirty || !it->second.empty();
+                it = _emitters.erase(it);
+                continue;
+            }
+            ++it;
+        }
+    }
+
+    // Rebuilds the buffer if anything changed. Returns true if it did.
+    bool upload()
+    {
+        if (!_dirty)
+        {
+            return false;
+        }
+        _dirty = false;
+        std::vector<LightSource> lights;
+        for (auto& light : _lights)
+        {
+            lights.push_back(light.second);
+        }
+        for (auto& chunk : _emitters)
+        {
+            for (auto& center : chunk.second)
+            {
+                lights.push_back(LightSource{ glm::vec4(center, emissive_block_radius),
+                    glm::vec4(_emissive_color, _emissive_intensity), glm::vec4(0) });
+            }
+        }
+        float power_sum = 0;
+        for (auto& light : lights)
+        {
+            power_sum += light.color.w;
+            light.power_sum.x = power_sum;
+        }
+        _count = lights.size();
+        // An empty buffer can't be bound
+        if (lights.empty())
+        {
+            lights.push_back(LightSource{ glm::vec4(0), glm::vec4(0), glm::vec4(0) });
+        }
+        _buf->load_data(lights, 0);
+        return true;
+    }
+
+    int count() const
+    {
+        return _count;
+    }
+
+    std::shared_ptr<graphics::Buffer<LightSource>> get_buffer()
+    {
+        return _buf;
+    }
+
+private:
+    std::shared_ptr<graphics::Buffer<LightSource>> _buf;
+    // Lights added from the CPU, by id
+    std::map<int, LightSource> _lights;
+    // Emissive block centers by chunk coordinate
+    std::map<std::tuple<int, int, int>, std::vector<glm::vec3>> _emitters;
+    glm::vec3 _emissive_color;
+    float _emissive_intensity;
+    int _next_id;
+    int _count;
+    bool _dirty;
+};
+
+#endif  // GRAPHICS_LIGHT_LIST_H_
@@ -0,0 +1,115 @@
+#pragma once
+#ifndef LIGHT_SMOOTHING_H_
+#define LIGHT_SMOOTHING_H_
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define LIGHT_SMOOTHING_SSE
+#endif
+
+// One row range of smooth_light_cpu()
+inline void smooth_light_rows(const std::vector<glm::vec4>& color,
+	const std::vector<glm::vec4>& norm,
+	int x_res, int y_res, int radius,
+	int row_start, int row_end,
+	std::vector<glm::vec4>& out)
+{
+	for (int j = row_start; j < row_end; ++j)
+	{
+		for (int i = 0; i < x_res; ++i)
+		{
+			const glm::vec4& n1 = norm[i + j * x_res];
+#ifdef LIGHT_SMOOTHING_SSE
+			__m128 sum = _mm_setzero_ps();
+#else
+			glm::vec4 sum(0.0f);
+#endif
+			int count = 0;
+			for (int y_offset = -radius; y_offset <= radius; ++y_offset)
+			{
+				int y = j + y_offset;
+				if (y < 0 || y >= y_res)
+				{
+					continue;
+				}
+				for (int x_offset = -radius; x_offset <= radius; ++x_offset)
+				{
+					int x = i + x_offset;
+					if (x < 0 || x >= x_res)
+					{
+						continue;
+					}
+					const glm::vec4& n2 = norm[x + y * x_res];
+					float facing = n1.x * n2.x + n1.y * n2.y + n1.z * n2.z;
+					if (facing > 0.1f && std::abs(n1.w - n2.w) < 0.5f)
+					{
+#ifdef LIGHT_SMOOTHING_SSE
+						sum = _mm_add_ps(sum, _mm_loadu_ps(&color[x + y * x_res].x));
+#else
+						sum += color[x + y * x_res];
+#endif
+						count += 1;
+					}
+				}
+			}
+			if (count > 0)
+			{
+#ifdef LIGHT_SMOOTHING_SSE
+				_mm_storeu_ps(&out[i + j * x_res].x, _mm_div_ps(sum, _mm_set1_ps(float(count))));
+#else
+				out[i + j * x_res] = sum / float(count);
+#endif
+			}
+			else
+			{
+				out[i + j * x_res] = color[i + j * x_res];
+			}
+		}
+	}
+}
+
+// CPU version of shaders/smooth_light.glsl for headless runs. Rows are
+// split across threads; each output pixel only depends on the input so
+// the split doesn't change the result.
+inline void smooth_light_cpu(const std::vector<glm::vec4>& color,
+	const std::vector<glm::vec4>& norm,
+	int x_res, int y_res, int radius,
+	std::vector<glm::vec4>& out,
+	int thread_count = 0)
+{
+	out.resize(color.size());
+	if (thread_count <= 0)
+	{
+		thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+	}
+	thread_count = std::min(thread_count, std::max(1, y_res));
+
+	std::vector<std::thread> threads;
+	int rows_per_thread = (y_res + thread_count - 1) / thread_count;
+	for (int t = 1; t < thread_count; ++t)
+	{
+		int row_start = t * rows_per_thread;
+		int row_end = std::min(y_res, row_start + rows_per_thread);
+		if (row_start >= row_end)
+		{
+			break;
+		}
+		threads.emplace_back(smooth_light_rows, std::cref(color), std::cref(norm),
+			x_res, y_res, radius, row_start, row_end, std::ref(out));
+	}
+	smooth_light_rows(color, norm, x_res, y_res, radius, 0, std::min(y_res, rows_per_thread), out);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+#endif  // LIGHT_SMOOTHING_H_
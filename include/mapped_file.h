@@ -0,0 +1,148 @@
+#pragma once
+#ifndef MAPPED_FILE_H_
+#define MAPPED_FILE_H_
+
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only memory mapping of a whole file
+class MappedFile
+{
+public:
+	MappedFile() :
+		_data(nullptr),
+		_size(0)
+	{
+#ifdef _WIN32
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = NULL;
+#endif
+	}
+
+	MappedFile(const std::string& path) :
+		MappedFile()
+	{
+		open(path);
+	}
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path)
+	{
+		close();
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(_file, &file_size);
+		_size = size_t(file_size.QuadPart);
+		if (_size == 0)
+		{
+			return true;
+		}
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping == NULL)
+		{
+			close();
+			return false;
+		}
+		_data = reinterpret_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat file_stat;
+		fstat(fd, &file_stat);
+		_size = size_t(file_stat.st_size);
+		if (_size == 0)
+		{
+			::close(fd);
+			return true;
+		}
+		void* data = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+		{
+			_size = 0;
+			return false;
+		}
+		_data = reinterpret_cast<const char*>(data);
+#endif
+		return _data != nullptr;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (_data)
+		{
+			UnmapViewOfFile(_data);
+		}
+		if (_mapping != NULL)
+		{
+			CloseHandle(_mapping);
+			_mapping = NULL;
+		}
+		if (_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (_data)
+		{
+			munmap(const_cast<char*>(_data), _size);
+		}
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+
+	const char* data() const
+	{
+		return _data;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+	bool is_open() const
+	{
+		return _data != nullptr;
+	}
+
+private:
+	const char* _data;
+	size_t _size;
+#ifdef _WIN32
+	HANDLE _file;
+	HANDLE _mapping;
+#endif
+};
+
+#endif  // MAPPED_FILE_H_
@@ -61,9 +61,7 @@ class Object : public Entity
 	{
 		bind();
 		_instances->bind();
-		glBindAttribLocation(_program->get_program_name(),
-			_INSTANCE_BINDING,
-			DEFAULT_INSTANCE_VARIABLE.c_str());
+		_program->bind_attrib_location(_INSTANCE_BINDING, DEFAULT_INSTANCE_VARIABLE);
 		glEnableVertexAttribArray(_INSTANCE_BINDING);
 		
 		glVertexAttribPointer(_INSTANCE_BINDING, 3, GL_FLOAT, GL_FALSE, 0, 0);
@@ -95,23 +93,17 @@ class Object : public Entity
 		_program = program;
 
 		_vertices->bind();
-		glBindAttribLocation(_program->get_program_name(), 
-			_POSITION_BINDING, 
-			DEFAULT_VERTEX_POSITION_VARIABLE.c_str());
+		_program->bind_attrib_location(_POSITION_BINDING, DEFAULT_VERTEX_POSITION_VARIABLE);
 		glEnableVertexAttribArray(_POSITION_BINDING);
 		glVertexAttribPointer(_POSITION_BINDING, 3, GL_FLOAT, GL_FALSE, 0, 0);
 		
 		_normals->bind();
-		glBindAttribLocation(_program->get_program_name(),
-			_NORMAL_BINDING,
-			DEFAULT_VERTEX_NORMAL_VARIABLE.c_str());
+		_program->bind_attrib_location(_NORMAL_BINDING, DEFAULT_VERTEX_NORMAL_VARIABLE);
 		glEnableVertexAttribArray(_NORMAL_BINDING);
 		glVertexAttribPointer(_NORMAL_BINDING, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
 		_uvs->bind();
-		glBindAttribLocation(_program->get_program_name(),
-			_UV_BINDING,
-			DEFAULT_VERTEX_UV_VARIABLE.c_str());
+		_program->bind_attrib_location(_UV_BINDING, DEFAULT_VERTEX_UV_VARIABLE);
 		glEnableVertexAttribArray(_UV_BINDING);
 		glVertexAttribPointer(_UV_BINDING, 2, GL_FLOAT, GL_FALSE, 0, 0);
 		_program->link();
@@ -125,9 +117,7 @@ class Object : public Entity
 	void draw()
 	{
 		bind();
-		GLuint model_mat_loc = glGetUniformLocation(_program->get_program_name(), "model_mat");
-		glm::mat4 model_mat = get_transform();
-		glUniformMatrix4fv(model_mat_loc, 1, GL_FALSE, glm::value_ptr(model_mat));
+		_program->set_uniform_mat4(_program->common_uniforms().model_mat, get_transform());
 		if (_is_instanced)
 		{
 			glDrawArraysInstanced(GL_TRIANGLES, 0, vertex_count(), get_instance_count());
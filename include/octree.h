@@ -3,9 +3,69 @@
 #define GRAPHICS_OCTREE_H_
 
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "async_readback.h"
+#include "octree_node.h"
+#include "persistent_buffer.h"
+
+// Header of the node allocator buffer shared with
+// octree_allocate_block() in multi_ray.glsl, followed by the free list
+// of block bases. The free list is a ring: the CPU appends and moves
+// free_count, the shader takes from free_taken, and neither count ever
+// goes back.
+const int octree_alloc_bump = 0;
+const int octree_alloc_capacity = 1;
+const int octree_alloc_free_count = 2;
+const int octree_alloc_free_taken = 3;
+const int octree_alloc_header_size = 4;
+
+// Entries in the GPU free list ring, and how many freed blocks are kept
+// waiting in it. Blocks in the ring can't be used by the CPU.
+const int octree_gpu_free_list_size = 65536;
+const int octree_gpu_free_target = 4096;
+
+// Nodes the GPU bump pointer gets at a time. A new slab is handed out
+// once the readback shows less than a quarter of the last one is left.
+const int octree_gpu_slab_nodes = OCTREE_BLOCK_NODES * 4096;
+
+// Frames per LRU generation. Child blocks are bucketed by the generation
+// they were last touched in, so eviction only has to order generations.
+const int octree_frames_per_generation = 8;
+
+// Blocks evict_lru() examines or frees per call
+const int default_octree_evict_budget = 4096;
+
+// Nodes the light octree buffer starts with and may grow to
+const int default_octree_initial_capacity = 1 << 16;
+const int default_octree_max_capacity = 10000000;
+
+// Fraction of the buffer in use that triggers growth
+const float octree_grow_threshold = 0.75f;
+
+// Levels encoded in an octree Morton code, 3 bits each
+const int octree_morton_levels = 21;
+
+// Octree levels two Morton codes have in common
+inline int morton_shared_levels(uint64_t a, uint64_t b)
+{
+    uint64_t diff = a ^ b;
+    int levels = octree_morton_levels;
+    while (diff)
+    {
+        diff >>= 3;
+        levels -= 1;
+    }
+    return levels;
+}
 
 class Octree
 {
@@ -134,201 +194,749 @@ private:
 class MappedOctree
 {
 public:
-    struct Node
-    {
-        float size; // side size
-        float pad[3];
-        glm::vec4 pos; // "floor" corner of bounds
-        int children[8];
-        glm::vec4 value;
-        int parent;
-        int pad2[3];
-    };
+    typedef OctreeNode Node;
 
-    MappedOctree():
-        _oct_buf(std::make_shared<graphics::Buffer<Node>>(GL_SHADER_STORAGE_BUFFER)),
-        _mapped_depth(0)
+    // The node buffer starts at initial_capacity nodes and doubles when
+    // it fills up, up to max_capacity. It stays mapped the whole time.
+    MappedOctree(int initial_capacity = default_octree_initial_capacity,
+        int max_capacity = default_octree_max_capacity):
+        _oct_buf(std::make_shared<graphics::PersistentBuffer<Node>>(std::min(initial_capacity, max_capacity))),
+        _alloc_buf(std::make_shared<graphics::Buffer<int>>(GL_SHADER_STORAGE_BUFFER)),
+        _alloc_readback(octree_alloc_header_size),
+        _gpu_free_ring(octree_gpu_free_list_size),
+        _mapped_depth(0),
+        _grow_requested(false),
+        _frame(0),
+        _oldest_generation(0),
+        _max_capacity(max_capacity)
     {
+        _oct_proto.child_base = OCTREE_NO_CHILDREN;
         _oct_proto.parent = -1;
-        for (int i = 0; i < 8; ++i)
-        {
-            _oct_proto.children[i] = -1;
-        }
-        std::vector<Node> oct_vector;
-        oct_vector.push_back(_oct_proto);
-        oct_vector.back().pos = glm::vec4(0, 0, 0, 0);
-        oct_vector.back().size = 1000;
-        _oct_buf->load_data(oct_vector, 10000000);
+        _oct_proto.value_rg = 0;
+        _oct_proto.value_ba = 0;
+        _oct_proto.last_touched = 0;
+        _oct_proto.bucket_generation = -1;
+        _oct_proto.pad0 = 0;
+        _oct_proto.pad1 = 0;
+        _oct_array = _oct_buf->data();
+        write_root();
+        _oct_buf->flush();
+        _capacity = max_capacity / 10 * 9;
+        std::vector<int> alloc_data(octree_alloc_header_size, 0);
+        _alloc_buf->load_data(alloc_data, octree_gpu_free_list_size);
+        reset_gpu_allocator();
     }
 
     int lookup(int depth, glm::vec3 coord, bool allocate_node)
     {
         int current_index = 0;
+        glm::vec3 node_pos(0);
+        float node_size = OCTREE_ROOT_SIZE;
         for (int i = 0; i < depth; ++i)
         {
-            glm::vec3 node_center = glm::vec3(_oct_array[current_index].pos) + glm::vec3(_oct_array[current_index].size / 2.0);
+            write_node(current_index).last_touched = _frame;
+            node_size /= 2.0f;
+            glm::vec3 node_center = node_pos + glm::vec3(node_size);
             int x_index = int(coord.x > node_center.x);
             int y_index = int(coord.y > node_center.y);
             int z_index = int(coord.z > node_center.z);
             int child_index = x_index + y_index * 2 + z_index * 4;
+            node_pos += glm::vec3(x_index, y_index, z_index) * node_size;
 
-            if (_oct_array[current_index].children[child_index] < 0)
+            if (_oct_array[current_index].child_base < 0)
             {
-                if (allocate_node)
-                {
-                    int new_index = allocate(current_index);
-                    if (new_index == -1)
-                    {
-                        return current_index;
-                    }
-                    _oct_array[current_index].children[child_index] = new_index;
-                    _oct_array[new_index].size =
-                        _oct_array[current_index].size / 2.0;
-                    _oct_array[new_index].pos =
-                        glm::vec4(glm::vec3(_oct_array[current_index].pos) + glm::vec3(x_index, y_index, z_index) *
-                            _oct_array[current_index].size / 2.0f, 0);
-                    _oct_array[new_index].value = _oct_array[current_index].value;// glm::vec4(-1000);
-                }
-                else
+                if (!allocate_node || allocate_children(current_index) == -1)
                 {
                     return current_index;
                 }
             }
-            current_index = _oct_array[current_index].children[child_index];
+            current_index = _oct_array[current_index].child_base + child_index;
         }
+        write_node(current_index).last_touched = _frame;
         return current_index;
     }
 
+    // Path from the root to coord as a Morton code, the root's child in
+    // the top 3 bits. Matches the descent in lookup(), which sends points
+    // on a split plane to the low side.
+    uint64_t morton_code(glm::vec3 coord) const
+    {
+        const double cells = double(1 << octree_morton_levels);
+        glm::dvec3 rel = glm::dvec3(coord) * (cells / OCTREE_ROOT_SIZE);
+        uint64_t code = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            uint64_t cell = uint64_t(std::min(std::max(std::ceil(rel[axis]) - 1.0, 0.0), cells - 1.0));
+            for (int level = 0; level < octree_morton_levels; ++level)
+            {
+                code |= ((cell >> level) & 1) << (3 * level + axis);
+            }
+        }
+        return code;
+    }
+
+    // Descends depth levels along code. path[0..shared_depth] holds the
+    // nodes of an earlier lookup that share the first shared_depth levels
+    // and is extended from there. Returns the depth reached.
+    int lookup_path(uint64_t code, int depth, int shared_depth, int* path, bool allocate_node,
+        std::mutex& alloc_mutex)
+    {
+        path[0] = 0;
+        for (int i = shared_depth; i < depth; ++i)
+        {
+            int current_index = path[i];
+            int child_index = int(code >> (3 * (octree_morton_levels - 1 - i))) & 7;
+            if (_oct_array[current_index].child_base < 0)
+            {
+                if (!allocate_node)
+                {
+                    return i;
+                }
+                int child_base;
+                {
+                    std::lock_guard<std::mutex> lock(alloc_mutex);
+                    child_base = allocate_children(current_index);
+                }
+                if (child_base == -1)
+                {
+                    return i;
+                }
+            }
+            path[i + 1] = _oct_array[current_index].child_base + child_index;
+            write_node(path[i + 1]).last_touched = _frame;
+        }
+        return depth;
+    }
+
+    // lookup() for many points at once. Points are sorted by Morton code
+    // so the levels neighbouring points share are only descended once,
+    // and each of the root's octants is walked on its own thread.
+    // Must be mapped.
+    void lookup_batch(const std::vector<glm::vec3>& coords, const std::vector<int>& depths,
+        bool allocate_node)
+    {
+        std::vector<std::pair<uint64_t, int>> order(coords.size());
+        for (int i = 0; i < coords.size(); ++i)
+        {
+            order[i] = { morton_code(coords[i]), std::min(depths[i], octree_morton_levels) };
+        }
+        std::sort(order.begin(), order.end());
+        write_node(0).last_touched = _frame;
+        // The root's block is the only one the threads would share
+        if (allocate_node && _oct_array[0].child_base < 0 && allocate_children(0) == -1)
+        {
+            return;
+        }
+
+        std::mutex alloc_mutex;
+        auto walk = [&](int start, int end)
+        {
+            int path[octree_morton_levels + 1];
+            int reached = 0;
+            for (int i = start; i < end; ++i)
+            {
+                int shared = 0;
+                if (i > start)
+                {
+                    shared = std::min(reached, morton_shared_levels(order[i - 1].first, order[i].first));
+                }
+                reached = lookup_path(order[i].first, order[i].second, std::min(shared, order[i].second),
+                    path, allocate_node, alloc_mutex);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        int start = 0;
+        for (int octant = 0; octant < 8; ++octant)
+        {
+            int end = start;
+            while (end < order.size() &&
+                int(order[end].first >> (3 * (octree_morton_levels - 1))) == octant)
+            {
+                end += 1;
+            }
+            if (end > start)
+            {
+                workers.emplace_back(walk, start, end);
+            }
+            start = end;
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
     void set(int depth, glm::vec3 coord, glm::vec4 val)
     {
-        //map();
         int current_index = lookup(depth, coord, true);
-        _oct_array[current_index].value = val;
-        //unmap();
+        set_value(current_index, val);
     }
 
-    int allocate(int parent)
+    glm::vec4 value(int index) const
     {
-        //map();
-        if (_free_nodes.size())
+        return glm::vec4(glm::unpackHalf2x16(_oct_array[index].value_rg),
+            glm::unpackHalf2x16(_oct_array[index].value_ba));
+    }
+
+    void set_value(int index, glm::vec4 val)
+    {
+        write_node(index).value_rg = glm::packHalf2x16(glm::vec2(val.x, val.y));
+        _oct_array[index].value_ba = glm::packHalf2x16(glm::vec2(val.z, val.w));
+    }
+
+    // Allocates the block of 8 children of parent, which start out with
+    // its value. Returns the first child or -1 if the buffer is full.
+    int allocate_children(int parent)
+    {
+        int base;
+        if (_free_blocks.size())
         {
-            int fn = _free_nodes.back();
-            _free_nodes.pop_back();
-            _oct_array[fn].parent = parent;
-            //unmap();
-            return fn;
+            base = _free_blocks.back();
+            _free_blocks.pop_back();
         }
-        if (_oct_buf->max_count() - 1 > _oct_buf->count())
+        else if (_oct_buf->count() + OCTREE_BLOCK_NODES <= _oct_buf->capacity())
         {
-            Node temp_node = _oct_proto;
-            temp_node.parent = parent;
-            _oct_buf->add_data(temp_node, 10000);
+            base = _oct_buf->count();
+            _oct_buf->set_count(base + OCTREE_BLOCK_NODES);
         }
         else
         {
+            // The buffer can't be replaced while mapped; grow on the next map()
+            _grow_requested = true;
             return -1;
-            unmap(true);
-            Node temp_node = _oct_proto;
-            temp_node.parent = parent;
-            _oct_buf->add_data(temp_node, 10000);
-            map(true);
         }
-        //unmap();
-        return _oct_buf->count() - 1;
+        for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
+        {
+            write_node(base + i) = _oct_proto;
+            _oct_array[base + i].parent = parent;
+            _oct_array[base + i].value_rg = _oct_array[parent].value_rg;
+            _oct_array[base + i].value_ba = _oct_array[parent].value_ba;
+            _oct_array[base + i].last_touched = _frame;
+        }
+        file_block(base, generation(_frame));
+        write_node(parent).child_base = base;
+        return base;
     }
 
-    void cleanup(glm::vec3 pos, float size_thresh)
+    // Starts a new frame for last touched stamps. The same counter is
+    // passed to the shader as octree_frame.
+    void advance_frame()
+    {
+        _frame += 1;
+    }
+
+    int frame() const
+    {
+        return _frame;
+    }
+
+    // Live nodes evict_lru() trims down to
+    void set_capacity(int nodes)
+    {
+        _capacity = nodes;
+    }
+
+    // Blocks waiting in the GPU free list and the untaken part of the
+    // GPU slabs don't count
+    int live_count() const
     {
-        for (int i = 2; i < _oct_buf->count(); ++i)
+        int gpu_free = (_gpu_free_pushed - _gpu_free_taken) * OCTREE_BLOCK_NODES +
+            (_gpu_slab_end - _gpu_slab_next) + (_old_slab_end - _old_slab_next);
+        return _oct_buf->count() - int(_free_blocks.size()) * OCTREE_BLOCK_NODES - gpu_free;
+    }
+
+    // Incremental LRU eviction, must be mapped. Finishes reclaiming
+    // subtrees of earlier evictions first, then while over capacity
+    // evicts the least recently touched blocks oldest generation first.
+    // At most budget blocks are looked at. Returns the nodes freed.
+    int evict_lru(int budget = default_octree_evict_budget)
+    {
+        file_gpu_blocks();
+        int freed = 0;
+        while (budget > 0 && _pending_reclaim.size())
         {
-            //auto& node = _oct_array[i];
-            if (_oct_array[i].size < glm::length(pos - glm::vec3(_oct_array[i].pos)) / 1000.0 && _oct_array[i].parent > 0)//_oct_array[i].parent > 0 && _oct_array[i].size < 1 && 0);// glm::length(pos - glm::vec3(_oct_array[i].pos)) / 1000.0 && _oct_array[i].size < 20);//&& glm::length(pos - glm::vec3(_oct_array[i].pos)) > 100)
+            freed += reclaim_one();
+            budget -= 1;
+        }
+        int current_generation = generation(_frame);
+        while (budget > 0 && !_pending_reclaim.size() && live_count() > _capacity &&
+            _oldest_generation < current_generation)
+        {
+            if (!_buckets.size() || !_buckets.front().size())
+            {
+                if (_buckets.size())
+                {
+                    _buckets.pop_front();
+                }
+                _oldest_generation += 1;
+                continue;
+            }
+            int base = _buckets.front().back();
+            _buckets.front().pop_back();
+            budget -= 1;
+            // Entries are left behind when a block is refiled or freed
+            if (_oct_array[base].bucket_generation != _oldest_generation)
+            {
+                continue;
+            }
+            int touched_generation = generation(block_last_touched(base));
+            if (touched_generation > _oldest_generation)
             {
-                delete_node(i);
+                file_block(base, touched_generation);
+                continue;
+            }
+            delete_block(base);
+            while (budget > 0 && _pending_reclaim.size())
+            {
+                freed += reclaim_one();
+                budget -= 1;
             }
         }
+        return freed;
     }
 
-    void delete_node(int node, int depth = 0)
+    // Unlinks the block starting at base from its parent. The block and
+    // everything under it are freed a block at a time by later
+    // evict_lru() calls.
+    void delete_block(int base)
     {
-        if (_oct_array[node].parent >= 0 && _oct_array[node].parent < _oct_buf->count())
+        int parent = _oct_array[base].parent;
+        if (parent >= 0 && parent < _oct_buf->count() && _oct_array[parent].child_base == base)
         {
-            for (int j = 0; j < 8; ++j)
+            write_node(parent).child_base = OCTREE_NO_CHILDREN;
+        }
+        write_node(base).bucket_generation = -1;
+        _pending_reclaim.push_back(base);
+    }
+
+    // Replaces the tree with count nodes saved from an earlier
+    // get_buffer() copy. The free list and LRU buckets are rebuilt from
+    // what is reachable from the root, and every node counts as touched
+    // this frame. Must be mapped. Returns false if the nodes don't fit.
+    bool load_nodes(const Node* nodes, int count)
+    {
+        if (count < 1 || count > _max_capacity)
+        {
+            return false;
+        }
+        if (_oct_buf->capacity() < count)
+        {
+            int capacity = _oct_buf->capacity();
+            while (capacity < count)
             {
-                if (_oct_array[_oct_array[node].parent].children[j] == node)
+                capacity *= 2;
+            }
+            _oct_buf->grow(std::min(capacity, _max_capacity));
+            _oct_array = _oct_buf->data();
+        }
+        memcpy(_oct_array, nodes, sizeof(Node) * count);
+        _oct_buf->mark_dirty_range(0, count);
+        _oct_buf->set_count(count);
+        _free_blocks.clear();
+        _pending_reclaim.clear();
+        _gpu_new_blocks.clear();
+        _buckets.clear();
+        _oldest_generation = generation(_frame);
+        reset_gpu_allocator();
+
+        std::vector<bool> reachable(count, false);
+        std::vector<int> stack(1, 0);
+        reachable[0] = true;
+        _oct_array[0].parent = -1;
+        while (stack.size())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            Node& node = _oct_array[index];
+            node.last_touched = _frame;
+            node.bucket_generation = -1;
+            int base = node.child_base;
+            // Drop links a damaged file could use to make cycles or run off the end
+            if (base < 1 || base + OCTREE_BLOCK_NODES > count ||
+                (base - 1) % OCTREE_BLOCK_NODES != 0 || reachable[base])
+            {
+                node.child_base = OCTREE_NO_CHILDREN;
+                continue;
+            }
+            for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
+            {
+                reachable[base + i] = true;
+                _oct_array[base + i].parent = index;
+                stack.push_back(base + i);
+            }
+        }
+        for (int base = 1; base + OCTREE_BLOCK_NODES <= count; base += OCTREE_BLOCK_NODES)
+        {
+            if (reachable[base])
+            {
+                file_block(base, generation(_frame));
+            }
+            else
+            {
+                for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
                 {
-                    _oct_array[_oct_array[node].parent].children[j] = -1;
-                    break;
+                    _oct_array[base + i] = _oct_proto;
                 }
+                _free_blocks.push_back(base);
             }
         }
-        for (int j = 0; j < 8; ++j)
+        return true;
+    }
+
+    // Clears the light of every node inside the box from lo to hi and
+    // frees what is below them. Nodes that only overlap it keep their
+    // value. Must be mapped. Returns the nodes cleared.
+    int invalidate_box(glm::vec3 lo, glm::vec3 hi)
+    {
+        return invalidate_node(0, glm::vec3(0), OCTREE_ROOT_SIZE, lo, hi);
+    }
+
+    int node_count() const
+    {
+        return _oct_buf->count();
+    }
+
+    void reset()
+    {
+        write_root();
+        _free_blocks.clear();
+        _pending_reclaim.clear();
+        _gpu_new_blocks.clear();
+        _buckets.clear();
+        _oldest_generation = generation(_frame);
+        reset_gpu_allocator();
+    }
+
+    // Keeps the GPU allocator supplied before a dispatch that may
+    // allocate nodes. The allocator stays on the GPU across frames and
+    // never waits for it: what the shader took is learned from a header
+    // readback a few frames later, and the CPU only writes what it
+    // changed, a new slab for the bump pointer or freed blocks appended
+    // to the free list. CPU allocations use neither, so both sides can
+    // allocate without waiting on each other.
+    void push_gpu_allocator()
+    {
+        poll_gpu_allocator();
+        grow_if_needed();
+        _oct_buf->flush();
+        // Requested before the writes below, so the copy taken when a slab
+        // is replaced holds how far the GPU got into it
+        bool requested = _alloc_readback.request(_alloc_buf->get_buffer_name(), 0);
+        if (requested && _old_slab_end == _old_slab_next &&
+            _gpu_slab_end - _gpu_slab_next < octree_gpu_slab_nodes / 4)
+        {
+            start_gpu_slab();
+        }
+        append_gpu_free_list();
+    }
+
+    // Takes in the header readbacks that finished. Blocks the GPU took
+    // are filed for eviction, and once the last copy of a replaced slab
+    // is in, the part the GPU never reached goes to the free list.
+    // Never blocks.
+    void poll_gpu_allocator()
+    {
+        std::vector<int> header;
+        while (_alloc_readback.poll(header))
         {
-            if (_oct_array[node].children[j] > 0 && 
-                _oct_array[node].children[j] < _oct_buf->count() &&
-                depth < 15)
+            int capacity = header[octree_alloc_capacity];
+            int end = std::min(header[octree_alloc_bump], capacity);
+            if (capacity == _gpu_slab_end)
+            {
+                // Copies are in order, so the replaced slab's last one is in
+                for (; _old_slab_next + OCTREE_BLOCK_NODES <= _old_slab_end; _old_slab_next += OCTREE_BLOCK_NODES)
+                {
+                    _free_blocks.push_back(_old_slab_next);
+                }
+                _old_slab_next = _old_slab_end;
+                take_gpu_slab_blocks(_gpu_slab_next, end);
+            }
+            else if (capacity == _old_slab_end)
+            {
+                take_gpu_slab_blocks(_old_slab_next, end);
+            }
+            int taken = std::min(header[octree_alloc_free_taken], header[octree_alloc_free_count]);
+            for (; _gpu_free_taken < taken; ++_gpu_free_taken)
             {
-                _oct_array[_oct_array[node].children[j]].parent = -1;
-                delete_node(_oct_array[node].children[j], depth + 1);
+                _gpu_new_blocks.push_back(_gpu_free_ring[_gpu_free_taken % octree_gpu_free_list_size]);
             }
         }
-        _oct_array[node] = _oct_proto;
-        _free_nodes.push_front(node);
     }
 
-    void reset()
+    std::shared_ptr<graphics::Buffer<int>> get_allocator_buffer()
     {
-        std::vector<Node> oct_vector;
-        oct_vector.push_back(_oct_proto);
-        oct_vector.back().pos = glm::vec4(0, 0, 0, 0);
-        oct_vector.back().size = 1000;
-        _oct_buf->load_data(oct_vector, 10000);
+        return _alloc_buf;
     }
 
+    // The buffer is persistently mapped, so map() only takes in the GPU
+    // allocator readbacks and grows the buffer if it filled up. Nodes the
+    // GPU wrote are only visible once the dispatch that wrote them finished.
     void map(bool force=false)
     {
-        if (force)
+        poll_gpu_allocator();
+        if (force || _mapped_depth <= 0)
         {
-            _oct_array = _oct_buf->map_memory();
-            return;
+            grow_if_needed();
         }
-        if (_mapped_depth <= 0)
+        if (!force)
         {
-            _oct_array = _oct_buf->map_memory();
+            _mapped_depth += 1;
         }
-        _mapped_depth += 1;
     }
 
+    // Flushes the nodes written since the last flush to the GPU
     void unmap(bool force=false)
     {
         if (force)
         {
-            _oct_buf->unmap_memory();
-            _oct_array = nullptr;
+            _oct_buf->flush();
         }
         if (_mapped_depth > 0)
         {
             if (_mapped_depth == 1)
             {
-                _oct_buf->unmap_memory();
-                _oct_array = nullptr;
+                _oct_buf->flush();
             }
             _mapped_depth -= 1;
         }
     }
 
-    std::shared_ptr<graphics::Buffer<Node>> get_buffer()
+    // The buffer is replaced when it grows; bind it again every frame
+    std::shared_ptr<graphics::PersistentBuffer<Node>> get_buffer()
     {
         return _oct_buf;
     }
 
+    int buffer_capacity() const
+    {
+        return _oct_buf->capacity();
+    }
+
     Node* _oct_array;
-    std::shared_ptr<graphics::Buffer<Node>> _oct_buf;
+    std::shared_ptr<graphics::PersistentBuffer<Node>> _oct_buf;
+    std::shared_ptr<graphics::Buffer<int>> _alloc_buf;
     std::vector<glm::vec4> _oct_values;
 private:
-    std::deque<int> _free_nodes;
+    int generation(int frame) const
+    {
+        return frame / octree_frames_per_generation;
+    }
+
+    // Node reference for writing; the node's page is flushed on unmap()
+    Node& write_node(int index)
+    {
+        _oct_buf->mark_dirty(index);
+        return _oct_array[index];
+    }
+
+    void write_root()
+    {
+        write_node(0) = _oct_proto;
+        _oct_buf->set_count(1);
+    }
+
+    // Doubles the buffer when an allocation failed or it is mostly used
+    void grow_if_needed()
+    {
+        int capacity = _oct_buf->capacity();
+        if (capacity >= _max_capacity ||
+            (!_grow_requested && _oct_buf->count() < capacity * octree_grow_threshold))
+        {
+            return;
+        }
+        _grow_requested = false;
+        _oct_buf->grow(std::min(capacity * 2, _max_capacity));
+        _oct_array = _oct_buf->data();
+    }
+
+    int block_last_touched(int base) const
+    {
+        int last_touched = _oct_array[base].last_touched;
+        for (int i = 1; i < OCTREE_BLOCK_NODES; ++i)
+        {
+            last_touched = std::max(last_touched, _oct_array[base + i].last_touched);
+        }
+        return last_touched;
+    }
+
+    int invalidate_node(int index, glm::vec3 pos, float size, glm::vec3 lo, glm::vec3 hi)
+    {
+        glm::vec3 far_corner = pos + glm::vec3(size);
+        if (glm::any(glm::lessThanEqual(far_corner, lo)) || glm::any(glm::greaterThanEqual(pos, hi)))
+        {
+            return 0;
+        }
+        int base = _oct_array[index].child_base;
+        if (glm::all(glm::greaterThanEqual(pos, lo)) && glm::all(glm::lessThanEqual(far_corner, hi)))
+        {
+            set_value(index, glm::vec4(0));
+            if (base >= 0)
+            {
+                delete_block(base);
+            }
+            return 1;
+        }
+        if (base < 0)
+        {
+            return 0;
+        }
+        int cleared = 0;
+        float child_size = size / 2.0f;
+        for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
+        {
+            glm::vec3 offset(i & 1, (i >> 1) & 1, i >> 2);
+            cleared += invalidate_node(base + i, pos + offset * child_size, child_size, lo, hi);
+        }
+        return cleared;
+    }
+
+    // Adds the block at base to the LRU bucket of generation gen
+    void file_block(int base, int gen)
+    {
+        gen = std::max(gen, _oldest_generation);
+        while (_buckets.size() <= gen - _oldest_generation)
+        {
+            _buckets.push_back({});
+        }
+        _buckets[gen - _oldest_generation].push_back(base);
+        write_node(base).bucket_generation = gen;
+    }
+
+    // Forgets every GPU allocation, for when the tree is replaced. The
+    // GPU must not be using the allocator.
+    void reset_gpu_allocator()
+    {
+        _alloc_readback.clear();
+        _gpu_free_pushed = 0;
+        _gpu_free_taken = 0;
+        _gpu_slab_next = 0;
+        _gpu_slab_end = 0;
+        _old_slab_next = 0;
+        _old_slab_end = 0;
+        std::vector<int> header(octree_alloc_header_size, 0);
+        _alloc_buf->set_data(0, header);
+    }
+
+    // Points the GPU bump pointer at a new slab from the end of the node
+    // range. The rest of the old one is settled by poll_gpu_allocator().
+    void start_gpu_slab()
+    {
+        if (_oct_buf->count() + octree_gpu_slab_nodes > _oct_buf->capacity())
+        {
+            _grow_requested = true;
+            grow_if_needed();
+        }
+        int size = std::min(octree_gpu_slab_nodes, _oct_buf->capacity() - _oct_buf->count());
+        size -= size % OCTREE_BLOCK_NODES;
+        if (size <= 0)
+        {
+            return;
+        }
+        _old_slab_next = _gpu_slab_next;
+        _old_slab_end = _gpu_slab_end;
+        _gpu_slab_next = _oct_buf->count();
+        _gpu_slab_end = _gpu_slab_next + size;
+        _oct_buf->set_count(_gpu_slab_end);
+        int slab[2] = { _gpu_slab_next, _gpu_slab_end };
+        _alloc_buf->set_data(octree_alloc_bump, slab, 2);
+    }
+
+    // Moves the blocks of a slab below end to the blocks the GPU took
+    void take_gpu_slab_blocks(int& next, int end)
+    {
+        for (; next + OCTREE_BLOCK_NODES <= end; next += OCTREE_BLOCK_NODES)
+        {
+            _gpu_new_blocks.push_back(next);
+        }
+    }
+
+    // Tops the GPU free list up to octree_gpu_free_target once less than
+    // half of that is waiting to be taken
+    void append_gpu_free_list()
+    {
+        int waiting = _gpu_free_pushed - _gpu_free_taken;
+        if (!_free_blocks.size() || waiting > octree_gpu_free_target / 2)
+        {
+            return;
+        }
+        int count = std::min<int>(_free_blocks.size(), octree_gpu_free_target - waiting);
+        for (int i = 0; i < count; ++i)
+        {
+            _gpu_free_ring[(_gpu_free_pushed + i) % octree_gpu_free_list_size] = _free_blocks.back();
+            _free_blocks.pop_back();
+        }
+        // The new entries wrap around the end of the ring at most once
+        int first = _gpu_free_pushed % octree_gpu_free_list_size;
+        int run = std::min(count, octree_gpu_free_list_size - first);
+        _alloc_buf->set_data(octree_alloc_header_size + first, _gpu_free_ring.data() + first, run);
+        if (run < count)
+        {
+            _alloc_buf->set_data(octree_alloc_header_size, _gpu_free_ring.data(), count - run);
+        }
+        _gpu_free_pushed += count;
+        _alloc_buf->set_data(octree_alloc_free_count, _gpu_free_pushed);
+    }
+
+    // Blocks the shader took since the last poll aren't in a bucket yet.
+    // A block the CPU already reclaimed through an evicted ancestor is no
+    // longer linked to its parent and stays out.
+    void file_gpu_blocks()
+    {
+        for (int base : _gpu_new_blocks)
+        {
+            int parent = _oct_array[base].parent;
+            if (parent < 0 || parent >= _oct_buf->count() || _oct_array[parent].child_base != base)
+            {
+                continue;
+            }
+            file_block(base, generation(block_last_touched(base)));
+        }
+        _gpu_new_blocks.clear();
+    }
+
+    // Frees one block of an evicted subtree, queueing the blocks under it
+    int reclaim_one()
+    {
+        int base = _pending_reclaim.back();
+        _pending_reclaim.pop_back();
+        for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
+        {
+            int child_base = _oct_array[base + i].child_base;
+            if (child_base > 0 && child_base < _oct_buf->count())
+            {
+                write_node(child_base).bucket_generation = -1;
+                _pending_reclaim.push_back(child_base);
+            }
+            write_node(base + i) = _oct_proto;
+        }
+        _free_blocks.push_back(base);
+        return OCTREE_BLOCK_NODES;
+    }
+
+    std::vector<int> _free_blocks;
+    std::vector<int> _pending_reclaim;
+    std::vector<int> _gpu_new_blocks;
+    std::deque<std::vector<int>> _buckets;
     Node _oct_proto;
+    graphics::AsyncBufferReadback<int> _alloc_readback;
+    // Copy of the GPU free list ring
+    std::vector<int> _gpu_free_ring;
+    // Free list entries appended so far, and known to be taken by the GPU
+    int _gpu_free_pushed;
+    int _gpu_free_taken;
+    // Slab of the GPU bump pointer, from its first block not known to be
+    // taken, and the slab it replaced until its last readback is in
+    int _gpu_slab_next;
+    int _gpu_slab_end;
+    int _old_slab_next;
+    int _old_slab_end;
     int _mapped_depth;
+    bool _grow_requested;
+    int _frame;
+    int _oldest_generation;
+    int _capacity;
+    int _max_capacity;
 };
 
 #endif // GRAPHICS_OCTREE_H_
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef GRAPHICS_OCTREE_NODE_H_
+#define GRAPHICS_OCTREE_NODE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// The node layout lives in the shader tree so multi_ray.glsl can
+// include the same definition
+#include "../shaders/octree_node.glsl"
+
+static_assert(sizeof(OctreeNode) == OCTREE_NODE_BYTES, "OctreeNode must match its std430 layout");
+static_assert(offsetof(OctreeNode, value_rg) == 8, "OctreeNode must match its std430 layout");
+static_assert(offsetof(OctreeNode, last_touched) == 16, "OctreeNode must match its std430 layout");
+
+#endif  // GRAPHICS_OCTREE_NODE_H_
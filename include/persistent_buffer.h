@@ -0,0 +1,166 @@
+#pragma once
+#ifndef GRAPHICS_PERSISTENT_BUFFER_H_
+#define GRAPHICS_PERSISTENT_BUFFER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "gl_includes.h"
+
+namespace graphics
+{
+
+// Elements per dirty page of a PersistentBuffer
+const int persistent_buffer_page_size = 256;
+
+// Buffer that stays mapped for its whole life. The CPU reads and writes
+// elements in place through data(); writes have to be reported with
+// mark_dirty() and reach the GPU on flush(), which only flushes the
+// pages that were written. The mapping isn't coherent, so GPU writes
+// are only visible after glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT)
+// and the GPU finishing the commands that wrote them.
+template <class T>
+class PersistentBuffer
+{
+public:
+	PersistentBuffer(int capacity) :
+		_buffer_num(0),
+		_mapped_data(nullptr),
+		_capacity(0),
+		_count(0)
+	{
+		allocate(capacity);
+	}
+
+	~PersistentBuffer()
+	{
+		glUnmapNamedBuffer(_buffer_num);
+		glDeleteBuffers(1, &_buffer_num);
+	}
+
+	PersistentBuffer(const PersistentBuffer&) = delete;
+	PersistentBuffer& operator=(const PersistentBuffer&) = delete;
+
+	T* data()
+	{
+		return _mapped_data;
+	}
+
+	// Thread safe
+	void mark_dirty(int index)
+	{
+		_dirty_pages[index / persistent_buffer_page_size].store(1, std::memory_order_relaxed);
+	}
+
+	void mark_dirty_range(int first, int count)
+	{
+		for (int page = first / persistent_buffer_page_size;
+			page * persistent_buffer_page_size < first + count; ++page)
+		{
+			_dirty_pages[page].store(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Flushes the written pages, merging runs of neighbouring pages.
+	// Returns the number of ranges flushed.
+	int flush()
+	{
+		int page_count = page_count_for(_capacity);
+		int range_count = 0;
+		int page = 0;
+		while (page < page_count)
+		{
+			if (!_dirty_pages[page].load(std::memory_order_relaxed))
+			{
+				page += 1;
+				continue;
+			}
+			int end = page;
+			while (end < page_count && _dirty_pages[end].load(std::memory_order_relaxed))
+			{
+				_dirty_pages[end].store(0, std::memory_order_relaxed);
+				end += 1;
+			}
+			int first = page * persistent_buffer_page_size;
+			int last = std::min(end * persistent_buffer_page_size, _capacity);
+			glFlushMappedNamedBufferRange(_buffer_num, sizeof(T) * first, sizeof(T) * (last - first));
+			range_count += 1;
+			page = end;
+		}
+		return range_count;
+	}
+
+	// Moves the contents to a bigger buffer. The buffer name changes, so
+	// anything bound to the old one has to be rebound. Waits for the GPU.
+	void grow(int new_capacity)
+	{
+		if (new_capacity <= _capacity)
+		{
+			return;
+		}
+		flush();
+		GLuint old_buffer = _buffer_num;
+		int old_capacity = _capacity;
+		allocate(new_capacity);
+		glCopyNamedBufferSubData(old_buffer, _buffer_num, 0, 0, sizeof(T) * old_capacity);
+		glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(-1));
+		glDeleteSync(fence);
+		glUnmapNamedBuffer(old_buffer);
+		glDeleteBuffers(1, &old_buffer);
+	}
+
+	// Elements in use, for the owner's bookkeeping
+	int count() const
+	{
+		return _count;
+	}
+
+	void set_count(int count)
+	{
+		_count = std::min(count, _capacity);
+	}
+
+	int capacity() const
+	{
+		return _capacity;
+	}
+
+	GLuint get_buffer_name() const
+	{
+		return _buffer_num;
+	}
+
+private:
+	static int page_count_for(int capacity)
+	{
+		return (capacity + persistent_buffer_page_size - 1) / persistent_buffer_page_size;
+	}
+
+	void allocate(int capacity)
+	{
+		GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT;
+		glCreateBuffers(1, &_buffer_num);
+		glNamedBufferStorage(_buffer_num, sizeof(T) * capacity, NULL, flags | GL_DYNAMIC_STORAGE_BIT);
+		_mapped_data = reinterpret_cast<T*>(glMapNamedBufferRange(_buffer_num, 0, sizeof(T) * capacity,
+			flags | GL_MAP_FLUSH_EXPLICIT_BIT));
+		_capacity = capacity;
+		_dirty_pages.reset(new std::atomic<unsigned char>[page_count_for(capacity)]);
+		for (int i = 0; i < page_count_for(capacity); ++i)
+		{
+			_dirty_pages[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	GLuint _buffer_num;
+	T* _mapped_data;
+	int _capacity;
+	int _count;
+	std::unique_ptr<std::atomic<unsigned char>[]> _dirty_pages;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_PERSISTENT_BUFFER_H_
@@ -0,0 +1,176 @@
+#pragma once
+#ifndef GRAPHICS_PROGRAM_CACHE_H_
+#define GRAPHICS_PROGRAM_CACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "gl_includes.h"
+#include "mapped_file.h"
+
+// From GL_KHR_parallel_shader_compile, which the loader doesn't know
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+namespace graphics
+{
+
+const char program_binary_magic[4] = { 'U', 'G', 'P', 'B' };
+
+inline bool has_gl_extension(const char* name)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i)
+    {
+        const char* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if (extension && strcmp(extension, name) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether compile and link status can be polled without blocking
+inline bool parallel_shader_compile_supported()
+{
+    static const bool supported = has_gl_extension("GL_KHR_parallel_shader_compile") ||
+        has_gl_extension("GL_ARB_parallel_shader_compile");
+    return supported;
+}
+
+// Linked program binaries on disk, one file per key. A key covers the
+// full shader sources, defines included, and the driver, so a stale
+// binary is never looked up. Disabled until set_directory() is called.
+class ProgramBinaryCache
+{
+public:
+    ProgramBinaryCache() :
+        _enabled(false)
+    {
+    }
+
+    void set_directory(const std::string& directory)
+    {
+        _directory = directory;
+        _enabled = false;
+        if (directory.empty())
+        {
+            return;
+        }
+        GLint format_count = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+        if (format_count == 0)
+        {
+            std::cout << "Driver has no program binary formats, not caching programs\n";
+            return;
+        }
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        _enabled = !error;
+    }
+
+    bool enabled() const
+    {
+        return _enabled;
+    }
+
+    // 64 bit FNV-1a of the sources and the driver strings
+    uint64_t key(const std::string& sources) const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash](const char* bytes, size_t size)
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                hash = (hash ^ (unsigned char)bytes[i]) * 1099511628211ull;
+            }
+        };
+        for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+        {
+            const char* value = reinterpret_cast<const char*>(glGetString(name));
+            if (value)
+            {
+                add(value, strlen(value) + 1);
+            }
+        }
+        add(sources.data(), sources.size());
+        return hash;
+    }
+
+    // Loads the binary for key into program. Returns false, leaving the
+    // program to be built from source, if there is none or the driver
+    // rejects it.
+    bool load(uint64_t key, GLuint program) const
+    {
+        if (!_enabled)
+        {
+            return false;
+        }
+        MappedFile file(path(key));
+        size_t header_size = sizeof(program_binary_magic) + sizeof(GLenum);
+        if (!file.is_open() || file.size() <= header_size ||
+            memcmp(file.data(), program_binary_magic, sizeof(program_binary_magic)) != 0)
+        {
+            return false;
+        }
+        GLenum format;
+        memcpy(&format, file.data() + sizeof(program_binary_magic), sizeof(format));
+        glProgramBinary(program, format, file.data() + header_size, GLsizei(file.size() - header_size));
+        GLint success = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        return success == GL_TRUE;
+    }
+
+    // program must be linked
+    void save(uint64_t key, GLuint program) const
+    {
+        if (!_enabled)
+        {
+            return;
+        }
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+        {
+            return;
+        }
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(program, length, &length, &format, binary.data());
+        std::ofstream file(path(key), std::ios::binary);
+        file.write(program_binary_magic, sizeof(program_binary_magic));
+        file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        file.write(binary.data(), length);
+    }
+
+private:
+    std::string path(uint64_t key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+        return (std::filesystem::path(_directory) / name).string();
+    }
+
+    std::string _directory;
+    bool _enabled;
+};
+
+// Shared by every Program. Set its directory before building programs.
+inline ProgramBinaryCache& program_binary_cache()
+{
+    static ProgramBinaryCache cache;
+    return cache;
+}
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_PROGRAM_CACHE_H_
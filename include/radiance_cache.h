@@ -0,0 +1,82 @@
+#pragma once
+#ifndef GRAPHICS_RADIANCE_CACHE_H_
+#define GRAPHICS_RADIANCE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gl_includes.h"
+#include "buffer.h"
+
+#include "../shaders/radiance_cache_entry.glsl"
+
+static_assert(sizeof(RadianceCacheEntry) == RADIANCE_CACHE_ENTRY_BYTES, "RadianceCacheEntry must match its std430 layout");
+
+// Slots in the table, rounded up to a power of two
+const int default_radiance_cache_entries = 1 << 20;
+
+// Frames a slot keeps its key without being touched
+const int default_radiance_cache_max_age = 120;
+
+// Side of the finest cache cell in blocks, and the distance from the
+// camera at which cells start doubling in size
+const float default_radiance_cache_cell_size = 0.25f;
+const float default_radiance_cache_lod_distance = 8.0f;
+
+// GPU hash table of radiance, keyed by position, level of detail and
+// normal. All inserts, updates and evictions happen in multi_ray.glsl;
+// the CPU only owns the buffer and the frame counter.
+class RadianceCache
+{
+public:
+    RadianceCache(int entries = default_radiance_cache_entries) :
+        _buf(std::make_shared<graphics::Buffer<RadianceCacheEntry>>(GL_SHADER_STORAGE_BUFFER)),
+        _size(1),
+        _frame(0)
+    {
+        while (_size < entries)
+        {
+            _size *= 2;
+        }
+        std::vector<RadianceCacheEntry> empty(_size, RadianceCacheEntry{ RADIANCE_CACHE_EMPTY, 0, 0, 0 });
+        _buf->load_data(empty, 0);
+    }
+
+    // Drops every entry
+    void clear()
+    {
+        uint32_t zero = 0;
+        glClearNamedBufferData(_buf->get_buffer_name(), GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    }
+
+    // Passed to the shader as cache_frame
+    void advance_frame()
+    {
+        _frame += 1;
+    }
+
+    int frame() const
+    {
+        return _frame;
+    }
+
+    // Slot index mask, the table size minus one
+    int mask() const
+    {
+        return _size - 1;
+    }
+
+    std::shared_ptr<graphics::Buffer<RadianceCacheEntry>> get_buffer()
+    {
+        return _buf;
+    }
+
+private:
+    std::shared_ptr<graphics::Buffer<RadianceCacheEntry>> _buf;
+    int _size;
+    int _frame;
+};
+
+#endif  // GRAPHICS_RADIANCE_CACHE_H_
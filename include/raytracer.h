@@ -2,7 +2,12 @@
 #ifndef GRAPHICS_RAYTRACER_H_
 #define GRAPHICS_RAYTRACER_H_
 
+#include <deque>
+#include <filesystem>
+#include <map>
 #include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
 #include <ctime>
 
@@ -17,12 +22,56 @@
 #include "shader.h"
 #include "buffer.h"
 #include "octree.h"
+#include "radiance_cache.h"
 
+#include "async_readback.h"
 #include "chunk_memory.h"
+#include "chunk_streamer.h"
+#include "frame_sync.h"
+#include "frame_uniforms.h"
+#include "gpu_timer.h"
+#include "light_cache_file.h"
+#include "light_list.h"
+#include "light_smoothing.h"
+#include "mapped_file.h"
+#include "region_pager.h"
+#include "texture_cache.h"
+#include "workgroup_tuner.h"
 
 
 #define MAX_OCTREE_ELEMENTS 1000
 
+// Blocks from the camera before chunks switch to their first LOD level
+const float default_lod_distance = 64.0f;
+
+// GI filter passes, must match gi_filter.glsl
+const int gi_filter_temporal = 0;
+const int gi_filter_atrous = 1;
+const int gi_filter_composite = 2;
+
+// Neighbourhood smooth_light() averages over
+const int light_smoothing_radius = 2;
+
+// A-trous iterations, the filter reaches 2 * (2^iterations - 1) pixels out
+const int default_gi_filter_iterations = 4;
+
+// Texture unit of the block texture array, must match multi_ray.glsl
+const int block_texture_unit = 0;
+
+// Trace local size until set_trace_group_size() or autotune_workgroups()
+const glm::ivec2 default_trace_group_size(8, 8);
+
+// Lowest render scale, see Raytracer::set_render_scale()
+const float min_render_scale = 0.25f;
+// Most the dynamic render scale changes per frame, and the frame time
+// error it ignores, both relative
+const float dynamic_render_scale_step = 0.05f;
+const float dynamic_render_scale_deadband = 0.05f;
+
+// Light caches, must match multi_ray.glsl
+const int light_cache_octree = 0;
+const int light_cache_hash = 1;
+
 namespace graphics
 {
 
@@ -38,28 +87,26 @@ class Raytracer
 public:
 	Raytracer(int x_chunk_size, int y_chunk_size, int z_chunk_size, int x_res=1024, int y_res=1024,
 		int map_size_x=10, int map_size_y=5, int map_size_z=10,
-		int low_res_div=8) :
+		int low_res_div=8, int octree_max_nodes=default_octree_max_capacity) :
 		_low_res_div(low_res_div),
 		_x_res(x_res),
 		_y_res(y_res),
 		_map_size_x(map_size_x),
 		_map_size_y(map_size_y),
 		_map_size_z(map_size_z),
-		_mip_map_levels(3),
-		_light_octree(),
+		_light_octree(default_octree_initial_capacity, octree_max_nodes),
+		_light_cache_mode(light_cache_octree),
 		_chunk_buffer_manager(x_chunk_size, y_chunk_size, z_chunk_size, 
 			_map_size_x*_map_size_y*_map_size_z/2, 
 			_map_size_x, _map_size_y, _map_size_z),
+		_chunk_streamer(_chunk_buffer_manager),
 		_cube_locs_buf(std::make_shared<graphics::Buffer<glm::vec4>>(GL_SHADER_STORAGE_BUFFER)),
 		//_cube_state_buf(std::make_shared<graphics::Buffer<GLint>>(GL_SHADER_STORAGE_BUFFER)),
 		_cube_state_buf(_chunk_buffer_manager.get_chunk_buffer()),
 		_chunk_index_buf(_chunk_buffer_manager.get_index_buffer()),
 		_chunk_map_buf(_chunk_buffer_manager.get_map_buffer()),
 		_cube_colors_buf(std::make_shared<graphics::Buffer<glm::vec4>>(GL_SHADER_STORAGE_BUFFER)),
-		_texture_buf(std::make_shared<graphics::Buffer<glm::vec4>>(GL_SHADER_STORAGE_BUFFER)),
-		_octree_buf(_light_octree.get_buffer()),//std::make_shared<graphics::Buffer<Octree::Node>>(GL_SHADER_STORAGE_BUFFER)),
 		_octree_values(std::make_shared<graphics::Buffer<glm::vec4>>(GL_SHADER_STORAGE_BUFFER)),
-		_mip_map_bufs(_mip_map_levels, std::make_shared<graphics::Buffer<glm::vec4>>(GL_SHADER_STORAGE_BUFFER)),
 		_focal_length(0.5),
 		_cam_horiz_angle(40 * 3.14159 / 180),
 		_cam_vertic_angle(40*3.14159/180), 
@@ -77,13 +124,43 @@ public:
 		_block_types(std::make_shared<graphics::Texture2D>(x_res, y_res)),
 		_norm_tex_low_res(std::make_shared<graphics::Texture2D>(x_res/_low_res_div, y_res/ _low_res_div)),
 		_pos_tex(std::make_shared<graphics::Texture2D>(x_res/ _low_res_div, y_res/ _low_res_div)),
-		_c_shader(std::make_shared<graphics::ComputeShader>("../shaders/multi_ray.glsl")),
-		//_c_shader(std::make_shared<graphics::ComputeShader>("shaders/distance_split_proto.glsl")),
+		_gi_history({ std::make_shared<graphics::Texture2D>(x_res, y_res),
+			std::make_shared<graphics::Texture2D>(x_res, y_res) }),
+		_gi_filter_temp({ std::make_shared<graphics::Texture2D>(x_res, y_res),
+			std::make_shared<graphics::Texture2D>(x_res, y_res) }),
+		_norm_history(std::make_shared<graphics::Texture2D>(x_res, y_res)),
+		_smooth_src(std::make_shared<graphics::Texture2D>(x_res, y_res)),
+		_display_tex(std::make_shared<graphics::Texture2D>(x_res, y_res)),
+		_pos_readback(x_res / _low_res_div, y_res / _low_res_div),
+		_frame_uniform_buf(std::make_shared<graphics::Buffer<FrameUniforms>>(GL_UNIFORM_BUFFER)),
+		_pos_size(0, 0),
+		_pos_data_size(0, 0),
+		_octree_write_frame(-1),
+		_octree_edit_pending(false),
+		_gi_history_index(0),
+		_gi_history_valid(false),
+		_gi_filter_iterations(default_gi_filter_iterations),
+		_gi_upsampling(true),
+		_trace_programs("../shaders/multi_ray.glsl"),
+		//_trace_programs("shaders/distance_split_proto.glsl"),
+		_specialize_trace(true),
+		_trace_group_size(default_trace_group_size),
+		_render_scale(1.0f),
+		_dynamic_target_ms(0),
+		_dynamic_min_scale(min_render_scale),
+		_dynamic_max_scale(1.0f),
+		_frame_ms_avg(0),
+		_display_upscaled(false),
 		_filter_shader(std::make_shared<graphics::ComputeShader>("../shaders/gi_filter.glsl")),
+		_smooth_shader(std::make_shared<graphics::ComputeShader>("../shaders/smooth_light.glsl")),
+		_upscale_shader(std::make_shared<graphics::ComputeShader>("../shaders/upscale.glsl")),
+		_gi_upsample_shader(std::make_shared<graphics::ComputeShader>("../shaders/gi_upsample.glsl")),
 		_v_shader(std::make_shared<graphics::ScreenVertexShader>()),
 		_f_shader(std::make_shared<graphics::ScreenFragmentShader>()),
-		_compute_program(std::make_shared<graphics::Program>()),
 		_filter_program(std::make_shared<graphics::Program>()),
+		_smooth_program(std::make_shared<graphics::Program>()),
+		_upscale_program(std::make_shared<graphics::Program>()),
+		_gi_upsample_program(std::make_shared<graphics::Program>()),
 		_screen_program(std::make_shared<graphics::Program>()),
 		_screen(std::make_shared<graphics::Object>())
 	{
@@ -98,36 +175,48 @@ public:
 		g_oct_buf[0].size = 1000;
 		_octree_buf->load_data(g_oct_buf, 0);
 		*/
-		_compute_program->add_shader(_c_shader);
-		_compute_program->compile_and_link();
-		//_compute_program->bind_image_texture(_cube_locs, 0);
-		_compute_program->bind_image_texture(_out_tex, 1);
-		//_compute_program->bind_image_texture(_out_tex_bounce_pass, 3);
-		_compute_program->bind_image_texture(_out_tex_low_res, 7);
-		_compute_program->bind_image_texture(_block_types, 4);
-		_compute_program->bind_image_texture(_norm_tex, 6);
-		_compute_program->bind_image_texture(_norm_tex_low_res, 2);
-		_compute_program->bind_image_texture(_pos_tex, 0);
+		// Start every build before anything waits on one, so they can
+		// compile in parallel
+		_filter_program->add_shader(_filter_shader);
+		_filter_program->compile_and_link();
+		_smooth_program->add_shader(_smooth_shader);
+		_smooth_program->compile_and_link();
+		_upscale_program->add_shader(_upscale_shader);
+		_upscale_program->compile_and_link();
+		_gi_upsample_program->add_shader(_gi_upsample_shader);
+		_gi_upsample_program->compile_and_link();
+		_screen_program->add_shader(_v_shader);
+		_screen_program->add_shader(_f_shader);
+		_screen_program->compile_and_link();
+		_compute_program = _trace_programs.get(trace_defines(1, true));
+		bind_trace_images();
 		_compute_program->bind_storage_buffer(_cube_locs_buf, 0);
 		//_compute_program->bind_storage_buffer(_cube_colors_buf, 3);
 		_compute_program->bind_storage_buffer(_cube_state_buf, 4);
 		_compute_program->bind_storage_buffer(_chunk_index_buf, 6);
 		_compute_program->bind_storage_buffer(_chunk_map_buf, 3);
-		_compute_program->bind_storage_buffer(_octree_buf, 7);
 		_compute_program->bind_storage_buffer(_octree_values, 8);
+		_compute_program->bind_storage_buffer(_light_octree.get_allocator_buffer(), 10);
+		_compute_program->bind_storage_buffer(_radiance_cache.get_buffer(), 11);
 		//_compute_program->bind_image_texture(_norm_tex, 2);
 		//_compute_program->bind_image_texture(_cube_colors, 3);
 
-		_filter_program->add_shader(_filter_shader);
-		_filter_program->compile_and_link();
-		//_compute_program->bind_image_texture(_cube_locs, 0);
-		_filter_program->bind_image_texture(_out_tex, 1);
-		_filter_program->bind_image_texture(_norm_tex, 2);
-		_filter_program->bind_image_texture(_out_tex_bounce_pass, 3);
+		_filter_program->set_uniform_float("temporal_alpha", 0.1);
+		_filter_program->set_uniform_float("max_history", 32);
+		_filter_program->set_uniform_float("normal_phi", 32);
+		_filter_program->set_uniform_float("depth_phi", 0.02);
+		_filter_pass_uniform = _filter_program->get_uniform_handle("pass");
+		_filter_step_x_uniform = _filter_program->get_uniform_handle("step_x");
+		_filter_step_y_uniform = _filter_program->get_uniform_handle("step_y");
 
-		_screen_program->add_shader(_v_shader);
-		_screen_program->add_shader(_f_shader);
-		_screen_program->compile_and_link();
+		std::vector<FrameUniforms> frame_data(1);
+		_frame_uniform_buf->load_data(frame_data, 0);
+
+		_smooth_program->set_uniform_int("radius", light_smoothing_radius);
+		_upscale_program->set_uniform_float("normal_phi", 32);
+		_upscale_program->set_uniform_float("depth_phi", 0.02);
+		_gi_upsample_program->set_uniform_float("normal_phi", 32);
+		_gi_upsample_program->set_uniform_float("depth_phi", 0.02);
 
 
 		graphics::Mesh triangle_mesh;
@@ -143,13 +232,29 @@ public:
 		_screen_program->set_uniform_vec3("screen_size", glm::vec3(x_res, y_res, 0));
 
 		auto sizes = _chunk_buffer_manager.get_chunk_size();
-		_compute_program->set_uniform_int("chunk_count", _chunk_buffer_manager.get_max_chunks());
-		_compute_program->set_uniform_int("chunk_size_x", sizes[0]);
-		_compute_program->set_uniform_int("chunk_size_y", sizes[1]);
-		_compute_program->set_uniform_int("chunk_size_z", sizes[2]);
-		_compute_program->set_uniform_int("chunk_map_size_x", _map_size_x);
-		_compute_program->set_uniform_int("chunk_map_size_y", _map_size_y);
-		_compute_program->set_uniform_int("chunk_map_size_z", _map_size_z);
+		_trace_programs.set_uniform_int("chunk_count", _chunk_buffer_manager.get_max_chunks());
+		_trace_programs.set_uniform_int("chunk_size_x", sizes[0]);
+		_trace_programs.set_uniform_int("chunk_size_y", sizes[1]);
+		_trace_programs.set_uniform_int("chunk_size_z", sizes[2]);
+		_trace_programs.set_uniform_int("chunk_map_size_x", _map_size_x);
+		_trace_programs.set_uniform_int("chunk_map_size_y", _map_size_y);
+		_trace_programs.set_uniform_int("chunk_map_size_z", _map_size_z);
+		_trace_programs.set_uniform_int("chunk_stride", _chunk_buffer_manager.chunk_stride());
+		_trace_programs.set_uniform_int("chunk_lod_levels", _chunk_buffer_manager.lod_levels());
+		set_lod_distance(default_lod_distance);
+		_prev_render_size = glm::ivec2(_x_res, _y_res);
+		apply_render_scale(1.0f);
+		_trace_programs.set_uniform_int("radiance_cache_mask", _radiance_cache.mask());
+		_trace_programs.set_uniform_int("radiance_cache_max_age", default_radiance_cache_max_age);
+		_trace_programs.set_uniform_float("radiance_cache_cell_size", default_radiance_cache_cell_size);
+		_trace_programs.set_uniform_float("radiance_cache_lod_distance", default_radiance_cache_lod_distance);
+		set_light_cache_mode(light_cache_octree);
+		_chunk_buffer_manager.set_load_callback([this](glm::ivec3 chunk_coord, const int* blocks)
+			{
+				scan_emitters(chunk_coord, blocks);
+			});
+		_light_list.upload();
+		_trace_programs.set_uniform_int("light_count", _light_list.count());
 
 	}
 
@@ -184,7 +289,7 @@ public:
 		_cube_colors_buf->load_data(in_cube_colors,
 			0);
 
-		_compute_program->set_uniform_int("cube_count", _cube_count_x);
+		_trace_programs.set_uniform_int("cube_count", _cube_count_x);
 	}
 
 	void set_cube_states(std::vector<GLint> in_cube_states)
@@ -196,98 +301,240 @@ public:
 		_cube_state_buf->load_data(in_cube_states,
 			0);
 
-		_compute_program->set_uniform_int("cube_count_x", _cube_count_x);
-		_compute_program->set_uniform_int("cube_count_y", _cube_count_y);
-		_compute_program->set_uniform_int("cube_count_z", _cube_count_z);
+		_trace_programs.set_uniform_int("cube_count_x", _cube_count_x);
+		_trace_programs.set_uniform_int("cube_count_y", _cube_count_y);
+		_trace_programs.set_uniform_int("cube_count_z", _cube_count_z);
 	}
 
-	void set_textures(std::vector<std::string> in_image_filenames)
+	// Loads the block textures into one RGBA8 texture array, a layer per
+	// file in order. Layers take the largest image size; smaller images
+	// are scaled up. With a cache_path the decoded images and all their
+	// mip levels come from that file while it matches the sources, and
+	// are baked on the CPU and written to it when it doesn't. Without
+	// one, mip levels are generated on the GPU.
+	void set_textures(std::vector<std::string> in_image_filenames, std::string cache_path="")
 	{
-		unsigned char* pixels = NULL;
-		unsigned int width, height;
-		std::vector <glm::vec4> pixel_vec;
-		std::vector<std::vector <glm::vec4>> mip_map_vectors(_mip_map_levels);
+		if (!cache_path.empty())
+		{
+			set_textures_cached(in_image_filenames, cache_path);
+			return;
+		}
+		struct Image
+		{
+			unsigned char* pixels;
+			unsigned int width;
+			unsigned int height;
+		};
+		std::vector<Image> images;
+		unsigned int max_width = 1;
+		unsigned int max_height = 1;
 		for (auto f : in_image_filenames)
 		{
-			std::vector<glm::vec4> prev_level;
-			unsigned int err = loadbmp_decode_file(f.c_str(), &pixels, &width, &height, LOADBMP_RGBA);
-			for (int i = 0; i < 4*width * height; i+=4)
+			Image image = { NULL, 0, 0 };
+			unsigned int err = loadbmp_decode_file(f.c_str(), &image.pixels, &image.width, &image.height, LOADBMP_RGBA);
+			if (err)
 			{
-				pixel_vec.push_back(glm::vec4(float(pixels[i] / 256.0),
-					float(pixels[i + 1]/256.0),
-					float(pixels[i + 2] / 256.0),
-					float(pixels[i + 3] / 256.0)));
-				prev_level.push_back(glm::vec4(float(pixels[i] / 256.0),
-					float(pixels[i + 1] / 256.0),
-					float(pixels[i + 2] / 256.0),
-					float(pixels[i + 3] / 256.0)));
+				std::cout << "Couldn't load texture " << f << "\n";
+				image.pixels = NULL;
+				image.width = 0;
+				image.height = 0;
 			}
-
-			// Mip map calculation. Four pixel average.
-			int prev_width = width;
-			int prev_height = height;
-			int next_width = width;
-			int next_height = height;
-			for (int i = 0; i < _mip_map_levels; ++i)
-			{
-				prev_width = next_width;
-				prev_height = next_height;
-				next_width = next_width / 2;
-				next_height = next_height / 2;
-
-				std::vector<glm::vec4> next_level(next_width * next_height);
-
-				for (int k = 0; k < next_width; ++k)
-				{
-					for (int n = 0; n < next_height; ++n)
-					{
-						glm::vec4 pix1 = prev_level[(k * 2) + prev_width * (n * 2)];
-						glm::vec4 pix2 = prev_level[(k * 2 + 1) + prev_width * (n * 2)];
-						glm::vec4 pix3 = prev_level[(k * 2) + prev_width * (n * 2 + 1)];
-						glm::vec4 pix4 = prev_level[(k * 2 + 1) + prev_width * (n * 2 + 1)];
-						next_level[k + next_width * n] = (pix1 + pix2 + pix3 + pix4) / 4.0f;
-					}
-				}
-				mip_map_vectors[i].insert(mip_map_vectors[i].end(), next_level.begin(), next_level.end());
-				prev_level = next_level;
-			}
-			//pixel_vec.insert(pixel_vec.end(), pixels, pixels + width * height);
-			free(pixels);
+			max_width = std::max(max_width, image.width);
+			max_height = std::max(max_height, image.height);
+			images.push_back(image);
 		}
 
-		_texture_buf->load_data(pixel_vec);
-		_compute_program->bind_storage_buffer(_texture_buf, 5);
-		for (int i = 0; i < _mip_map_levels; ++i)
+		_block_textures = std::make_shared<graphics::Texture2DArray>(max_width, max_height,
+			std::max<int>(images.size(), 1));
+		for (int i = 0; i < images.size(); ++i)
 		{
-			_mip_map_bufs[i]->load_data(mip_map_vectors[i]);
-			_compute_program->bind_storage_buffer(_mip_map_bufs[i], 20+i);
+			if (images[i].pixels)
+			{
+				_block_textures->set_layer(i, images[i].width, images[i].height, images[i].pixels);
+				free(images[i].pixels);
+			}
 		}
-		_compute_program->set_uniform_int("tex_width", width);
-		_compute_program->set_uniform_int("tex_height", height);
-		_compute_program->set_uniform_int("tex_count", in_image_filenames.size());
+		_block_textures->generate_mipmaps();
+		_block_textures->bind_unit(block_texture_unit);
+		_trace_programs.set_uniform_int("tex_size", max_width);
 	}
 
-	void draw(int x_width, int y_width, int bounces, bool include_first_bounce=true, bool filter=false)
+	// Traces a frame and draws it to the screen. Without
+	// include_first_bounce it only gathers bounce light at 1/low_res_div
+	// resolution. Group counts follow from the target size and the trace
+	// local size.
+	void draw(int bounces, bool include_first_bounce=true, bool filter=false)
 	{
-		_compute_program->set_uniform_int("max_bounces", bounces);
-		_compute_program->set_uniform_int("include_first_bounce", int(include_first_bounce));
-		_compute_program->run_compute_program(x_width, y_width);
-		//glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT || GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-		if (filter)
+		// Waits for the frame frames_in_flight back, not the last one.
+		// Nothing else in a frame waits on the GPU; refresh_octree() only
+		// checks whether the frames that wrote the octree are done.
+		_frame_sync.begin_frame();
+		update_dynamic_render_scale();
+		_profiler.begin("frame");
+		_chunk_streamer.update();
+		_chunk_buffer_manager.flush_edits();
+		_profiler.begin("trace");
+		trace(bounces, include_first_bounce);
+		_profiler.end("trace");
+		// With the hash cache the bounce light is looked up per pixel, not
+		// taken from the low resolution pass
+		if (include_first_bounce && _gi_upsampling && _light_cache_mode == light_cache_octree)
 		{
-			//_filter_program->run_compute_program(x_width, y_width);
+			_profiler.begin("gi_upsample");
+			upsample_gi();
+			_profiler.end("gi_upsample");
+		}
+		// The filter only applies to the full resolution pass that adds the bounce light
+		if (filter && include_first_bounce)
+		{
+			filter_gi();
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+		}
+		if (include_first_bounce)
+		{
+			_display_upscaled = get_render_size() != glm::ivec2(_x_res, _y_res);
+			if (_display_upscaled)
+			{
+				_profiler.begin("upscale");
+				upscale();
+				_profiler.end("upscale");
+			}
 		}
-		//glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT || GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-		glFinish();
 
 		graphics::set_draw_target(nullptr);
 		graphics::start_loop();
 		//smooth_light();
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, _out_tex->get_texture_name());
+		glBindTexture(GL_TEXTURE_2D, (_display_upscaled ? _display_tex : _out_tex)->get_texture_name());
 		//get_data();
+		_profiler.begin("screen");
 		graphics::draw_object(_screen, _camera);
+		_profiler.end("screen");
 		graphics::end_loop();
+		_profiler.end("frame");
+		_frame_sync.end_frame();
+	}
+
+	// Edge aware a-trous filter over the bounce light, fed by a temporal
+	// history that is reprojected with the camera movement since the last
+	// filtered frame. Runs on whatever the last full resolution pass wrote.
+	void filter_gi()
+	{
+		int cur = _gi_history_index;
+		int prev = 1 - cur;
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		// The camera and history_valid come from the frame uniforms
+		_filter_program->bind_image_texture(_out_tex, 1);
+		_filter_program->bind_image_texture(_norm_tex, 2);
+		_filter_program->bind_image_texture(_out_tex_bounce_pass, 3);
+		_filter_program->bind_image_texture(_gi_history[prev], 6);
+		_filter_program->bind_image_texture(_norm_history, 7);
+
+		_profiler.begin("gi_temporal");
+		run_filter_pass(gi_filter_temporal, _gi_history[prev], _gi_history[cur]);
+		_profiler.end("gi_temporal");
+
+		// Horizontal then vertical 5 tap pass per iteration, ping ponging
+		// between the temp textures so the history stays untouched
+		_profiler.begin("gi_atrous");
+		std::shared_ptr<graphics::Texture2D> src = _gi_history[cur];
+		for (int i = 0; i < _gi_filter_iterations; ++i)
+		{
+			for (int dir = 0; dir < 2; ++dir)
+			{
+				std::shared_ptr<graphics::Texture2D> dst = _gi_filter_temp[dir];
+				_filter_program->set_uniform_int(_filter_step_x_uniform, dir == 0 ? 1 << i : 0);
+				_filter_program->set_uniform_int(_filter_step_y_uniform, dir == 1 ? 1 << i : 0);
+				run_filter_pass(gi_filter_atrous, src, dst);
+				src = dst;
+			}
+		}
+		_profiler.end("gi_atrous");
+
+		_profiler.begin("gi_composite");
+		run_filter_pass(gi_filter_composite, src, src);
+		_profiler.end("gi_composite");
+
+		_gi_history_index = prev;
+		_gi_history_valid = true;
+		_prev_cam_pos = _cam_pos;
+		_prev_cam_11 = _cam_11;
+		_prev_cam_12 = _cam_12;
+		_prev_cam_21 = _cam_21;
+		_prev_render_size = get_render_size();
+	}
+
+	// Traces at scale times the display resolution along each axis, and
+	// scales the result up to it with an edge aware filter. Cuts the
+	// primary and GI rays by about scale squared. 1 traces at full
+	// resolution and skips the upscale. Turns the dynamic scale off.
+	void set_render_scale(float scale)
+	{
+		_dynamic_target_ms = 0;
+		apply_render_scale(glm::clamp(scale, min_render_scale, 1.0f));
+	}
+
+	float get_render_scale() const
+	{
+		return _render_scale;
+	}
+
+	// Moves the render scale between min_scale and max_scale every frame
+	// to keep the GPU time of draw() near target_ms. Reads the profiler's
+	// "frame" pass, so the profiler has to stay enabled.
+	void set_dynamic_render_scale(float target_ms, float min_scale=min_render_scale, float max_scale=1.0f)
+	{
+		_dynamic_target_ms = target_ms;
+		_dynamic_min_scale = glm::clamp(min_scale, min_render_scale, 1.0f);
+		_dynamic_max_scale = glm::clamp(max_scale, _dynamic_min_scale, 1.0f);
+		_frame_ms_avg = 0;
+	}
+
+	// Pixels traced by the full resolution pass; the low resolution pass
+	// traces 1/low_res_div of that
+	glm::ivec2 get_render_size() const
+	{
+		if (_render_scale >= 1.0f)
+		{
+			return glm::ivec2(_x_res, _y_res);
+		}
+		return glm::ivec2(std::max(_low_res_div, int(_x_res * _render_scale)),
+			std::max(_low_res_div, int(_y_res * _render_scale)));
+	}
+
+	void set_gi_filter_iterations(int iterations)
+	{
+		_gi_filter_iterations = iterations;
+	}
+
+	// Blends the low resolution bounce light into the full resolution
+	// pass with a joint bilateral filter guided by its normals and depth,
+	// instead of taking the nearest low resolution texel. On by default.
+	// Only used with the octree light cache.
+	void set_gi_upsampling(bool enabled)
+	{
+		_gi_upsampling = enabled;
+	}
+
+	// Drops the temporal history, e.g. after a camera cut
+	void reset_gi_history()
+	{
+		_gi_history_valid = false;
+	}
+
+	// GPU milliseconds of a pass a few frames ago: "frame", "trace",
+	// "gi_upsample", "gi_temporal", "gi_atrous", "gi_composite", "upscale"
+	// or "screen". 0 until a measurement is available.
+	double get_pass_time(const std::string& name)
+	{
+		return _profiler.last_ms(name);
+	}
+
+	// Per pass statistics, also written by its write_csv() and write_json()
+	graphics::GpuProfiler& get_profiler()
+	{
+		return _profiler;
 	}
 
 	void get_data()
@@ -307,40 +554,32 @@ public:
 		in_vec[x_size * y + x] = in_val;
 	}
 
+	// Blends the lighting in out_tex across neighbouring pixels of the
+	// same surface. Runs entirely on the GPU.
 	void smooth_light()
 	{
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+		glm::ivec2 size = get_render_size();
+		glCopyImageSubData(_out_tex->get_texture_name(), GL_TEXTURE_2D, 0, 0, 0, 0,
+			_smooth_src->get_texture_name(), GL_TEXTURE_2D, 0, 0, 0, 0,
+			size.x, size.y, 1);
+		_smooth_program->bind_image_texture(_out_tex, 1);
+		_smooth_program->bind_image_texture(_norm_tex, 2);
+		_smooth_program->bind_image_texture(_smooth_src, 4);
+		_smooth_program->dispatch_for_size(size.x, size.y);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+
+	// Same as smooth_light() but on the CPU, for headless testing. Always
+	// covers the full resolution.
+	void smooth_light_cpu(int thread_count = 0)
+	{
+		std::vector<glm::vec4> smoothed;
 		_out_tex->get_data(_out_vec1);
 		_norm_tex->get_data(_out_vec2);
-
-		int radius = 2;
-
-		for (int x_offset = -radius; x_offset < radius + 1; ++x_offset)
-		{
-			for (int y_offset = -radius; y_offset < radius + 1; ++y_offset)
-			{
-				for (int i = std::abs(x_offset); i < 1024 - std::abs(x_offset); ++i)
-				{
-					for (int j = std::abs(y_offset); j < 1024 - std::abs(y_offset); ++j)
-					{
-						glm::vec4 v1 = tex_index(_out_vec1, i, j, 1024, 1024);
-						glm::vec4 v2 = tex_index(_out_vec1, i + x_offset, j + y_offset, 1024, 1024);
-						glm::vec4 n1 = tex_index(_out_vec2, i, j, 1024, 1024);
-						glm::vec4 n2 = tex_index(_out_vec2, i + x_offset, j + y_offset, 1024, 1024);
-
-						if (glm::dot(glm::vec3(n1), glm::vec3(n2)) > 0.1 && std::abs(n1.w - n2.w) < 0.5)
-						{
-							//std::cout << glm::length(n1) << ", " << glm::length(n2) << "\n";
-							set_tex_index(_out_vec1, (v1 + v2) / 2.0f, i, j, 1024, 1024);
-							set_tex_index(_out_vec1, (v1 + v2) / 2.0f, i + x_offset, j + y_offset, 1024, 1024);
-						}
-						else
-						{
-						}
-					}
-				}
-			}
-		}
-		_out_tex->set_data(0,0,1024,1024,_out_vec1);
+		::smooth_light_cpu(_out_vec1, _out_vec2, _x_res, _y_res,
+			light_smoothing_radius, smoothed, thread_count);
+		_out_tex->set_data(0, 0, _x_res, _y_res, smoothed);
 	}
 
 #ifndef _SHARED_CAM
@@ -362,110 +601,708 @@ public:
 			in_cam->get_up_vector() * cam_height;
 		_cam_21 = center + in_cam->get_right_vector() * cam_width -
 			in_cam->get_up_vector() * cam_height;
-		_compute_program->set_uniform_vec3("ray00", _cam_11 - _cam_pos);
-		_compute_program->set_uniform_vec3("ray01", _cam_12 - _cam_pos);
-		_compute_program->set_uniform_vec3("ray10", _cam_21 - _cam_pos);
-		_compute_program->set_uniform_vec3("ray11", _cam_22 - _cam_pos);
-		_compute_program->set_uniform_vec3("eye", _cam_pos);
-
-		_compute_program->set_uniform_double("ttime", cur_time());
-		
+		// Uploaded with the rest of the frame uniforms in draw()
 		//refresh_octree(_cam_pos);
 		//_octree_buf->load_data(_light_octree._oct_buf);
 	}
 
+	// Grows the light octree around the hit positions of the low
+	// resolution pass and evicts from it. pos_tex is read back
+	// asynchronously, so this works on positions from a frame or two ago
+	// and does nothing until the first readback lands. Never waits on the
+	// GPU: once positions are in, the bounce pass stops writing the tree
+	// and the edit is made on a later call, when the last frame that wrote
+	// it has finished.
 	void refresh_octree(glm::vec3 cam_pos)
 	{
-		_light_octree.map(true);
-		static int count = 0;
-		count += 1;
-		if (count % 5 == 0)
+		// The hash cache is filled by the shader itself
+		if (_light_cache_mode != light_cache_octree)
 		{
-			_light_octree.cleanup(cam_pos, 50);
-			//_light_octree.reset();
-			count = 0;
+			return;
 		}
-		else
+		if (_pos_readback.request(_pos_tex))
+		{
+			_pos_readback_sizes.push_back(_pos_size);
+		}
+		if (_pos_readback.poll(_pos_data))
+		{
+			_pos_data_size = _pos_readback_sizes.front();
+			_pos_readback_sizes.pop_front();
+			_octree_edit_pending = true;
+		}
+		if (!_octree_edit_pending || !_frame_sync.finished(_octree_write_frame))
 		{
-			
+			return;
 		}
+		_octree_edit_pending = false;
+		// Below render scale 1 the bounce pass only writes a corner of
+		// pos_tex; the rest is stale or was never written
+		glm::ivec2 pos_size = _pos_data_size;
+		if (pos_size.x <= 0 || pos_size.y <= 0)
+		{
+			return;
+		}
+
+		_light_octree.map(true);
+		if (_light_cache_chunks.size())
+		{
+			check_light_cache_chunks();
+		}
+		_light_octree.evict_lru();
 		
-		std::vector<Octree> g_oct_buf;
-		std::vector<glm::vec4> tex_data;
-		_pos_tex->get_data(tex_data);
-		for (int i = 0; i < _y_res/_low_res_div; ++i)
+		int pos_width = _x_res / _low_res_div;
+		std::vector<glm::vec3> coords(pos_size.x * pos_size.y);
+		std::vector<int> depths(coords.size());
+		for (int i = 0; i < coords.size(); ++i)
 		{
-			for (int j = 0; j < _x_res/_low_res_div; ++j)
+			glm::vec3 val = glm::vec3(_pos_data[i % pos_size.x + (i / pos_size.x) * pos_width]);
+			float dist = glm::length(cam_pos - val);
+			int oct_depth = 1;
+			if (dist < 10)
 			{
-				glm::vec3 val = glm::vec3(tex_data[j + (_x_res/ _low_res_div) * i]);
-				float dist = glm::length(cam_pos - val);
-				int oct_depth = 1;
-				if (dist < 10)
-				{
-					oct_depth = 15;
-				}
-				else if (dist < 20)
-				{
-					oct_depth = 14;
-				}
-				else if (dist < 50)
-				{
-					oct_depth = 10;
-				}
-				else if (dist < 200)
+				oct_depth = 15;
+			}
+			else if (dist < 20)
+			{
+				oct_depth = 14;
+			}
+			else if (dist < 50)
+			{
+				oct_depth = 10;
+			}
+			else
+			{
+				oct_depth = 2;
+			}
+			coords[i] = val;
+			depths[i] = oct_depth;
+		}
+		_light_octree.lookup_batch(coords, depths, true);
+		_light_octree.unmap(true);
+	}
+
+	void add_chunk(int x, int y, int z, const std::vector<int>& blocks)
+	{
+		_chunk_buffer_manager.add_chunk(x, y, z, blocks);
+	}
+
+	// Queues a chunk for upload on a later frame. Safe to call from any
+	// thread; closer chunks are uploaded first.
+	void request_chunk(int x, int y, int z, std::vector<int>&& blocks)
+	{
+		_chunk_streamer.request_chunk(x, y, z, std::move(blocks));
+	}
+
+	// Block edits in world block coordinates. Edits are batched and
+	// uploaded once per frame in draw().
+	bool set_block(int x, int y, int z, int type)
+	{
+		if (!_chunk_buffer_manager.set_block(x, y, z, type))
+		{
+			return false;
+		}
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		glm::ivec3 chunk_coord(floor_div(x, sizes[0]), floor_div(y, sizes[1]), floor_div(z, sizes[2]));
+		_light_list.set_emitter(chunk_coord, glm::vec3(x, y, z) + 0.5f, type == emissive_block_type);
+		return true;
+	}
+
+	int fill_region(glm::ivec3 min_corner, glm::ivec3 max_corner, int type)
+	{
+		int count = _chunk_buffer_manager.fill_region(min_corner, max_corner, type);
+		// Rescan the touched chunks instead of tracking every block
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		glm::ivec3 size(sizes[0], sizes[1], sizes[2]);
+		for (int z = floor_div(min_corner.z, size.z); z <= floor_div(max_corner.z, size.z); ++z)
+		{
+			for (int y = floor_div(min_corner.y, size.y); y <= floor_div(max_corner.y, size.y); ++y)
+			{
+				for (int x = floor_div(min_corner.x, size.x); x <= floor_div(max_corner.x, size.x); ++x)
 				{
-					oct_depth = 2;
+					const int* blocks = _chunk_buffer_manager.resident_chunk_data(glm::ivec3(x, y, z));
+					if (blocks)
+					{
+						scan_emitters(glm::ivec3(x, y, z), blocks);
+					}
 				}
-				else
+			}
+		}
+		return count;
+	}
+
+	// Point lights, shaded together with the emissive blocks. radius > 0
+	// keeps shadow rays from hitting geometry that far around the light.
+	int add_light(glm::vec3 position, glm::vec3 color, float intensity, float radius = 0)
+	{
+		return _light_list.add_light(position, color, intensity, radius);
+	}
+
+	bool remove_light(int id)
+	{
+		return _light_list.remove_light(id);
+	}
+
+	// Light given off by each block of type emissive_block_type
+	void set_emissive_light(glm::vec3 color, float intensity)
+	{
+		_light_list.set_emissive_light(color, intensity);
+	}
+
+	int get_block(int x, int y, int z) const
+	{
+		return _chunk_buffer_manager.get_block(x, y, z);
+	}
+
+	// Bytes of chunk data uploaded per frame at most
+	void set_chunk_upload_budget(size_t bytes)
+	{
+		_chunk_streamer.set_frame_budget(bytes);
+	}
+
+	// light_cache_octree keeps bounce light in the octree that
+	// refresh_octree() grows on the CPU. light_cache_hash keeps it in
+	// RadianceCache, which the trace fills and reads with no CPU work.
+	void set_light_cache_mode(int mode)
+	{
+		if (mode == light_cache_hash && _light_cache_mode != light_cache_hash)
+		{
+			_radiance_cache.clear();
+		}
+		_light_cache_mode = mode;
+		_trace_programs.set_uniform_int("light_cache_mode", mode);
+	}
+
+	// Traces with a multi_ray.glsl variant that has the chunk layout and
+	// the bounce settings of each draw() compiled in, so the compiler can
+	// fold them. Each combination is compiled on its first draw. On by
+	// default; off traces with the generic variant that reads them from
+	// uniforms.
+	void set_trace_specialization(bool enabled)
+	{
+		_specialize_trace = enabled;
+	}
+
+	// local_size x and y of the trace shader. Each size is compiled on
+	// its first draw.
+	void set_trace_group_size(glm::ivec2 size)
+	{
+		_trace_group_size = size;
+	}
+
+	glm::ivec2 get_trace_group_size() const
+	{
+		return _trace_group_size;
+	}
+
+	// Keeps the linked shader programs in directory, so runs after the
+	// first load multi_ray.glsl and its variants instead of compiling
+	// them. Call it with the GL context current and before constructing
+	// a Raytracer; programs built earlier aren't cached. Off by default,
+	// and an empty directory turns it off again.
+	static void set_program_cache_directory(const std::string& directory)
+	{
+		graphics::program_binary_cache().set_directory(directory);
+	}
+
+	// Picks the trace work group size for this GPU and returns it. Takes
+	// the size stored for GL_RENDERER in cache_path when there is one;
+	// otherwise, or with retune, times a low resolution and a full
+	// resolution trace from the current camera for every candidate size
+	// and stores the fastest. Set up the camera and chunks for a typical
+	// view first. Without a cache_path it always tunes and stores nothing.
+	glm::ivec2 autotune_workgroups(const std::string& cache_path="", int bounces=1, bool retune=false)
+	{
+		graphics::WorkgroupTuner tuner(cache_path);
+		glm::ivec2 size;
+		if (!retune && tuner.find("trace", size))
+		{
+			_trace_group_size = size;
+			return size;
+		}
+		_frame_sync.wait_all();
+		_chunk_streamer.update();
+		_chunk_buffer_manager.flush_edits();
+		size = tuner.tune("trace", [&](glm::ivec2 candidate)
+			{
+				_trace_group_size = candidate;
+				trace(bounces, false);
+				trace(bounces, true);
+			});
+		_trace_group_size = size.x ? size : default_trace_group_size;
+		// Only the winner's variants are used from here on
+		_trace_programs.clear();
+		return _trace_group_size;
+	}
+
+	// Distance in blocks beyond which chunks are traced at 2x block size,
+	// doubling for each further LOD level. 0 always uses full resolution.
+	void set_lod_distance(float distance)
+	{
+		_trace_programs.set_uniform_float("lod_distance", distance);
+	}
+
+	// Recenters the chunk map on in_vec. Returns the chunk coordinates
+	// that just came into range and need to be loaded.
+	std::vector<glm::ivec3> set_ref(glm::vec3 in_vec)
+	{
+		_chunk_streamer.set_focus(in_vec);
+		std::vector<glm::ivec3> exposed = _chunk_buffer_manager.set_ref(in_vec);
+		if (_region_pager)
+		{
+			_region_pager->set_focus(in_vec);
+			_region_pager->set_window(_chunk_buffer_manager.get_ref(),
+				glm::ivec3(_map_size_x, _map_size_y, _map_size_z));
+		}
+		if (exposed.size())
+		{
+			page_in(exposed);
+		}
+		return exposed;
+	}
+
+	// Backs the world with region files in directory. Chunks that come
+	// into range are paged in from disk, and chunks with unsaved changes
+	// are written back when they're evicted or on save_world(). The file
+	// IO runs on the pager's own thread.
+	void set_world_directory(const std::string& directory)
+	{
+		std::filesystem::create_directories(directory);
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		_region_pager.reset();
+		_region_pager = std::make_unique<RegionPager>(directory,
+			glm::ivec3(sizes[0], sizes[1], sizes[2]), _chunk_streamer);
+		_region_pager->set_window(_chunk_buffer_manager.get_ref(),
+			glm::ivec3(_map_size_x, _map_size_y, _map_size_z));
+		_chunk_buffer_manager.set_evict_callback([this](glm::ivec3 chunk_coord, const int* blocks)
+			{
+				_region_pager->write_chunk(chunk_coord, blocks);
+			});
+
+		// Page in everything already covered by the map window
+		glm::ivec3 origin = _chunk_buffer_manager.get_ref();
+		std::vector<glm::ivec3> window;
+		for (int z = origin.z; z < origin.z + _map_size_z; ++z)
+		{
+			for (int y = origin.y; y < origin.y + _map_size_y; ++y)
+			{
+				for (int x = origin.x; x < origin.x + _map_size_x; ++x)
 				{
-					oct_depth = 2;
+					window.push_back(glm::ivec3(x, y, z));
 				}
-				_light_octree.lookup(oct_depth, val, true);
 			}
 		}
-		_light_octree.unmap(true);
+		page_in(window);
 	}
 
-	void add_chunk(int x, int y, int z, std::vector<int> blocks)
+	// Writes every resident chunk with unsaved changes to the region files
+	// and waits until they are on disk. Returns the number of chunks written.
+	int save_world()
 	{
-		_chunk_buffer_manager.add_chunk(x, y, z, blocks);
+		if (!_region_pager)
+		{
+			return 0;
+		}
+		int written = _chunk_buffer_manager.save_unsaved([this](glm::ivec3 chunk_coord, const int* blocks)
+			{
+				_region_pager->write_chunk(chunk_coord, blocks);
+			});
+		_region_pager->flush_writes();
+		return written;
 	}
 
-	void set_ref(glm::vec3 in_vec)
+	// Writes the light octree to path along with a hash of every resident
+	// chunk, so a later load_light_cache() into the same world can start
+	// with converged indirect light. world_id is any number the
+	// application uses to tell its worlds apart.
+	bool save_light_cache(const std::string& path, uint64_t world_id)
 	{
-		_chunk_buffer_manager.set_ref(in_vec);
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		int block_count = sizes[0] * sizes[1] * sizes[2];
+		std::vector<LightCacheChunk> chunks;
+		_chunk_buffer_manager.for_each_resident([&](glm::ivec3 chunk_coord, const int* blocks)
+			{
+				chunks.push_back({ { chunk_coord.x, chunk_coord.y, chunk_coord.z },
+					chunk_content_hash(blocks, block_count) });
+			});
+		_frame_sync.wait_all();
+		_light_octree.map(true);
+		bool ok = write_light_cache(path, world_id, sizes.data(), chunks,
+			_light_octree._oct_array, _light_octree.node_count());
+		_light_octree.unmap(true);
+		if (!ok)
+		{
+			std::cout << "Couldn't write light cache: " << path << "\n";
+		}
+		return ok;
+	}
+
+	// Streams a light cache written by save_light_cache() straight from
+	// a mapping of the file into the octree buffer. Light around resident
+	// chunks that changed since the save is cleared; chunks that aren't
+	// resident yet are checked by refresh_octree() once they arrive.
+	// Returns false, leaving the octree alone, if the file doesn't exist
+	// or belongs to another world.
+	bool load_light_cache(const std::string& path, uint64_t world_id)
+	{
+		MappedFile file(path);
+		if (!file.is_open() || file.size() < sizeof(LightCacheHeader))
+		{
+			return false;
+		}
+		LightCacheHeader header;
+		memcpy(&header, file.data(), sizeof(header));
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		if (memcmp(header.magic, light_cache_magic, 4) != 0 ||
+			header.version != light_cache_version ||
+			header.node_bytes != sizeof(OctreeNode))
+		{
+			std::cout << "Not a light cache file: " << path << "\n";
+			return false;
+		}
+		if (header.world_id != world_id ||
+			header.chunk_size[0] != sizes[0] ||
+			header.chunk_size[1] != sizes[1] ||
+			header.chunk_size[2] != sizes[2])
+		{
+			return false;
+		}
+		size_t chunk_bytes = sizeof(LightCacheChunk) * size_t(std::max(header.chunk_count, 0));
+		size_t node_bytes = sizeof(OctreeNode) * size_t(std::max(header.node_count, 0));
+		if (file.size() < sizeof(LightCacheHeader) + chunk_bytes + node_bytes)
+		{
+			std::cout << "Light cache file truncated: " << path << "\n";
+			return false;
+		}
+		std::vector<LightCacheChunk> chunks(header.chunk_count);
+		memcpy(chunks.data(), file.data() + sizeof(LightCacheHeader), chunk_bytes);
+
+		_frame_sync.wait_all();
+		_light_octree.map(true);
+		bool ok = _light_octree.load_nodes(
+			reinterpret_cast<const OctreeNode*>(file.data() + sizeof(LightCacheHeader) + chunk_bytes),
+			header.node_count);
+		if (ok)
+		{
+			_light_cache_chunks.clear();
+			for (auto& chunk : chunks)
+			{
+				_light_cache_chunks[std::make_tuple(chunk.coord[0], chunk.coord[1], chunk.coord[2])] = chunk.hash;
+			}
+			// Resident chunks the cache never saw had no light stored for them
+			_chunk_buffer_manager.for_each_resident([&](glm::ivec3 chunk_coord, const int*)
+				{
+					auto key = std::make_tuple(chunk_coord.x, chunk_coord.y, chunk_coord.z);
+					if (_light_cache_chunks.find(key) == _light_cache_chunks.end())
+					{
+						invalidate_chunk_light(chunk_coord);
+					}
+				});
+			check_light_cache_chunks();
+		}
+		_light_octree.unmap(true);
+		return ok;
 	}
 
     int get_screen_loc_block_type(float x, float y)
     {
         std::vector<glm::vec4> types;
-        _block_types->get_data(types, x*_x_res, y*_y_res, 1, 1);
+        glm::ivec2 size = get_render_size();
+        _block_types->get_data(types, x*size.x, y*size.y, 1, 1);
         return types[0].x;
     }
 
+
 private:
+	void set_textures_cached(const std::vector<std::string>& in_image_filenames, const std::string& cache_path)
+	{
+		std::vector<uint64_t> hashes;
+		for (auto& f : in_image_filenames)
+		{
+			hashes.push_back(texture_source_hash(f));
+		}
+		TextureCache cache;
+		if (!cache.load(cache_path, in_image_filenames, hashes))
+		{
+			cache.bake(in_image_filenames);
+			if (!cache.save(cache_path, hashes))
+			{
+				std::cout << "Couldn't write texture cache " << cache_path << "\n";
+			}
+		}
+		_block_textures = std::make_shared<graphics::Texture2DArray>(cache.width(), cache.height(),
+			cache.layer_count());
+		for (int level = 0; level < cache.level_count(); ++level)
+		{
+			_block_textures->set_level(level, cache.level_data(level));
+		}
+		_block_textures->bind_unit(block_texture_unit);
+		_trace_programs.set_uniform_int("tex_size", cache.width());
+	}
+
+	// Queues the saved copies of the given chunks for streaming. They are
+	// read closest first on the pager's thread. Chunks that have never
+	// been saved are left to the caller.
+	void page_in(const std::vector<glm::ivec3>& chunk_coords)
+	{
+		if (!_region_pager)
+		{
+			return;
+		}
+		_region_pager->read_chunks(chunk_coords);
+	}
+
+	// The GPU must not be writing the octree
+	void invalidate_chunk_light(glm::ivec3 chunk_coord)
+	{
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		glm::vec3 size(sizes[0], sizes[1], sizes[2]);
+		_light_octree.invalidate_box(glm::vec3(chunk_coord) * size, glm::vec3(chunk_coord + 1) * size);
+	}
+
+	// Compares the chunks of a loaded light cache that have become
+	// resident against their saved hashes. Must be mapped.
+	void check_light_cache_chunks()
+	{
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		int block_count = sizes[0] * sizes[1] * sizes[2];
+		for (auto it = _light_cache_chunks.begin(); it != _light_cache_chunks.end();)
+		{
+			glm::ivec3 chunk_coord(std::get<0>(it->first), std::get<1>(it->first), std::get<2>(it->first));
+			const int* blocks = _chunk_buffer_manager.resident_chunk_data(chunk_coord);
+			if (!blocks)
+			{
+				++it;
+				continue;
+			}
+			if (chunk_content_hash(blocks, block_count) != it->second)
+			{
+				invalidate_chunk_light(chunk_coord);
+			}
+			it = _light_cache_chunks.erase(it);
+		}
+	}
+
+	void bind_trace_images()
+	{
+		_compute_program->bind_image_texture(_pos_tex, 0);
+		_compute_program->bind_image_texture(_out_tex, 1);
+		_compute_program->bind_image_texture(_norm_tex_low_res, 2);
+		_compute_program->bind_image_texture(_out_tex_bounce_pass, 3);
+		_compute_program->bind_image_texture(_block_types, 4);
+		_compute_program->bind_image_texture(_norm_tex, 6);
+		_compute_program->bind_image_texture(_out_tex_low_res, 7);
+	}
+
+	void run_filter_pass(int pass,
+		std::shared_ptr<graphics::Texture2D> src,
+		std::shared_ptr<graphics::Texture2D> dst)
+	{
+		_filter_program->set_uniform_int(_filter_pass_uniform, pass);
+		_filter_program->bind_image_texture(src, 4);
+		_filter_program->bind_image_texture(dst, 5);
+		glm::ivec2 size = get_render_size();
+		_filter_program->dispatch_for_size(size.x, size.y);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+
+	// Whether a trace may write the light octree
+	bool octree_writes(bool include_first_bounce) const
+	{
+		return _light_cache_mode == light_cache_octree && !include_first_bounce && !_octree_edit_pending;
+	}
+
+	// Traces into out_tex, or into the low resolution targets without
+	// include_first_bounce
+	void trace(int bounces, bool include_first_bounce)
+	{
+		// Image units are shared with the filter program
+		bind_trace_images();
+		// Only the bounce pass grows the octree
+		if (octree_writes(include_first_bounce))
+		{
+			_light_octree.push_gpu_allocator();
+			_octree_write_frame = _frame_sync.frame();
+		}
+		// Growing the octree replaces its buffer
+		_compute_program->bind_storage_buffer(_light_octree.get_buffer(), 7);
+		_light_list.remove_unloaded_chunks([this](glm::ivec3 chunk_coord)
+			{
+				return _chunk_buffer_manager.resident_chunk_data(chunk_coord) != nullptr;
+			});
+		if (_light_list.upload())
+		{
+			_trace_programs.set_uniform_int("light_count", _light_list.count());
+		}
+		_compute_program->bind_storage_buffer(_light_list.get_buffer(), 12);
+		write_frame_uniforms(bounces, include_first_bounce);
+		_compute_program = _trace_programs.get(trace_defines(bounces, include_first_bounce));
+		glm::ivec2 size = get_render_size();
+		if (include_first_bounce)
+		{
+			_compute_program->dispatch_for_size(size.x, size.y);
+		}
+		else
+		{
+			_compute_program->dispatch_for_size(size.x / _low_res_div, size.y / _low_res_div);
+			_pos_size = size / _low_res_div;
+		}
+		// The filter reads the trace output as images, the screen samples
+		// it, the position readback copies it, and the octree stays mapped
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+			GL_TEXTURE_UPDATE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+		_light_octree.advance_frame();
+		_radiance_cache.advance_frame();
+	}
+
+	// Registers the emissive blocks of a chunk with the light list
+	void scan_emitters(glm::ivec3 chunk_coord, const int* blocks)
+	{
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		glm::ivec3 size(sizes[0], sizes[1], sizes[2]);
+		std::vector<glm::vec3> centers;
+		for (int i = 0; i < size.x * size.y * size.z; ++i)
+		{
+			if (blocks[i] == emissive_block_type)
+			{
+				glm::ivec3 local(i % size.x, (i / size.x) % size.y, i / (size.x * size.y));
+				centers.push_back(glm::vec3(chunk_coord * size + local) + 0.5f);
+			}
+		}
+		_light_list.set_chunk_emitters(chunk_coord, std::move(centers));
+	}
+
+	void upsample_gi()
+	{
+		_gi_upsample_program->bind_image_texture(_out_tex, 1);
+		_gi_upsample_program->bind_image_texture(_norm_tex, 2);
+		_gi_upsample_program->bind_image_texture(_out_tex_bounce_pass, 3);
+		_gi_upsample_program->bind_image_texture(_out_tex_low_res, 4);
+		_gi_upsample_program->bind_image_texture(_norm_tex_low_res, 5);
+		glm::ivec2 size = get_render_size();
+		_gi_upsample_program->dispatch_for_size(size.x, size.y);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+			GL_TEXTURE_UPDATE_BARRIER_BIT);
+	}
+
+	void upscale()
+	{
+		_upscale_program->bind_image_texture(_out_tex, 1);
+		_upscale_program->bind_image_texture(_norm_tex, 2);
+		_upscale_program->bind_image_texture(_display_tex, 5);
+		_upscale_program->dispatch_for_size(_x_res, _y_res);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	}
+
+	void apply_render_scale(float scale)
+	{
+		_render_scale = scale;
+		// Texture LOD follows the footprint of a traced pixel
+		_trace_programs.set_uniform_float("pixel_spread", 2.0f * tan(_cam_horiz_angle) / get_render_size().x);
+	}
+
+	void update_dynamic_render_scale()
+	{
+		if (_dynamic_target_ms <= 0)
+		{
+			return;
+		}
+		double ms = _profiler.last_ms("frame");
+		if (ms <= 0)
+		{
+			return;
+		}
+		_frame_ms_avg = _frame_ms_avg > 0 ? 0.9 * _frame_ms_avg + 0.1 * ms : ms;
+		// Trace time goes with the pixel count, the square of the scale
+		float ratio = float(std::sqrt(_dynamic_target_ms / _frame_ms_avg));
+		if (std::abs(ratio - 1.0f) < dynamic_render_scale_deadband)
+		{
+			return;
+		}
+		ratio = glm::clamp(ratio, 1.0f - dynamic_render_scale_step, 1.0f + dynamic_render_scale_step);
+		apply_render_scale(glm::clamp(_render_scale * ratio, _dynamic_min_scale, _dynamic_max_scale));
+	}
+
+	graphics::ShaderDefines trace_defines(int bounces, bool include_first_bounce)
+	{
+		graphics::ShaderDefines defines;
+		defines["GROUP_SIZE_X"] = std::to_string(_trace_group_size.x);
+		defines["GROUP_SIZE_Y"] = std::to_string(_trace_group_size.y);
+		if (!_specialize_trace)
+		{
+			return defines;
+		}
+		auto sizes = _chunk_buffer_manager.get_chunk_size();
+		defines["FIXED_CHUNK_LAYOUT"] = "1";
+		defines["CHUNK_COUNT"] = std::to_string(_chunk_buffer_manager.get_max_chunks());
+		defines["CHUNK_SIZE_X"] = std::to_string(sizes[0]);
+		defines["CHUNK_SIZE_Y"] = std::to_string(sizes[1]);
+		defines["CHUNK_SIZE_Z"] = std::to_string(sizes[2]);
+		defines["CHUNK_MAP_SIZE_X"] = std::to_string(_map_size_x);
+		defines["CHUNK_MAP_SIZE_Y"] = std::to_string(_map_size_y);
+		defines["CHUNK_MAP_SIZE_Z"] = std::to_string(_map_size_z);
+		defines["CHUNK_STRIDE"] = std::to_string(_chunk_buffer_manager.chunk_stride());
+		defines["CHUNK_LOD_LEVELS"] = std::to_string(_chunk_buffer_manager.lod_levels());
+		defines["FIXED_MAX_BOUNCES"] = std::to_string(bounces);
+		defines["FIXED_INCLUDE_FIRST_BOUNCE"] = std::to_string(int(include_first_bounce));
+		return defines;
+	}
+
+	// Everything the trace and filter programs need per frame, in one
+	// upload. Shared by both through the uniform buffer binding.
+	void write_frame_uniforms(int bounces, bool include_first_bounce)
+	{
+		FrameUniforms frame = {};
+		frame.eye = glm::vec4(_cam_pos, 0);
+		frame.ray00 = glm::vec4(_cam_11 - _cam_pos, 0);
+		frame.ray01 = glm::vec4(_cam_12 - _cam_pos, 0);
+		frame.ray10 = glm::vec4(_cam_21 - _cam_pos, 0);
+		frame.ray11 = glm::vec4(_cam_22 - _cam_pos, 0);
+		frame.prev_eye = glm::vec4(_prev_cam_pos, 0);
+		frame.prev_ray00 = glm::vec4(_prev_cam_11 - _prev_cam_pos, 0);
+		frame.prev_ray01 = glm::vec4(_prev_cam_12 - _prev_cam_pos, 0);
+		frame.prev_ray10 = glm::vec4(_prev_cam_21 - _prev_cam_pos, 0);
+		frame.chunk_map_origin = glm::ivec4(_chunk_buffer_manager.get_ref(), 0);
+		glm::ivec2 render_size = get_render_size();
+		frame.render_size = glm::ivec4(render_size, render_size / _low_res_div);
+		frame.prev_render_size = glm::ivec4(_prev_render_size, _prev_render_size / _low_res_div);
+		frame.ttime = cur_time();
+		frame.max_bounces = bounces;
+		frame.include_first_bounce = int(include_first_bounce);
+		frame.octree_frame = _light_octree.frame();
+		frame.cache_frame = _radiance_cache.frame();
+		frame.history_valid = int(_gi_history_valid);
+		frame.octree_writes = int(octree_writes(include_first_bounce));
+		_frame_uniform_buf->set_data(0, frame);
+		_compute_program->bind_uniform_buffer(_frame_uniform_buf, FRAME_UNIFORMS_BINDING);
+	}
+
 	int _cube_count_x;
 	int _cube_count_y;
 	int _cube_count_z;
 	int _map_size_x;
 	int _map_size_y;
 	int _map_size_z;
-	int _mip_map_levels;
 	int _x_res;
 	int _y_res;
 	int _low_res_div;
 
 	MappedOctree _light_octree;
+	RadianceCache _radiance_cache;
+	LightList _light_list;
+	int _light_cache_mode;
 	ChunkBufferManager _chunk_buffer_manager;
+	ChunkStreamer _chunk_streamer;
+	// Hands chunks to _chunk_streamer, so it is declared after it
+	std::unique_ptr<RegionPager> _region_pager;
+	// Saved chunk hashes of a loaded light cache, for chunks that weren't resident yet
+	std::map<std::tuple<int, int, int>, uint32_t> _light_cache_chunks;
 	std::shared_ptr<graphics::Buffer<chunk_alloc>> _chunk_index_buf;
 	std::shared_ptr<graphics::Buffer<GLint>> _chunk_map_buf;
 	std::shared_ptr<graphics::Buffer<glm::vec4>> _cube_locs_buf;
 	std::shared_ptr<graphics::Buffer<GLint>> _cube_state_buf;
 	std::shared_ptr<graphics::Buffer<glm::vec4>> _cube_colors_buf;
-	std::shared_ptr<graphics::Buffer<glm::vec4>> _texture_buf;
-	std::shared_ptr<graphics::Buffer<MappedOctree::Node>> _octree_buf;
 	std::shared_ptr<graphics::Buffer<glm::vec4>> _octree_values;
-	std::vector<std::shared_ptr<graphics::Buffer<glm::vec4>>> _mip_map_bufs;
+	std::shared_ptr<graphics::Texture2DArray> _block_textures;
 	std::shared_ptr<graphics::Texture1D> _cube_locs;
 	std::shared_ptr<graphics::Texture1D> _cube_colors;
 	std::shared_ptr<graphics::Texture2D> _out_tex;
@@ -475,13 +1312,58 @@ private:
 	std::shared_ptr<graphics::Texture2D> _block_types;
 	std::shared_ptr<graphics::Texture2D> _norm_tex_low_res;
 	std::shared_ptr<graphics::Texture2D> _pos_tex;
-	std::shared_ptr<graphics::Shader> _c_shader;
+	std::vector<std::shared_ptr<graphics::Texture2D>> _gi_history;
+	std::vector<std::shared_ptr<graphics::Texture2D>> _gi_filter_temp;
+	std::shared_ptr<graphics::Texture2D> _norm_history;
+	std::shared_ptr<graphics::Texture2D> _smooth_src;
+	// Display resolution output when tracing below it
+	std::shared_ptr<graphics::Texture2D> _display_tex;
+	graphics::AsyncTextureReadback _pos_readback;
+	graphics::FrameSync _frame_sync;
+	std::shared_ptr<graphics::Buffer<FrameUniforms>> _frame_uniform_buf;
+	graphics::UniformHandle _filter_pass_uniform;
+	graphics::UniformHandle _filter_step_x_uniform;
+	graphics::UniformHandle _filter_step_y_uniform;
+	std::vector<glm::vec4> _pos_data;
+	// Corner of _pos_tex the last bounce pass wrote, and that corner for
+	// each position readback in flight, oldest first
+	glm::ivec2 _pos_size;
+	std::deque<glm::ivec2> _pos_readback_sizes;
+	// The corner of the positions in _pos_data
+	glm::ivec2 _pos_data_size;
+	// Last frame whose bounce pass could write the octree, and whether
+	// refresh_octree() is waiting for it to finish before editing
+	int _octree_write_frame;
+	bool _octree_edit_pending;
+	int _gi_history_index;
+	bool _gi_history_valid;
+	int _gi_filter_iterations;
+	bool _gi_upsampling;
+	graphics::GpuProfiler _profiler;
+	graphics::ProgramVariants _trace_programs;
+	bool _specialize_trace;
+	glm::ivec2 _trace_group_size;
+	float _render_scale;
+	// 0 while the render scale is fixed
+	float _dynamic_target_ms;
+	float _dynamic_min_scale;
+	float _dynamic_max_scale;
+	double _frame_ms_avg;
+	// Whether the last full resolution pass went through _display_tex
+	bool _display_upscaled;
 	std::shared_ptr<graphics::Shader> _filter_shader;
+	std::shared_ptr<graphics::Shader> _smooth_shader;
+	std::shared_ptr<graphics::Shader> _upscale_shader;
+	std::shared_ptr<graphics::Shader> _gi_upsample_shader;
 	std::shared_ptr<graphics::ScreenVertexShader> _v_shader;
 	std::shared_ptr<graphics::ScreenFragmentShader> _f_shader;
 	std::shared_ptr<graphics::Object> _screen;
+	// Trace variant of the last draw()
 	std::shared_ptr<graphics::Program> _compute_program;
 	std::shared_ptr<graphics::Program> _filter_program;
+	std::shared_ptr<graphics::Program> _smooth_program;
+	std::shared_ptr<graphics::Program> _upscale_program;
+	std::shared_ptr<graphics::Program> _gi_upsample_program;
 	std::shared_ptr<graphics::Program> _screen_program;
 	std::vector<glm::vec4> _out_vec1;
 	std::vector<glm::vec4> _out_vec2;
@@ -498,6 +1380,12 @@ private:
 	glm::vec3 _cam_12;
 	glm::vec3 _cam_21;
 	glm::vec3 _cam_22;
+	// Camera of the last filtered frame, for reprojecting the GI history
+	glm::vec3 _prev_cam_pos;
+	glm::vec3 _prev_cam_11;
+	glm::vec3 _prev_cam_12;
+	glm::vec3 _prev_cam_21;
+	glm::ivec2 _prev_render_size;
 };
 
 }  // namespace graphics
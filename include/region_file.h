@@ -0,0 +1,311 @@
+#pragma once
+#ifndef REGION_FILE_H_
+#define REGION_FILE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "chunk_index_map.h"
+#include "mapped_file.h"
+
+// Chunks per side of a region file
+const int region_size = 8;
+const int region_chunk_count = region_size * region_size * region_size;
+const char region_magic[4] = { 'U', 'G', 'R', 'F' };
+const uint32_t region_version = 1;
+
+// On disk layout of a region file:
+//   RegionHeader
+//   RegionEntry[region_chunk_count]   offset table, x fastest then y then z
+//   payloads                          run length encoded (count, value) int pairs
+struct RegionHeader
+{
+	char magic[4];
+	uint32_t version;
+	int32_t chunk_size[3];
+	int32_t region_size;
+};
+
+struct RegionEntry
+{
+	uint64_t offset;  // 0 if the chunk has never been written
+	uint32_t byte_count;
+	uint32_t capacity;  // bytes reserved at offset, a rewrite that fits goes in place
+};
+
+// Run length encoding of a block array. Voxel chunks are mostly long runs
+// of the same type so this is usually a large win.
+inline void rle_encode(const int* blocks, int count, std::vector<int32_t>& out)
+{
+	out.clear();
+	int i = 0;
+	while (i < count)
+	{
+		int run = 1;
+		while (i + run < count && blocks[i + run] == blocks[i])
+		{
+			run += 1;
+		}
+		out.push_back(run);
+		out.push_back(blocks[i]);
+		i += run;
+	}
+}
+
+inline bool rle_decode(const int32_t* data, int pair_count, int block_count, std::vector<int>& out)
+{
+	out.clear();
+	out.reserve(block_count);
+	for (int i = 0; i < pair_count; ++i)
+	{
+		if (out.size() + data[2 * i] > block_count || data[2 * i] <= 0)
+		{
+			return false;
+		}
+		out.insert(out.end(), data[2 * i], data[2 * i + 1]);
+	}
+	return out.size() == block_count;
+}
+
+// One region file: a fixed grid of region_size^3 chunks. Reads go through
+// a memory mapping of the file, writes append (or overwrite in place)
+// and update the offset table.
+class RegionFile
+{
+public:
+	// A missing file is only created if create is set
+	RegionFile(const std::string& path, glm::ivec3 chunk_size, bool create) :
+		_path(path),
+		_chunk_size(chunk_size),
+		_block_count(chunk_size.x * chunk_size.y * chunk_size.z),
+		_valid(false),
+		_map_stale(true)
+	{
+		if (!MappedFile(path).is_open())
+		{
+			if (!create)
+			{
+				return;
+			}
+			create_file();
+		}
+		remap();
+		if (_map.size() < sizeof(RegionHeader) + sizeof(RegionEntry) * region_chunk_count)
+		{
+			std::cout << "Region file too small: " << path << "\n";
+			return;
+		}
+		const RegionHeader* header = reinterpret_cast<const RegionHeader*>(_map.data());
+		if (memcmp(header->magic, region_magic, 4) != 0 || header->version != region_version)
+		{
+			std::cout << "Not a region file: " << path << "\n";
+			return;
+		}
+		if (header->chunk_size[0] != chunk_size.x ||
+			header->chunk_size[1] != chunk_size.y ||
+			header->chunk_size[2] != chunk_size.z ||
+			header->region_size != region_size)
+		{
+			std::cout << "Region file chunk size mismatch: " << path << "\n";
+			return;
+		}
+		_valid = true;
+	}
+
+	bool valid() const
+	{
+		return _valid;
+	}
+
+	bool has_chunk(glm::ivec3 local)
+	{
+		return _valid && entry(local).offset != 0;
+	}
+
+	bool read_chunk(glm::ivec3 local, std::vector<int>& blocks)
+	{
+		if (!_valid)
+		{
+			return false;
+		}
+		if (_map_stale)
+		{
+			remap();
+		}
+		RegionEntry chunk_entry = entry(local);
+		if (chunk_entry.offset == 0 ||
+			chunk_entry.offset + chunk_entry.byte_count > _map.size())
+		{
+			return false;
+		}
+		return rle_decode(reinterpret_cast<const int32_t*>(_map.data() + chunk_entry.offset),
+			chunk_entry.byte_count / (2 * sizeof(int32_t)),
+			_block_count,
+			blocks);
+	}
+
+	bool write_chunk(glm::ivec3 local, const int* blocks)
+	{
+		if (!_valid)
+		{
+			return false;
+		}
+		rle_encode(blocks, _block_count, _encoded);
+		uint32_t byte_count = _encoded.size() * sizeof(int32_t);
+
+		std::fstream file(_path, std::ios::in | std::ios::out | std::ios::binary);
+		if (!file)
+		{
+			std::cout << "Couldn't open region file for writing: " << _path << "\n";
+			return false;
+		}
+		RegionEntry chunk_entry = entry(local);
+		if (chunk_entry.offset == 0 || byte_count > chunk_entry.capacity)
+		{
+			file.seekp(0, std::ios::end);
+			chunk_entry.offset = uint64_t(file.tellp());
+			// Leave some headroom so small edits can be rewritten in place
+			chunk_entry.capacity = byte_count + byte_count / 4;
+		}
+		chunk_entry.byte_count = byte_count;
+
+		std::vector<char> payload(chunk_entry.capacity, 0);
+		memcpy(payload.data(), _encoded.data(), byte_count);
+		file.seekp(chunk_entry.offset);
+		file.write(payload.data(), payload.size());
+		file.seekp(entry_offset(local));
+		file.write(reinterpret_cast<const char*>(&chunk_entry), sizeof(RegionEntry));
+		_entries[entry_index(local)] = chunk_entry;
+		_map_stale = true;
+		return bool(file);
+	}
+
+private:
+	void create_file()
+	{
+		std::ofstream file(_path, std::ios::binary);
+		RegionHeader header;
+		memcpy(header.magic, region_magic, 4);
+		header.version = region_version;
+		header.chunk_size[0] = _chunk_size.x;
+		header.chunk_size[1] = _chunk_size.y;
+		header.chunk_size[2] = _chunk_size.z;
+		header.region_size = region_size;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		std::vector<RegionEntry> table(region_chunk_count, { 0, 0, 0 });
+		file.write(reinterpret_cast<const char*>(table.data()), sizeof(RegionEntry) * table.size());
+	}
+
+	void remap()
+	{
+		_map.open(_path);
+		_map_stale = false;
+		if (_map.size() >= sizeof(RegionHeader) + sizeof(RegionEntry) * region_chunk_count)
+		{
+			const RegionEntry* table = reinterpret_cast<const RegionEntry*>(_map.data() + sizeof(RegionHeader));
+			_entries.assign(table, table + region_chunk_count);
+		}
+	}
+
+	int entry_index(glm::ivec3 local) const
+	{
+		return local.x + local.y * region_size + local.z * region_size * region_size;
+	}
+
+	size_t entry_offset(glm::ivec3 local) const
+	{
+		return sizeof(RegionHeader) + sizeof(RegionEntry) * entry_index(local);
+	}
+
+	RegionEntry entry(glm::ivec3 local) const
+	{
+		return _entries[entry_index(local)];
+	}
+
+	std::string _path;
+	glm::ivec3 _chunk_size;
+	int _block_count;
+	bool _valid;
+	bool _map_stale;
+	MappedFile _map;
+	std::vector<RegionEntry> _entries;
+	std::vector<int32_t> _encoded;
+};
+
+// A directory of region files addressed by chunk coordinate
+class RegionStore
+{
+public:
+	RegionStore(const std::string& directory, glm::ivec3 chunk_size) :
+		_directory(directory),
+		_chunk_size(chunk_size)
+	{
+
+	}
+
+	bool read_chunk(glm::ivec3 chunk_coord, std::vector<int>& blocks)
+	{
+		RegionFile* region = get_region(chunk_coord, false);
+		return region && region->read_chunk(local_coord(chunk_coord), blocks);
+	}
+
+	bool write_chunk(glm::ivec3 chunk_coord, const int* blocks)
+	{
+		RegionFile* region = get_region(chunk_coord, true);
+		return region && region->write_chunk(local_coord(chunk_coord), blocks);
+	}
+
+	// Chunk coordinate of the chunk containing world block position pos
+	glm::ivec3 chunk_coord(glm::ivec3 pos) const
+	{
+		return glm::ivec3(floor_div(pos.x, _chunk_size.x),
+			floor_div(pos.y, _chunk_size.y),
+			floor_div(pos.z, _chunk_size.z));
+	}
+
+private:
+	glm::ivec3 local_coord(glm::ivec3 chunk_coord) const
+	{
+		return glm::ivec3(wrap_index(chunk_coord.x, region_size),
+			wrap_index(chunk_coord.y, region_size),
+			wrap_index(chunk_coord.z, region_size));
+	}
+
+	RegionFile* get_region(glm::ivec3 chunk_coord, bool create)
+	{
+		glm::ivec3 region_coord(floor_div(chunk_coord.x, region_size),
+			floor_div(chunk_coord.y, region_size),
+			floor_div(chunk_coord.z, region_size));
+		auto key = std::make_tuple(region_coord.x, region_coord.y, region_coord.z);
+		auto found = _regions.find(key);
+		if (found == _regions.end() || (create && !found->second->valid()))
+		{
+			std::string path = _directory + "/r." +
+				std::to_string(region_coord.x) + "." +
+				std::to_string(region_coord.y) + "." +
+				std::to_string(region_coord.z) + ".ugr";
+			_regions[key] = std::make_unique<RegionFile>(path, _chunk_size, create);
+			found = _regions.find(key);
+		}
+		if (!found->second->valid())
+		{
+			return nullptr;
+		}
+		return found->second.get();
+	}
+
+	std::string _directory;
+	glm::ivec3 _chunk_size;
+	std::map<std::tuple<int, int, int>, std::unique_ptr<RegionFile>> _regions;
+};
+
+#endif  // REGION_FILE_H_
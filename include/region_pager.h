@@ -0,0 +1,205 @@
+#pragma once
+#ifndef REGION_PAGER_H_
+#define REGION_PAGER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "chunk_streamer.h"
+#include "region_file.h"
+
+// Does the region file IO of a world on its own thread, so paging never
+// blocks the render thread. Chunks to page in are read and decoded
+// closest to the focus first and handed to a ChunkStreamer, which
+// uploads them under its own budget. Write backs are copied when queued
+// and written before any read, so a chunk that is evicted and paged in
+// again reads its latest blocks.
+class RegionPager
+{
+public:
+	RegionPager(const std::string& directory, glm::ivec3 chunk_size, ChunkStreamer& streamer) :
+		_store(directory, chunk_size),
+		_chunk_size(chunk_size),
+		_streamer(streamer),
+		_focus(0),
+		_window_origin(0),
+		_window_size(0),
+		_writing(false),
+		_stop(false)
+	{
+		_thread = std::thread(&RegionPager::run, this);
+	}
+
+	// Finishes the queued writes, drops the queued reads
+	~RegionPager()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_wake.notify_all();
+		_thread.join();
+	}
+
+	RegionPager(const RegionPager&) = delete;
+	RegionPager& operator=(const RegionPager&) = delete;
+
+	// Queues chunks, by chunk coordinate, to be read from disk. Chunks
+	// that have never been saved are skipped.
+	void read_chunks(const std::vector<glm::ivec3>& chunk_coords)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (auto& chunk_coord : chunk_coords)
+			{
+				_reads.insert(std::make_tuple(chunk_coord.x, chunk_coord.y, chunk_coord.z));
+			}
+		}
+		_wake.notify_all();
+	}
+
+	// Queues a copy of a chunk's full resolution blocks to be written
+	void write_chunk(glm::ivec3 chunk_coord, const int* blocks)
+	{
+		PendingWrite write{ chunk_coord,
+			std::vector<int>(blocks, blocks + _chunk_size.x * _chunk_size.y * _chunk_size.z) };
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_writes.push_back(std::move(write));
+		}
+		_wake.notify_all();
+	}
+
+	// Queued reads outside the map window, in chunk coordinates, are dropped
+	void set_window(glm::ivec3 origin, glm::ivec3 size)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_window_origin = origin;
+		_window_size = size;
+	}
+
+	// World position reads are ordered by
+	void set_focus(glm::vec3 pos)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_focus = pos;
+	}
+
+	// Waits until every queued write is on disk
+	void flush_writes()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_idle.wait(lock, [this] { return !_writes.size() && !_writing; });
+	}
+
+	size_t pending_reads()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _reads.size();
+	}
+
+private:
+	struct PendingWrite
+	{
+		glm::ivec3 chunk_coord;
+		std::vector<int> blocks;
+	};
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (true)
+		{
+			_wake.wait(lock, [this] { return _stop || _writes.size() || _reads.size(); });
+			if (_writes.size())
+			{
+				PendingWrite write = std::move(_writes.front());
+				_writes.pop_front();
+				_writing = true;
+				lock.unlock();
+				_store.write_chunk(write.chunk_coord, write.blocks.data());
+				lock.lock();
+				_writing = false;
+				_idle.notify_all();
+				continue;
+			}
+			if (_stop)
+			{
+				return;
+			}
+			glm::ivec3 chunk_coord;
+			if (!next_read(chunk_coord))
+			{
+				continue;
+			}
+			lock.unlock();
+			std::vector<int> blocks;
+			if (_store.read_chunk(chunk_coord, blocks))
+			{
+				_streamer.request_chunk(chunk_coord.x * _chunk_size.x,
+					chunk_coord.y * _chunk_size.y,
+					chunk_coord.z * _chunk_size.z,
+					std::move(blocks), true);
+			}
+			lock.lock();
+		}
+	}
+
+	// Takes the queued read closest to the focus, dropping the ones that
+	// left the window. Called with the mutex held.
+	bool next_read(glm::ivec3& out_coord)
+	{
+		glm::vec3 half_chunk = glm::vec3(_chunk_size) / 2.0f;
+		float best_dist = -1;
+		for (auto it = _reads.begin(); it != _reads.end();)
+		{
+			glm::ivec3 chunk_coord(std::get<0>(*it), std::get<1>(*it), std::get<2>(*it));
+			glm::ivec3 rel = chunk_coord - _window_origin;
+			if (glm::any(glm::lessThan(rel, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(rel, _window_size)))
+			{
+				it = _reads.erase(it);
+				continue;
+			}
+			float dist = glm::length(glm::vec3(chunk_coord * _chunk_size) + half_chunk - _focus);
+			if (best_dist < 0 || dist < best_dist)
+			{
+				best_dist = dist;
+				out_coord = chunk_coord;
+			}
+			++it;
+		}
+		if (best_dist < 0)
+		{
+			return false;
+		}
+		_reads.erase(std::make_tuple(out_coord.x, out_coord.y, out_coord.z));
+		return true;
+	}
+
+	// Only touched by the IO thread
+	RegionStore _store;
+	glm::ivec3 _chunk_size;
+	ChunkStreamer& _streamer;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _idle;
+	std::set<std::tuple<int, int, int>> _reads;
+	std::deque<PendingWrite> _writes;
+	glm::vec3 _focus;
+	glm::ivec3 _window_origin;
+	glm::ivec3 _window_size;
+	bool _writing;
+	bool _stop;
+	std::thread _thread;
+};
+
+#endif  // REGION_PAGER_H_
@@ -6,10 +6,13 @@
 #include <fstream>
 #include <streambuf>
 #include <iostream>
+#include <sstream>
 #include <GLFW/glfw3.h>
 
 #include "gl_includes.h"
 #include "buffer.h"
+#include "persistent_buffer.h"
+#include "program_cache.h"
 #include "definitions.h"
 #include "texture.h"
 
@@ -22,12 +25,17 @@ const std::string DEFAULT_VERTEX_NORMAL_VARIABLE = "v_norm";
 const std::string DEFAULT_VERTEX_UV_VARIABLE = "v_uv";
 const std::string DEFAULT_INSTANCE_VARIABLE = "instance_var";
 
+// Name to value, added to a shader as #define lines
+typedef std::map<std::string, std::string> ShaderDefines;
+
 class ShaderBase
 {
   public:
     ShaderBase(GLenum type):
         _shader_name(-1),
-        _compiled(false)
+        _compiled(false),
+        _compile_started(false),
+        _compile_checked(false)
     {
         _type = type; 
         _shader_name = glCreateShader(type);
@@ -40,6 +48,8 @@ class ShaderBase
         {
             _source = std::string((std::istreambuf_iterator<char>(t)),
                 std::istreambuf_iterator<char>());
+            _source = expand_includes(_source, file_path);
+            _source = inject_defines(_source, _defines);
         }
         else
         {
@@ -47,12 +57,107 @@ class ShaderBase
         }
     }
 
+    // Replaces #include "file" lines with the file's contents, resolved
+    // relative to the including file. Included files should have include
+    // guards; there is no other protection against including twice.
+    static std::string expand_includes(const std::string& source, const std::string& file_path)
+    {
+        std::string dir;
+        size_t slash = file_path.find_last_of("/\\");
+        if (slash != std::string::npos)
+        {
+            dir = file_path.substr(0, slash + 1);
+        }
+        std::string out_string;
+        std::istringstream lines(source);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line.compare(start, 8, "#include") != 0)
+            {
+                out_string += line + "\n";
+                continue;
+            }
+            size_t open = line.find('"', start);
+            size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+            std::string include_path;
+            if (close != std::string::npos)
+            {
+                include_path = dir + line.substr(open + 1, close - open - 1);
+            }
+            std::ifstream include_file(include_path);
+            if (include_path.empty() || !include_file)
+            {
+                std::cout << "Couldn't find shader include " << line << "\n";
+                out_string += line + "\n";
+                continue;
+            }
+            std::string included((std::istreambuf_iterator<char>(include_file)),
+                std::istreambuf_iterator<char>());
+            out_string += expand_includes(included, include_path);
+        }
+        return out_string;
+    }
+
+    // Defines put in front of a file's source when it is built. The
+    // file should only give defaults for them under #ifndef.
+    void set_defines(const ShaderDefines& defines)
+    {
+        _defines = defines;
+    }
+
+    // Inserts the defines after the #version line, which has to stay first
+    static std::string inject_defines(const std::string& source, const ShaderDefines& defines)
+    {
+        if (defines.empty())
+        {
+            return source;
+        }
+        std::string lines;
+        for (auto& define : defines)
+        {
+            lines += "#define " + define.first + " " + define.second + "\n";
+        }
+        size_t version = source.find("#version");
+        if (version == std::string::npos)
+        {
+            return lines + source;
+        }
+        size_t line_end = source.find('\n', version);
+        if (line_end == std::string::npos)
+        {
+            return source + "\n" + lines;
+        }
+        return source.substr(0, line_end + 1) + lines + source.substr(line_end + 1);
+    }
+
+    // Compiles and checks the result
     void compile()
+    {
+        start_compile();
+        check_compile();
+    }
+
+    // Hands the source to the driver without waiting for the result, so
+    // several shaders can compile at once
+    void start_compile()
     {
         const char* c_str = _source.c_str();
         glShaderSource(_shader_name, 1, &c_str, NULL);
         glCompileShader(_shader_name);
+        _compile_started = true;
+        _compile_checked = false;
+    }
 
+    // Waits for the compile started last and prints the log if it failed
+    void check_compile()
+    {
+        if (!_compile_started || _compile_checked)
+        {
+            return;
+        }
+        _compile_checked = true;
         GLint success;
         glGetShaderiv(_shader_name, GL_COMPILE_STATUS, &success);
         if (success == GL_FALSE)
@@ -73,6 +178,16 @@ class ShaderBase
         }
     }
 
+    bool compile_started() const
+    {
+        return _compile_started;
+    }
+
+    const std::string& source() const
+    {
+        return _source;
+    }
+
     GLuint get_shader_id() const
     {
         return _shader_name;
@@ -83,8 +198,9 @@ class ShaderBase
         return _type;
     }
 
-    bool compiled() const
+    bool compiled()
     {
+        check_compile();
         return _compiled;
     }
 
@@ -93,8 +209,11 @@ class ShaderBase
     GLuint _shader_name;
     GLenum _type;
     bool _compiled;
+    bool _compile_started;
+    bool _compile_checked;
   protected:
     std::string _source;
+    ShaderDefines _defines;
 };
 
 
@@ -344,15 +463,37 @@ public:
     virtual std::string build_source_specific()
     {
         std::string out_string;
-        out_string += "frag_color = texture2D(raytraced, gl_FragCoord.xy*1.0/screen_size.xy);// /1024.0).rgba;\n";
+        out_string += "frag_color = texture(raytraced, gl_FragCoord.xy*1.0/screen_size.xy);// /1024.0).rgba;\n";
         return out_string;
     }
 };
 
+// A resolved uniform location, see Program::get_uniform_handle()
+struct UniformHandle
+{
+    GLint location;
+};
+
+struct CommonUniforms
+{
+    UniformHandle model_mat;
+    UniformHandle view_mat;
+    UniformHandle projection_mat;
+    UniformHandle x_res;
+    UniformHandle y_res;
+};
+
 class Program
 {
   public:
-    Program()
+    Program() :
+        _common_uniforms{ { -1 }, { -1 }, { -1 }, { -1 }, { -1 } },
+        _binary_key(0),
+        _from_binary(false),
+        _save_binary(false),
+        _link_checked(true),
+        _linked(false),
+        _local_size(0)
     {
         _program = glCreateProgram();
     }
@@ -367,45 +508,85 @@ class Program
         glAttachShader(_program, in_shader->get_shader_id());
     }
 
-    bool compile_and_link()
+    // Starts building the program without waiting for the driver; the
+    // result is checked on first use, so programs started back to back
+    // compile in parallel where the driver can. Loads the linked binary
+    // from program_binary_cache() instead when it has one.
+    void compile_and_link()
     {
+        std::string sources;
         for (auto& shdr : _shaders)
         {
-            if (!shdr.second->compiled())
+            if (!shdr.second->compile_started())
             {
-                attach_shader(shdr.second);
                 shdr.second->build_source();
-                shdr.second->compile();
-                if (!shdr.second->compiled())
-                {
-                    return false;
-                }
             }
+            sources += shdr.second->source();
         }
-        link();
-        return true;
+        _binary_key = program_binary_cache().key(sources);
+        _link_checked = false;
+        _save_binary = false;
+        if (program_binary_cache().load(_binary_key, _program))
+        {
+            _from_binary = true;
+            return;
+        }
+        compile_shaders();
+        glProgramParameteri(_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(_program);
+        _save_binary = program_binary_cache().enabled();
     }
 
+    // Binds a vertex attribute to index from the next link() on
+    void bind_attrib_location(GLuint index, const std::string& name)
+    {
+        glBindAttribLocation(_program, index, name.c_str());
+        _attrib_locations[name] = index;
+    }
+
+    // Relinks after binding attribute locations. Skipped when the linked
+    // program already has them, e.g. one loaded from a binary saved after
+    // an earlier relink. The relinked binary replaces the cached one.
     void link()
     {
+        if (attrib_locations_linked())
+        {
+            return;
+        }
+        if (_from_binary)
+        {
+            // Loaded from a binary, so the shaders were never compiled
+            compile_shaders();
+            _from_binary = false;
+        }
         glLinkProgram(_program);
-        GLint success;
-        glGetProgramiv(_program, GL_LINK_STATUS, &success);
-        if (success == GL_FALSE)
+        _link_checked = false;
+        _save_binary = program_binary_cache().enabled();
+    }
+
+    // Whether a started build has finished, without blocking. Always
+    // true without GL_KHR_parallel_shader_compile.
+    bool link_ready()
+    {
+        if (_link_checked || !parallel_shader_compile_supported())
         {
-            std::cout << " shader program link failed: " << "\n";
-            GLint log_size = 0;
-            glGetProgramiv(_program, GL_INFO_LOG_LENGTH, &log_size);
-            std::vector<GLchar> log_output(log_size);
-            glGetProgramInfoLog(_program, log_size, NULL, log_output.data());
-            std::string log_string(log_output.begin(), log_output.end());
-            std::cout << log_string << "\n";
+            return true;
         }
+        GLint done = GL_FALSE;
+        glGetProgramiv(_program, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
     }
 
+    // Waits for the build
+    bool linked()
+    {
+        check_link();
+        return _linked;
+    }
 
     void use()
     {
+        check_link();
         set_program(_program);
     }
 
@@ -430,96 +611,288 @@ class Program
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, in_tex->get_buffer_name());
     }
 
-    void set_uniform_vec3(std::string var_name, glm::vec3 in_vec)
+    template <class T>
+    void bind_storage_buffer(std::shared_ptr<graphics::PersistentBuffer<T>> in_buf, int index)
+    {
+        use();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, in_buf->get_buffer_name());
+    }
+
+    template <class T>
+    void bind_uniform_buffer(std::shared_ptr<graphics::Buffer<T>> in_buf, int index)
+    {
+        glBindBufferBase(GL_UNIFORM_BUFFER, index, in_buf->get_buffer_name());
+    }
+
+    // Looks the location up once; keep the handle to skip the lookup
+    UniformHandle get_uniform_handle(const std::string& var_name)
     {
-        GLuint loc;
-        if (_uniform_locs.find(var_name) == _uniform_locs.end())
+        check_link();
+        auto found = _uniform_locs.find(var_name);
+        if (found != _uniform_locs.end())
         {
-            _uniform_locs[var_name] = glGetUniformLocation(_program, var_name.c_str());
-            loc = _uniform_locs[var_name];
+            return UniformHandle{ found->second };
         }
-        else
+        GLint loc = glGetUniformLocation(_program, var_name.c_str());
+        _uniform_locs[var_name] = loc;
+        return UniformHandle{ loc };
+    }
+
+    // Handles for the uniforms draw_object() sets on every draw
+    const CommonUniforms& common_uniforms()
+    {
+        check_link();
+        return _common_uniforms;
+    }
+
+    // The handle setters write straight to the program, bound or not
+    void set_uniform_vec3(UniformHandle handle, glm::vec3 in_vec)
+    {
+        glProgramUniform3fv(_program, handle.location, 1, glm::value_ptr(in_vec));
+    }
+
+    void set_uniform_float(UniformHandle handle, GLfloat in_val)
+    {
+        glProgramUniform1f(_program, handle.location, in_val);
+    }
+
+    void set_uniform_double(UniformHandle handle, GLdouble in_val)
+    {
+        glProgramUniform1d(_program, handle.location, in_val);
+    }
+
+    void set_uniform_int(UniformHandle handle, GLint in_val)
+    {
+        glProgramUniform1i(_program, handle.location, in_val);
+    }
+
+    void set_uniform_mat4(UniformHandle handle, const glm::mat4& in_mat)
+    {
+        glProgramUniformMatrix4fv(_program, handle.location, 1, GL_FALSE, glm::value_ptr(in_mat));
+    }
+
+    void set_uniform_vec3(const std::string& var_name, glm::vec3 in_vec)
+    {
+        set_uniform_vec3(get_uniform_handle(var_name), in_vec);
+    }
+
+    void set_uniform_float(const std::string& var_name, GLfloat in_val)
+    {
+        set_uniform_float(get_uniform_handle(var_name), in_val);
+    }
+
+    void set_uniform_double(const std::string& var_name, GLdouble in_val)
+    {
+        set_uniform_double(get_uniform_handle(var_name), in_val);
+    }
+
+    void set_uniform_int(const std::string& var_name, GLint in_val)
+    {
+        set_uniform_int(get_uniform_handle(var_name), in_val);
+    }
+
+    void set_uniform_mat4(const std::string& var_name, const glm::mat4& in_mat)
+    {
+        set_uniform_mat4(get_uniform_handle(var_name), in_mat);
+    }
+
+    void run_compute_program(int x_width=1024, int y_width=1024)
+    {
+        use();
+        glDispatchCompute(x_width, y_width, 1);
+    }
+
+    // local_size of the linked compute shader
+    glm::ivec3 local_size()
+    {
+        check_link();
+        if (_local_size.x == 0)
         {
-            loc = _uniform_locs[var_name];
+            GLint size[3] = { 1, 1, 1 };
+            if (_linked)
+            {
+                glGetProgramiv(_program, GL_COMPUTE_WORK_GROUP_SIZE, size);
+            }
+            _local_size = glm::ivec3(size[0], size[1], size[2]);
         }
-        use();
-        glUniform3fv(loc, 1, glm::value_ptr(in_vec));
+        return _local_size;
+    }
+
+    // Enough groups of the shader's local size to cover width x height
+    // invocations; the shader has to skip the ones past the edge
+    void dispatch_for_size(int width, int height)
+    {
+        glm::ivec3 size = local_size();
+        run_compute_program((width + size.x - 1) / size.x, (height + size.y - 1) / size.y);
     }
 
-    void set_uniform_float(std::string var_name, GLfloat in_val)
+  private:
+    // Whether the last link put every bound attribute at its location.
+    // Attributes the program doesn't use have none and don't count.
+    bool attrib_locations_linked()
     {
-        GLuint loc;
-        if (_uniform_locs.find(var_name) == _uniform_locs.end())
+        if (!linked())
         {
-            _uniform_locs[var_name] = glGetUniformLocation(_program, var_name.c_str());
-            loc = _uniform_locs[var_name];
+            return false;
         }
-        else
+        for (auto& attrib : _attrib_locations)
         {
-            loc = _uniform_locs[var_name];
+            GLint location = glGetAttribLocation(_program, attrib.first.c_str());
+            if (location != -1 && location != GLint(attrib.second))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Uses the sources compile_and_link() built for the cache key
+    void compile_shaders()
+    {
+        for (auto& shdr : _shaders)
+        {
+            if (!shdr.second->compile_started())
+            {
+                attach_shader(shdr.second);
+                shdr.second->start_compile();
+            }
         }
-        use();
-        glUniform1fv(loc, 1, &in_val);
     }
 
-    void set_uniform_double(std::string var_name, GLdouble in_val)
+    // Blocks until the last build is done, reports failures, and
+    // resolves the common uniforms. Saves the binary of a fresh build.
+    void check_link()
     {
-        GLuint loc;
-        if (_uniform_locs.find(var_name) == _uniform_locs.end())
+        if (_link_checked)
         {
-            _uniform_locs[var_name] = glGetUniformLocation(_program, var_name.c_str());
-            loc = _uniform_locs[var_name];
+            return;
         }
-        else
+        _link_checked = true;
+        GLint success;
+        glGetProgramiv(_program, GL_LINK_STATUS, &success);
+        _linked = success == GL_TRUE;
+        if (!_linked)
         {
-            loc = _uniform_locs[var_name];
+            for (auto& shdr : _shaders)
+            {
+                shdr.second->check_compile();
+            }
+            std::cout << " shader program link failed: " << "\n";
+            GLint log_size = 0;
+            glGetProgramiv(_program, GL_INFO_LOG_LENGTH, &log_size);
+            std::vector<GLchar> log_output(log_size);
+            glGetProgramInfoLog(_program, log_size, NULL, log_output.data());
+            std::string log_string(log_output.begin(), log_output.end());
+            std::cout << log_string << "\n";
         }
-        use();
-        glUniform1dv(loc, 1, &in_val);
+        else if (_save_binary)
+        {
+            program_binary_cache().save(_binary_key, _program);
+        }
+        _save_binary = false;
+        _local_size = glm::ivec3(0);
+        // Locations can change with every link
+        _uniform_locs.clear();
+        _common_uniforms.model_mat = get_uniform_handle("model_mat");
+        _common_uniforms.view_mat = get_uniform_handle(VIEW_MAT_NAME);
+        _common_uniforms.projection_mat = get_uniform_handle(PROJECTION_MAT_NAME);
+        _common_uniforms.x_res = get_uniform_handle("x_res");
+        _common_uniforms.y_res = get_uniform_handle("y_res");
     }
 
-    void set_uniform_int(std::string var_name, GLint in_val)
+    GLuint _program;
+    std::map<GLenum, std::shared_ptr<Shader>> _shaders;
+    std::map<std::string, GLint> _uniform_locs;
+    std::map<std::string, GLuint> _attrib_locations;
+    CommonUniforms _common_uniforms;
+    uint64_t _binary_key;
+    bool _from_binary;
+    bool _save_binary;
+    bool _link_checked;
+    bool _linked;
+    // Queried on first use, 0 until then
+    glm::ivec3 _local_size;
+};
+
+// Programs built from one compute shader file with different defines.
+// Each set of defines is compiled on first use and kept. Uniforms set
+// here go to every variant, including ones built later, so callers can
+// switch variants per dispatch without setting them up again.
+class ProgramVariants
+{
+  public:
+    ProgramVariants(std::string file_path, ShaderDefines base_defines = ShaderDefines()) :
+        _file_path(file_path),
+        _base_defines(base_defines)
+    {
+    }
+
+    // defines are added to the base defines, replacing ones of the same name
+    std::shared_ptr<Program> get(const ShaderDefines& defines = ShaderDefines())
     {
-        GLuint loc;
-        if (_uniform_locs.find(var_name) == _uniform_locs.end())
+        ShaderDefines all_defines = _base_defines;
+        for (auto& define : defines)
         {
-            _uniform_locs[var_name] = glGetUniformLocation(_program, var_name.c_str());
-            loc = _uniform_locs[var_name];
+            all_defines[define.first] = define.second;
         }
-        else
+        auto found = _variants.find(all_defines);
+        if (found != _variants.end())
         {
-            loc = _uniform_locs[var_name];
+            return found->second;
         }
-        use();
-        glUniform1iv(loc, 1, &in_val);
+        auto shader = std::make_shared<ComputeShader>(_file_path);
+        shader->set_defines(all_defines);
+        auto program = std::make_shared<Program>();
+        program->add_shader(shader);
+        program->compile_and_link();
+        for (auto& uniform : _int_uniforms)
+        {
+            program->set_uniform_int(uniform.first, uniform.second);
+        }
+        for (auto& uniform : _float_uniforms)
+        {
+            program->set_uniform_float(uniform.first, uniform.second);
+        }
+        _variants[all_defines] = program;
+        return program;
     }
 
-    void set_uniform_mat4(std::string var_name, glm::mat4 in_mat)
+    void set_uniform_int(const std::string& var_name, GLint in_val)
     {
-        GLuint loc;
-        if (_uniform_locs.find(var_name) == _uniform_locs.end())
+        _int_uniforms[var_name] = in_val;
+        for (auto& variant : _variants)
         {
-            _uniform_locs[var_name] = glGetUniformLocation(_program, var_name.c_str());
-            loc = _uniform_locs[var_name];
+            variant.second->set_uniform_int(var_name, in_val);
         }
-        else
+    }
+
+    void set_uniform_float(const std::string& var_name, GLfloat in_val)
+    {
+        _float_uniforms[var_name] = in_val;
+        for (auto& variant : _variants)
         {
-            loc = _uniform_locs[var_name];
+            variant.second->set_uniform_float(var_name, in_val);
         }
-        use();
-        glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(in_mat));
     }
 
-    void run_compute_program(int x_width=1024, int y_width=1024)
+    size_t variant_count() const
     {
-        use();
-        glDispatchCompute(x_width, y_width, 1);
+        return _variants.size();
+    }
+
+    // Drops every built variant, e.g. after trying out defines that
+    // won't be used again. Programs already handed out stay valid.
+    void clear()
+    {
+        _variants.clear();
     }
 
   private:
-    GLuint _program;
-    std::map<GLenum, std::shared_ptr<Shader>> _shaders;
-    std::map<std::string, int> _uniform_locs;
+    std::string _file_path;
+    ShaderDefines _base_defines;
+    std::map<ShaderDefines, std::shared_ptr<Program>> _variants;
+    std::map<std::string, GLint> _int_uniforms;
+    std::map<std::string, GLfloat> _float_uniforms;
 };
 
 }  // namespace graphics
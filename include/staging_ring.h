@@ -0,0 +1,150 @@
+#pragma once
+#ifndef GRAPHICS_STAGING_RING_H_
+#define GRAPHICS_STAGING_RING_H_
+
+#include <cstring>
+#include <deque>
+
+#include "gl_includes.h"
+
+namespace graphics
+{
+
+// Persistently mapped upload buffer used as a ring. Data is written
+// into the ring on the CPU and copied into its destination buffer on
+// the GPU. Each frame's allocations are guarded by a fence, and space
+// is only reused once the GPU has signaled it is done with it.
+class StagingRing
+{
+public:
+	StagingRing(size_t capacity) :
+		_capacity(capacity),
+		_head(0),
+		_used(0),
+		_pending(0)
+	{
+		glCreateBuffers(1, &_buffer_num);
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glNamedBufferStorage(_buffer_num, _capacity, NULL, flags);
+		_mapped_data = reinterpret_cast<char*>(
+			glMapNamedBufferRange(_buffer_num, 0, _capacity, flags));
+	}
+
+	~StagingRing()
+	{
+		for (auto& region : _in_flight)
+		{
+			glDeleteSync(region.fence);
+		}
+		glUnmapNamedBuffer(_buffer_num);
+		glDeleteBuffers(1, &_buffer_num);
+	}
+
+	// Copies count bytes of data into the ring and queues a GPU copy
+	// into dst_buffer at dst_offset. Returns false if the ring doesn't
+	// have room until earlier frames retire.
+	bool upload(GLuint dst_buffer, GLintptr dst_offset, const void* data, size_t count)
+	{
+		size_t offset = allocate(count);
+		if (offset == size_t(-1))
+		{
+			return false;
+		}
+		memcpy(_mapped_data + offset, data, count);
+		glCopyNamedBufferSubData(_buffer_num, dst_buffer, offset, dst_offset, count);
+		return true;
+	}
+
+	// Guards everything uploaded since the last call with a fence.
+	// Call once per frame after the uploads are issued.
+	void fence()
+	{
+		if (_pending)
+		{
+			_in_flight.push_back({ _pending, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) });
+			_pending = 0;
+		}
+	}
+
+	// Frees space from frames the GPU has finished with. Never blocks.
+	void reclaim()
+	{
+		while (_in_flight.size())
+		{
+			GLenum status = glClientWaitSync(_in_flight.front().fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			{
+				break;
+			}
+			glDeleteSync(_in_flight.front().fence);
+			_used -= _in_flight.front().size;
+			_in_flight.pop_front();
+		}
+	}
+
+	size_t capacity() const
+	{
+		return _capacity;
+	}
+
+	size_t free_space() const
+	{
+		return _capacity - _used;
+	}
+
+	// True if upload() of count bytes would find room now, counting the
+	// tail of the ring it may have to skip
+	bool fits(size_t count)
+	{
+		reclaim();
+		size_t size = aligned_size(count);
+		return _used + tail_waste(size) + size <= _capacity;
+	}
+
+private:
+	struct Region
+	{
+		size_t size;
+		GLsync fence;
+	};
+
+	// Keep copies 16 byte aligned
+	static size_t aligned_size(size_t count)
+	{
+		return (count + 15) & ~size_t(15);
+	}
+
+	// The tail end of the ring is skipped rather than splitting a copy
+	size_t tail_waste(size_t size) const
+	{
+		return _head + size > _capacity ? _capacity - _head : 0;
+	}
+
+	size_t allocate(size_t count)
+	{
+		size_t size = aligned_size(count);
+		reclaim();
+		size_t wasted = tail_waste(size);
+		size_t offset = wasted ? 0 : _head;
+		if (_used + wasted + size > _capacity)
+		{
+			return size_t(-1);
+		}
+		_head = offset + size;
+		_used += wasted + size;
+		_pending += wasted + size;
+		return offset;
+	}
+
+	GLuint _buffer_num;
+	char* _mapped_data;
+	size_t _capacity;
+	size_t _head;
+	size_t _used;
+	size_t _pending;
+	std::deque<Region> _in_flight;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_STAGING_RING_H_
@@ -2,6 +2,7 @@
 #ifndef GRAPHICS_TEXTURE_H_
 #define GRAPHICS_TEXTURE_H_
 
+#include <algorithm>
 #include <vector>
 #include <iostream>
 
@@ -317,6 +318,111 @@ private:
 	GLenum _format;
 };
 
+// Mip levels of a full chain for a width x height image
+inline int mip_level_count(int width, int height)
+{
+	int levels = 1;
+	while ((std::max(width, height) >> levels) > 0)
+	{
+		levels += 1;
+	}
+	return levels;
+}
+
+// RGBA8 2D texture array with a full mip chain, sampled through a
+// texture unit. Every layer has the array's size; set_layer() scales
+// images of other sizes to fit.
+class Texture2DArray : public Texture
+{
+public:
+	Texture2DArray(GLsizei size_x, GLsizei size_y, GLsizei layers) :
+		_size_x(size_x),
+		_size_y(size_y),
+		_layers(layers)
+	{
+		glDeleteTextures(1, &_texture_name);
+		glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &_texture_name);
+		glTextureStorage3D(_texture_name, mip_level_count(size_x, size_y), GL_RGBA8, size_x, size_y, layers);
+		glTextureParameteri(_texture_name, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTextureParameteri(_texture_name, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTextureParameteri(_texture_name, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		// Keeps the blocky look up close
+		glTextureParameteri(_texture_name, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
+	~Texture2DArray()
+	{
+		glDeleteTextures(1, &_texture_name);
+	}
+
+	Texture2DArray(const Texture2DArray&) = delete;
+	Texture2DArray& operator=(const Texture2DArray&) = delete;
+
+	// Uploads width x height RGBA8 pixels to level 0 of layer
+	void set_layer(int layer, int width, int height, const unsigned char* pixels)
+	{
+		if (width == _size_x && height == _size_y)
+		{
+			glTextureSubImage3D(_texture_name, 0, 0, 0, layer, width, height, 1,
+				GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+			return;
+		}
+		// Scale on the GPU by blitting from a temporary texture
+		GLuint source;
+		glCreateTextures(GL_TEXTURE_2D, 1, &source);
+		glTextureStorage2D(source, 1, GL_RGBA8, width, height);
+		glTextureSubImage2D(source, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		GLuint framebuffers[2];
+		glCreateFramebuffers(2, framebuffers);
+		glNamedFramebufferTexture(framebuffers[0], GL_COLOR_ATTACHMENT0, source, 0);
+		glNamedFramebufferTextureLayer(framebuffers[1], GL_COLOR_ATTACHMENT0, _texture_name, 0, layer);
+		glBlitNamedFramebuffer(framebuffers[0], framebuffers[1], 0, 0, width, height,
+			0, 0, _size_x, _size_y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glDeleteFramebuffers(2, framebuffers);
+		glDeleteTextures(1, &source);
+	}
+
+	// Uploads level for every layer at once from pixels holding each
+	// layer's level back to back
+	void set_level(int level, const unsigned char* pixels)
+	{
+		glTextureSubImage3D(_texture_name, level, 0, 0, 0,
+			std::max(1, _size_x >> level), std::max(1, _size_y >> level), _layers,
+			GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	}
+
+	// Rebuilds every level below 0 from level 0
+	void generate_mipmaps()
+	{
+		glGenerateTextureMipmap(_texture_name);
+	}
+
+	void bind_unit(int unit)
+	{
+		glBindTextureUnit(unit, _texture_name);
+	}
+
+	GLint width() const
+	{
+		return _size_x;
+	}
+
+	GLint height() const
+	{
+		return _size_y;
+	}
+
+	GLint layers() const
+	{
+		return _layers;
+	}
+
+private:
+	GLint _size_x;
+	GLint _size_y;
+	GLint _layers;
+};
+
 }  // namespace graphics
 
 #endif  // GRAPHICS_TEXTURE_H_
@@ -0,0 +1,343 @@
+#pragma once
+#ifndef TEXTURE_CACHE_H_
+#define TEXTURE_CACHE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "loadbmp.h"
+#include "mapped_file.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXTURE_CACHE_SSE2
+#endif
+
+const char texture_cache_magic[4] = { 'U', 'G', 'T', 'C' };
+const uint32_t texture_cache_version = 1;
+
+// On disk layout of a texture cache file:
+//   TextureCacheHeader
+//   uint64_t[layer_count]   hash of each source BMP file, in layer order
+//   levels                  RGBA8, level 0 first; each level holds every
+//                           layer back to back, ready for one upload
+struct TextureCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	int32_t layer_count;
+	int32_t width;
+	int32_t height;
+	int32_t level_count;
+};
+
+// 64 bit FNV-1a of a whole file, 0 if it can't be read
+inline uint64_t texture_source_hash(const std::string& path)
+{
+	MappedFile file(path);
+	if (!file.is_open())
+	{
+		return 0;
+	}
+	uint64_t hash = 14695981039346656037ull;
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(file.data());
+	for (size_t i = 0; i < file.size(); ++i)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+inline int texture_level_size(int size, int level)
+{
+	return std::max(1, size >> level);
+}
+
+// Bytes of one level for every layer
+inline size_t texture_level_bytes(int width, int height, int layer_count, int level)
+{
+	return size_t(4) * texture_level_size(width, level) * texture_level_size(height, level) * layer_count;
+}
+
+// Halves an RGBA8 image with a 2x2 box filter. Each output channel is
+// avg(avg(top left, bottom left), avg(top right, bottom right)) with
+// rounding up at both steps, which is what _mm_avg_epu8 does, so the
+// SSE2 and scalar paths give the same bytes. Odd edges repeat the last
+// row or column.
+inline void downsample_rgba8(const unsigned char* src, int width, int height, unsigned char* dst)
+{
+	int out_width = texture_level_size(width, 1);
+	int out_height = texture_level_size(height, 1);
+	for (int y = 0; y < out_height; ++y)
+	{
+		const unsigned char* row0 = src + size_t(4) * width * std::min(2 * y, height - 1);
+		const unsigned char* row1 = src + size_t(4) * width * std::min(2 * y + 1, height - 1);
+		unsigned char* out = dst + size_t(4) * out_width * y;
+		int x = 0;
+#ifdef TEXTURE_CACHE_SSE2
+		if (width % 2 == 0)
+		{
+			// 8 source pixels to 4 output pixels per step
+			for (; x + 4 <= out_width; x += 4)
+			{
+				__m128i top_a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 8 * x));
+				__m128i top_b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + 8 * x + 16));
+				__m128i bottom_a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 8 * x));
+				__m128i bottom_b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + 8 * x + 16));
+				__m128 column_a = _mm_castsi128_ps(_mm_avg_epu8(top_a, bottom_a));
+				__m128 column_b = _mm_castsi128_ps(_mm_avg_epu8(top_b, bottom_b));
+				__m128i left = _mm_castps_si128(_mm_shuffle_ps(column_a, column_b, _MM_SHUFFLE(2, 0, 2, 0)));
+				__m128i right = _mm_castps_si128(_mm_shuffle_ps(column_a, column_b, _MM_SHUFFLE(3, 1, 3, 1)));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * x), _mm_avg_epu8(left, right));
+			}
+		}
+#endif
+		for (; x < out_width; ++x)
+		{
+			int x0 = std::min(2 * x, width - 1);
+			int x1 = std::min(2 * x + 1, width - 1);
+			for (int c = 0; c < 4; ++c)
+			{
+				int left = (row0[4 * x0 + c] + row1[4 * x0 + c] + 1) >> 1;
+				int right = (row0[4 * x1 + c] + row1[4 * x1 + c] + 1) >> 1;
+				out[4 * x + c] = (unsigned char)((left + right + 1) >> 1);
+			}
+		}
+	}
+}
+
+// Decoded block textures with every mip level, laid out as in the cache
+// file. Either owns its pixels after bake() or points into a mapping
+// after load().
+class TextureCache
+{
+public:
+	TextureCache() :
+		_width(0),
+		_height(0),
+		_layer_count(0),
+		_level_count(0),
+		_pixels(nullptr)
+	{
+	}
+
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	// Maps path and checks it was baked from exactly these sources.
+	// Returns false if it is missing, stale or damaged.
+	bool load(const std::string& path, const std::vector<std::string>& sources,
+		const std::vector<uint64_t>& source_hashes)
+	{
+		_file.open(path);
+		if (!_file.is_open() || _file.size() < sizeof(TextureCacheHeader))
+		{
+			return false;
+		}
+		TextureCacheHeader header;
+		memcpy(&header, _file.data(), sizeof(header));
+		if (memcmp(header.magic, texture_cache_magic, 4) != 0 ||
+			header.version != texture_cache_version ||
+			header.layer_count != int(sources.size()))
+		{
+			return false;
+		}
+		size_t hash_bytes = sizeof(uint64_t) * sources.size();
+		if (_file.size() < sizeof(TextureCacheHeader) + hash_bytes ||
+			memcmp(_file.data() + sizeof(TextureCacheHeader), source_hashes.data(), hash_bytes) != 0)
+		{
+			return false;
+		}
+		set_size(header.width, header.height, header.layer_count);
+		if (header.level_count != _level_count ||
+			_file.size() < sizeof(TextureCacheHeader) + hash_bytes + total_bytes())
+		{
+			std::cout << "Texture cache damaged: " << path << "\n";
+			return false;
+		}
+		_pixels = reinterpret_cast<const unsigned char*>(_file.data() + sizeof(TextureCacheHeader) + hash_bytes);
+		return true;
+	}
+
+	// Decodes every source on a pool of threads and builds all mip
+	// levels. Layers take the largest image size; smaller images are
+	// scaled up by pixel repetition. A source that can't be decoded
+	// leaves its layer black. thread_count 0 uses every core.
+	void bake(const std::vector<std::string>& sources, int thread_count = 0)
+	{
+		struct Image
+		{
+			unsigned char* pixels;
+			unsigned int width;
+			unsigned int height;
+		};
+		std::vector<Image> images(sources.size(), Image{ NULL, 0, 0 });
+		if (thread_count <= 0)
+		{
+			thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+		}
+		thread_count = std::min<int>(thread_count, std::max<size_t>(sources.size(), 1));
+
+		run_parallel(int(sources.size()), thread_count, [&](int i)
+			{
+				if (loadbmp_decode_file(sources[i].c_str(), &images[i].pixels,
+					&images[i].width, &images[i].height, LOADBMP_RGBA))
+				{
+					std::cout << "Couldn't load texture " << sources[i] << "\n";
+					images[i] = Image{ NULL, 0, 0 };
+				}
+			});
+
+		int width = 1;
+		int height = 1;
+		for (auto& image : images)
+		{
+			width = std::max(width, int(image.width));
+			height = std::max(height, int(image.height));
+		}
+		set_size(width, height, std::max<int>(images.size(), 1));
+		_owned.assign(total_bytes(), 0);
+		_pixels = _owned.data();
+
+		run_parallel(int(images.size()), thread_count, [&](int i)
+			{
+				if (!images[i].pixels)
+				{
+					return;
+				}
+				unsigned char* layer = _owned.data() + layer_offset(0, i);
+				for (int y = 0; y < _height; ++y)
+				{
+					int src_y = y * int(images[i].height) / _height;
+					for (int x = 0; x < _width; ++x)
+					{
+						int src_x = x * int(images[i].width) / _width;
+						memcpy(layer + size_t(4) * (x + _width * y),
+							images[i].pixels + size_t(4) * (src_x + images[i].width * src_y), 4);
+					}
+				}
+				free(images[i].pixels);
+				for (int level = 1; level < _level_count; ++level)
+				{
+					downsample_rgba8(_owned.data() + layer_offset(level - 1, i),
+						texture_level_size(_width, level - 1), texture_level_size(_height, level - 1),
+						_owned.data() + layer_offset(level, i));
+				}
+			});
+	}
+
+	bool save(const std::string& path, const std::vector<uint64_t>& source_hashes) const
+	{
+		std::ofstream file(path, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+		TextureCacheHeader header;
+		memcpy(header.magic, texture_cache_magic, 4);
+		header.version = texture_cache_version;
+		header.layer_count = _layer_count;
+		header.width = _width;
+		header.height = _height;
+		header.level_count = _level_count;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(source_hashes.data()), sizeof(uint64_t) * source_hashes.size());
+		file.write(reinterpret_cast<const char*>(_pixels), total_bytes());
+		return bool(file);
+	}
+
+	// Every layer of level, back to back
+	const unsigned char* level_data(int level) const
+	{
+		return _pixels + layer_offset(level, 0);
+	}
+
+	int width() const
+	{
+		return _width;
+	}
+
+	int height() const
+	{
+		return _height;
+	}
+
+	int layer_count() const
+	{
+		return _layer_count;
+	}
+
+	int level_count() const
+	{
+		return _level_count;
+	}
+
+private:
+	template <class F>
+	static void run_parallel(int count, int thread_count, F func)
+	{
+		std::atomic<int> next(0);
+		auto worker = [&]()
+		{
+			for (int i = next++; i < count; i = next++)
+			{
+				func(i);
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int t = 1; t < thread_count; ++t)
+		{
+			threads.emplace_back(worker);
+		}
+		worker();
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	void set_size(int width, int height, int layer_count)
+	{
+		_width = width;
+		_height = height;
+		_layer_count = layer_count;
+		_level_count = 1;
+		while ((std::max(width, height) >> _level_count) > 0)
+		{
+			_level_count += 1;
+		}
+	}
+
+	size_t layer_offset(int level, int layer) const
+	{
+		size_t offset = 0;
+		for (int i = 0; i < level; ++i)
+		{
+			offset += texture_level_bytes(_width, _height, _layer_count, i);
+		}
+		return offset + texture_level_bytes(_width, _height, 1, level) * layer;
+	}
+
+	size_t total_bytes() const
+	{
+		return layer_offset(_level_count, 0);
+	}
+
+	int _width;
+	int _height;
+	int _layer_count;
+	int _level_count;
+	const unsigned char* _pixels;
+	std::vector<unsigned char> _owned;
+	MappedFile _file;
+};
+
+#endif  // TEXTURE_CACHE_H_
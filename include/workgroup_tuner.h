@@ -0,0 +1,191 @@
+#pragma once
+#ifndef GRAPHICS_WORKGROUP_TUNER_H_
+#define GRAPHICS_WORKGROUP_TUNER_H_
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "gl_includes.h"
+#include "gpu_timer.h"
+
+namespace graphics
+{
+
+// local_size x and y tried by WorkgroupTuner::tune(). Square tiles keep
+// neighbouring rays together; the wide ones suit drivers with 32 or 64
+// wide subgroups.
+const std::vector<glm::ivec2> default_workgroup_candidates = {
+	{ 8, 4 }, { 8, 8 }, { 16, 4 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 2 }, { 32, 4 }, { 32, 8 } };
+
+// Dispatches timed per candidate, after one untimed warm up dispatch
+const int default_workgroup_tune_iterations = 8;
+
+struct WorkgroupResult
+{
+	glm::ivec2 size;
+	double avg_ms;
+};
+
+// Finds the fastest work group size of a compute kernel and remembers it
+// per GPU. Entries are keyed on GL_RENDERER and a kernel name and kept in
+// a text file, one "renderer<tab>name<tab>x<tab>y" line each, so one file
+// can serve machines with different drivers. Needs a current context.
+class WorkgroupTuner
+{
+public:
+	// Without a path nothing is loaded or saved
+	WorkgroupTuner(const std::string& path = "") :
+		_path(path)
+	{
+		const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+		_renderer = renderer ? renderer : "";
+		load();
+	}
+
+	// Size stored for name on this GPU
+	bool find(const std::string& name, glm::ivec2& size) const
+	{
+		auto found = _sizes.find(key(name));
+		if (found == _sizes.end())
+		{
+			return false;
+		}
+		size = found->second;
+		return true;
+	}
+
+	void store(const std::string& name, glm::ivec2 size)
+	{
+		_sizes[key(name)] = size;
+		save();
+	}
+
+	// Times run(size), which has to dispatch the kernel built with that
+	// local size, for each candidate the GPU supports. Stores and returns
+	// the fastest. Waits for the GPU after every dispatch, so only call it
+	// outside the frame loop.
+	template <class F>
+	glm::ivec2 tune(const std::string& name, F run,
+		const std::vector<glm::ivec2>& candidates = default_workgroup_candidates,
+		int iterations = default_workgroup_tune_iterations)
+	{
+		GLint max_invocations = 0;
+		GLint max_x = 0;
+		GLint max_y = 0;
+		glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+		glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_x);
+		glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &max_y);
+
+		_results.clear();
+		glm::ivec2 best(0);
+		double best_ms = 0;
+		for (auto size : candidates)
+		{
+			if (size.x * size.y > max_invocations || size.x > max_x || size.y > max_y)
+			{
+				continue;
+			}
+			// Builds the variant and warms the caches
+			run(size);
+			glFinish();
+			GpuTimer timer;
+			for (int i = 0; i < iterations; ++i)
+			{
+				timer.start();
+				run(size);
+				timer.stop();
+				glFinish();
+			}
+			GpuTimerStats stats = timer.stats();
+			_results.push_back(WorkgroupResult{ size, stats.avg_ms });
+			if (best.x == 0 || stats.avg_ms < best_ms)
+			{
+				best = size;
+				best_ms = stats.avg_ms;
+			}
+		}
+		if (best.x == 0)
+		{
+			std::cout << "No work group size to tune " << name << " with\n";
+			return best;
+		}
+		store(name, best);
+		return best;
+	}
+
+	// Timings of the last tune(), in candidate order
+	const std::vector<WorkgroupResult>& results() const
+	{
+		return _results;
+	}
+
+	const std::string& renderer() const
+	{
+		return _renderer;
+	}
+
+private:
+	std::string key(const std::string& name) const
+	{
+		return _renderer + "\t" + name;
+	}
+
+	void load()
+	{
+		if (_path.empty())
+		{
+			return;
+		}
+		std::ifstream file(_path);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			size_t name_end = line.find('\t');
+			size_t size_start = name_end == std::string::npos ? name_end : line.find('\t', name_end + 1);
+			if (size_start == std::string::npos)
+			{
+				continue;
+			}
+			std::istringstream size_text(line.substr(size_start + 1));
+			glm::ivec2 size;
+			if (size_text >> size.x >> size.y && size.x > 0 && size.y > 0)
+			{
+				_sizes[line.substr(0, size_start)] = size;
+			}
+		}
+	}
+
+	void save() const
+	{
+		if (_path.empty())
+		{
+			return;
+		}
+		std::ofstream file(_path);
+		if (!file)
+		{
+			std::cout << "Couldn't write work group sizes to " << _path << "\n";
+			return;
+		}
+		for (auto& entry : _sizes)
+		{
+			file << entry.first << "\t" << entry.second.x << "\t" << entry.second.y << "\n";
+		}
+	}
+
+	std::string _path;
+	std::string _renderer;
+	// Keyed on renderer and kernel name
+	std::map<std::string, glm::ivec2> _sizes;
+	std::vector<WorkgroupResult> _results;
+};
+
+}  // namespace graphics
+
+#endif  // GRAPHICS_WORKGROUP_TUNER_H_
@@ -0,0 +1,55 @@
+// Per frame data of the trace and GI filter programs, uploaded in one
+// buffer write per frame. Included by multi_ray.glsl, gi_filter.glsl
+// and include/frame_uniforms.h, so it has to stay valid GLSL and C++.
+// std140 layout: vectors are 4 wide to keep C++ and GLSL offsets equal.
+#ifndef FRAME_UNIFORMS_GLSL_
+#define FRAME_UNIFORMS_GLSL_
+
+#define FRAME_UNIFORMS_BINDING 0
+
+#ifdef __cplusplus
+#define FRAME_VEC4 glm::vec4
+#define FRAME_IVEC4 glm::ivec4
+#define FRAME_UNIFORMS_BLOCK struct FrameUniforms
+#define FRAME_UNIFORMS_INSTANCE
+#else
+#define FRAME_VEC4 vec4
+#define FRAME_IVEC4 ivec4
+#define FRAME_UNIFORMS_BLOCK layout(std140, binding = FRAME_UNIFORMS_BINDING) uniform FrameUniforms
+#define FRAME_UNIFORMS_INSTANCE frame
+#endif
+
+FRAME_UNIFORMS_BLOCK
+{
+    // Camera position and the rays through the screen corners, relative
+    // to it. Only xyz is used.
+    FRAME_VEC4 eye;
+    FRAME_VEC4 ray00;
+    FRAME_VEC4 ray01;
+    FRAME_VEC4 ray10;
+    FRAME_VEC4 ray11;
+    // Camera of the last filtered frame, for GI reprojection
+    FRAME_VEC4 prev_eye;
+    FRAME_VEC4 prev_ray00;
+    FRAME_VEC4 prev_ray01;
+    FRAME_VEC4 prev_ray10;
+    // Lowest chunk coordinate covered by the (toroidal) chunk map, xyz
+    FRAME_IVEC4 chunk_map_origin;
+    // Traced area this frame and in the filter history, in pixels from
+    // the corner of the full size targets: full pass xy, low res pass zw
+    FRAME_IVEC4 render_size;
+    FRAME_IVEC4 prev_render_size;
+    double ttime;
+    int max_bounces;
+    int include_first_bounce;
+    // MappedOctree frame counter, stamped on every octree node a lookup visits
+    int octree_frame;
+    // RadianceCache frame counter
+    int cache_frame;
+    int history_valid;
+    // Whether the bounce pass may write the light octree, off while the
+    // CPU waits to edit it
+    int octree_writes;
+} FRAME_UNIFORMS_INSTANCE;
+
+#endif  // FRAME_UNIFORMS_GLSL_
@@ -4,54 +4,165 @@
 #define GROUP_SIZE_Y 8
 #define GROUP_SIZE_Z 1
 
-
-#define INV_SQRT_OF_2PI 0.39894228040143267793994605993439  // 1.0/SQRT_OF_2PI
-#define INV_PI 0.31830988618379067153776752674503
+// Passes, run in this order each frame:
+//   temporal   reproject last frame's GI history and blend in the new bounce pass
+//   atrous     one direction of one a-trous iteration, run horizontal then
+//              vertical with the step doubling every iteration
+//   composite  swap the raw bounce light in color_tex for the filtered one
+#define PASS_TEMPORAL 0
+#define PASS_ATROUS 1
+#define PASS_COMPOSITE 2
 
 layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
 
 layout(binding = 1, rgba32f) uniform image2D color_tex;
 layout(binding = 2, rgba32f) uniform image2D norm_tex;
 layout(binding = 3, rgba32f) uniform image2D bounce_pass;
+layout(binding = 4, rgba32f) uniform image2D src_tex;
+layout(binding = 5, rgba32f) uniform image2D dst_tex;
+layout(binding = 6, rgba32f) uniform image2D history_tex;
+layout(binding = 7, rgba32f) uniform image2D history_norm_tex;
+
+uniform int pass;
+
+// Camera this frame and last frame, and whether the history is valid
+#include "frame_uniforms.glsl"
+
+// Lowest weight given to the new frame, and the number of frames
+// after which the history stops gaining weight
+uniform float temporal_alpha;
+uniform float max_history;
 
-int offset_radius = 3;
+// Pixel offset between taps, (2^i, 0) or (0, 2^i) for iteration i
+uniform int step_x;
+uniform int step_y;
+uniform float normal_phi;
+uniform float depth_phi;
+
+// B3 spline taps, center first
+const float kernel[3] = float[](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+bool has_surface(vec4 norm)
+{
+	return dot(norm.xyz, norm.xyz) > 0.5;
+}
+
+// Finds where world_pos was on screen last frame
+bool project_to_prev(vec3 world_pos, out vec2 uv)
+{
+	vec3 x_axis = frame.prev_ray10.xyz - frame.prev_ray00.xyz;
+	vec3 y_axis = frame.prev_ray01.xyz - frame.prev_ray00.xyz;
+	vec3 plane_norm = cross(x_axis, y_axis);
+	vec3 rel = world_pos - frame.prev_eye.xyz;
+	float plane_d = dot(frame.prev_ray00.xyz, plane_norm);
+	float rel_d = dot(rel, plane_norm);
+	uv = vec2(-1);
+	if (rel_d * plane_d <= 0)
+	{
+		return false;
+	}
+	vec3 on_plane = rel * (plane_d / rel_d) - frame.prev_ray00.xyz;
+	uv = vec2(dot(on_plane, x_axis) / dot(x_axis, x_axis),
+		dot(on_plane, y_axis) / dot(y_axis, y_axis));
+	return all(greaterThanEqual(uv, vec2(0))) && all(lessThan(uv, vec2(1)));
+}
+
+void temporal(ivec2 pix, ivec2 size)
+{
+	vec4 bounce = imageLoad(bounce_pass, pix);
+	vec4 norm = imageLoad(norm_tex, pix);
+	vec4 result = vec4(bounce.rgb, 1);
+	vec2 prev_uv;
+	if (frame.history_valid > 0 && has_surface(norm))
+	{
+		vec2 uv = vec2(pix) / vec2(size);
+		vec3 dir = normalize(mix(mix(frame.ray00.xyz, frame.ray01.xyz, uv.y), mix(frame.ray10.xyz, frame.ray11.xyz, uv.y), uv.x));
+		vec3 world_pos = frame.eye.xyz + dir * norm.w;
+		if (project_to_prev(world_pos, prev_uv))
+		{
+			// The history may have been traced at another render scale
+			ivec2 prev_pix = ivec2(prev_uv * vec2(frame.prev_render_size.xy) + 0.5);
+			vec4 prev_norm = imageLoad(history_norm_tex, prev_pix);
+			float expected_d = length(world_pos - frame.prev_eye.xyz);
+			// Only reuse history from the same surface
+			if (dot(prev_norm.xyz, norm.xyz) > 0.9 &&
+				abs(prev_norm.w - expected_d) < 0.05 * expected_d + 0.1)
+			{
+				vec4 history = imageLoad(history_tex, prev_pix);
+				float count = min(history.w + 1, max_history);
+				float alpha = max(1.0 / count, temporal_alpha);
+				result = vec4(mix(history.rgb, bounce.rgb, alpha), count);
+			}
+		}
+	}
+	imageStore(dst_tex, pix, result);
+}
 
-vec4 smartDeNoise(ivec2 pix, vec4 centrPx)
+// Edge stopping on normals and depth keeps light from bleeding
+// across block edges and between near and far surfaces
+void atrous(ivec2 pix, ivec2 size)
 {
-	vec4 n1 = imageLoad(norm_tex, pix);
-	const float trad = centrPx.w;
-	const float radius = clamp(int(20*(100 - n1.w)/100.0),0,20);
-	float radQ = radius * radius;
-	vec4 out_px = vec4(0);
-	float factor = 0;
-	int count = 0;
-	for (float x = -radius; x <= radius; x+=2) {
-		float pt = sqrt(radQ - x * x);  // pt = yRadius: have circular trend
-		for (float y = -pt; y <= pt; y+=2) {
-			vec2 d = vec2(x, y);
-			vec4 walk_norm = imageLoad(norm_tex, pix+ivec2(x, y));
-			vec4 walk_px = imageLoad(bounce_pass, pix + ivec2(x,y));
-			out_px += walk_px * max(dot(walk_norm.xyz, n1.xyz), 0)*clamp((5 - abs(centrPx.w - walk_px.w))/5.0, 0, 1);
-			factor += max(dot(walk_norm.xyz, n1.xyz), 0) * clamp((5 - abs(centrPx.w - walk_px.w)) / 5.0, 0, 1);
-			count += 1;
+	vec4 center = imageLoad(src_tex, pix);
+	vec4 norm = imageLoad(norm_tex, pix);
+	if (!has_surface(norm))
+	{
+		imageStore(dst_tex, pix, center);
+		return;
+	}
+	ivec2 step_dir = ivec2(step_x, step_y);
+	float step_len = float(max(step_x, step_y));
+	vec3 sum = center.rgb * kernel[0];
+	float weight_sum = kernel[0];
+	for (int i = -2; i <= 2; ++i)
+	{
+		ivec2 tap = pix + step_dir * i;
+		if (i == 0 || any(lessThan(tap, ivec2(0))) || any(greaterThanEqual(tap, size)))
+		{
+			continue;
 		}
+		vec4 tap_norm = imageLoad(norm_tex, tap);
+		if (!has_surface(tap_norm))
+		{
+			continue;
+		}
+		float w_normal = pow(max(dot(norm.xyz, tap_norm.xyz), 0), normal_phi);
+		float w_depth = exp(-abs(norm.w - tap_norm.w) / (depth_phi * norm.w * step_len * abs(i) + 0.0001));
+		float weight = kernel[abs(i)] * w_normal * w_depth;
+		sum += imageLoad(src_tex, tap).rgb * weight;
+		weight_sum += weight;
 	}
-	return out_px / factor;
+	imageStore(dst_tex, pix, vec4(sum / weight_sum, center.w));
 }
 
-float random(vec2 st) {
-	return fract(sin(dot(st.xy,
-		vec2(12.9898, 78.233))) *
-		43758.5453123);
+void composite(ivec2 pix)
+{
+	vec4 base = imageLoad(color_tex, pix);
+	vec4 bounce = imageLoad(bounce_pass, pix);
+	vec4 filtered = imageLoad(src_tex, pix);
+	vec4 norm = imageLoad(norm_tex, pix);
+	imageStore(color_tex, pix, vec4(base.rgb - bounce.rgb + filtered.rgb, base.w));
+	imageStore(history_norm_tex, pix, norm);
 }
 
 void main()
 {
 	ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
-	ivec2 image_size = imageSize(color_tex);
-	vec4 bounce = imageLoad(bounce_pass, pix);
-	vec4 base = imageLoad(color_tex, pix);
+	ivec2 size = frame.render_size.xy;
+	if (pix.x >= size.x || pix.y >= size.y)
+	{
+		return;
+	}
 
-	vec4 val = smartDeNoise(pix, bounce);
-	imageStore(color_tex, pix, base + val);
-}
\ No newline at end of file
+	if (pass == PASS_TEMPORAL)
+	{
+		temporal(pix, size);
+	}
+	else if (pass == PASS_ATROUS)
+	{
+		atrous(pix, size);
+	}
+	else
+	{
+		composite(pix);
+	}
+}
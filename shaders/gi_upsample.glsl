@@ -0,0 +1,99 @@
+#version 460 core
+
+#define GROUP_SIZE_X 8
+#define GROUP_SIZE_Y 8
+#define GROUP_SIZE_Z 1
+
+layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
+
+// Joint bilateral upsampling of the bounce light from the low resolution
+// pass. Runs after the full resolution pass, which took the nearest low
+// resolution texel; each pixel instead blends the 4x4 low resolution
+// texels around it, weighted by distance and by how well their normal
+// and depth match the pixel's own. Light stays on the surface it was
+// gathered for, so a coarse GI buffer doesn't halo around edges.
+layout(binding = 1, rgba32f) uniform image2D color_tex;
+layout(binding = 2, rgba32f) uniform image2D norm_tex;
+layout(binding = 3, rgba32f) uniform image2D bounce_pass;
+layout(binding = 4, rgba32f) uniform image2D low_res_tex;
+layout(binding = 5, rgba32f) uniform image2D low_res_norm_tex;
+
+#include "frame_uniforms.glsl"
+
+uniform float normal_phi;
+uniform float depth_phi;
+
+// Falloff of the distance weight, in low resolution texels
+const float spatial_sigma = 1.0;
+
+bool has_surface(vec4 norm)
+{
+	return dot(norm.xyz, norm.xyz) > 0.5;
+}
+
+void main()
+{
+	ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = frame.render_size.xy;
+	if (pix.x >= size.x || pix.y >= size.y)
+	{
+		return;
+	}
+	vec4 norm = imageLoad(norm_tex, pix);
+	if (!has_surface(norm))
+	{
+		return;
+	}
+
+	// Same pixel to ray mapping as both trace passes, pix / size
+	ivec2 low_size = frame.render_size.zw;
+	vec2 low_pos = vec2(pix) * vec2(low_size) / vec2(size);
+	ivec2 base = ivec2(floor(low_pos)) - 1;
+
+	vec3 sum = vec3(0);
+	float weight_sum = 0;
+	// Fallback when no texel is on the same surface: the closest in depth
+	vec3 closest = vec3(0);
+	float closest_depth_error = -1;
+	for (int y = 0; y < 4; ++y)
+	{
+		for (int x = 0; x < 4; ++x)
+		{
+			ivec2 tap = base + ivec2(x, y);
+			if (any(lessThan(tap, ivec2(0))) || any(greaterThanEqual(tap, low_size)))
+			{
+				continue;
+			}
+			vec4 tap_norm = imageLoad(low_res_norm_tex, tap);
+			if (!has_surface(tap_norm))
+			{
+				continue;
+			}
+			vec3 light = imageLoad(low_res_tex, tap).rgb;
+			float depth_error = abs(norm.w - tap_norm.w);
+			if (closest_depth_error < 0 || depth_error < closest_depth_error)
+			{
+				closest = light;
+				closest_depth_error = depth_error;
+			}
+			vec2 offset = vec2(tap) - low_pos;
+			float w_spatial = exp(-dot(offset, offset) / (2 * spatial_sigma * spatial_sigma));
+			float w_normal = pow(max(dot(norm.xyz, tap_norm.xyz), 0), normal_phi);
+			float w_depth = exp(-depth_error / (depth_phi * norm.w + 0.0001));
+			float weight = w_spatial * w_normal * w_depth;
+			sum += light * weight;
+			weight_sum += weight;
+		}
+	}
+	if (closest_depth_error < 0)
+	{
+		return;
+	}
+	vec3 upsampled = weight_sum > 0.0001 ? sum / weight_sum : closest;
+
+	// Swap the nearest texel the trace added for the upsampled light
+	vec4 bounce = imageLoad(bounce_pass, pix);
+	vec4 color = imageLoad(color_tex, pix);
+	imageStore(color_tex, pix, vec4(color.rgb - bounce.rgb + upsampled, color.w));
+	imageStore(bounce_pass, pix, vec4(upsampled, bounce.w));
+}
@@ -0,0 +1,29 @@
+// Light list entry. Included by both multi_ray.glsl and
+// include/light_list.h, so it has to stay valid GLSL and C++.
+//
+// Shading picks lights from the list in proportion to their intensity
+// by binary search over power_sum, then resamples those candidates by
+// their contribution at the hit, see sample_lights() in multi_ray.glsl.
+#ifndef LIGHT_SOURCE_GLSL_
+#define LIGHT_SOURCE_GLSL_
+
+#define LIGHT_SOURCE_BYTES 48
+
+#ifdef __cplusplus
+#define LIGHT_VEC4 glm::vec4
+#else
+#define LIGHT_VEC4 vec4
+#endif
+
+struct LightSource
+{
+    // xyz position; w distance from it at which shadow rays stop, so an
+    // emissive block doesn't shadow itself
+    LIGHT_VEC4 position;
+    // rgb color; w intensity
+    LIGHT_VEC4 color;
+    // x sum of the intensities of this and every earlier light
+    LIGHT_VEC4 power_sum;
+};
+
+#endif  // LIGHT_SOURCE_GLSL_
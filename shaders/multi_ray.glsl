@@ -1,29 +1,65 @@
 #version 460 core
 
+// Defaults for the constants a variant may override, see
+// graphics::ProgramVariants
+#ifndef MAX_CHILD_RAYS
 #define MAX_CHILD_RAYS 3
+#endif
+#ifndef MAX_BOUNCES
 #define MAX_BOUNCES 5
+#endif
+#ifndef MAX_INITIAL_SHOTS
 #define MAX_INITIAL_SHOTS 1
+#endif
+#ifndef ARRAY_SIZE
 #define ARRAY_SIZE 5
+#endif
+#ifndef MAX_CHUNK_INFOS
 #define MAX_CHUNK_INFOS 10
+#endif
+#ifndef MAX_OCTREE_ELEMENTS
 #define MAX_OCTREE_ELEMENTS 100000
+#endif
+// Lights drawn from the light list per shading point, see sample_lights()
+#ifndef LIGHT_CANDIDATES
+#define LIGHT_CANDIDATES 8
+#endif
 
+#ifndef GROUP_SIZE_X
 #define GROUP_SIZE_X 8
+#endif
+#ifndef GROUP_SIZE_Y
 #define GROUP_SIZE_Y 8
+#endif
+#ifndef GROUP_SIZE_Z
 #define GROUP_SIZE_Z 1
+#endif
 
 #define valtype vec4
 
+// light_cache_mode values, see Raytracer::set_light_cache_mode()
+#define LIGHT_CACHE_OCTREE 0
+#define LIGHT_CACHE_HASH 1
+
 layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
 
-struct Octree
-{
-    float size; // side size
-    vec4 pos; // "floor" corner of bounds
-    int children[8];
-    valtype value;
-    int parent;
-    //int pad[3];
-};
+#include "octree_node.glsl"
+#include "radiance_cache_entry.glsl"
+#include "light_source.glsl"
+#include "frame_uniforms.glsl"
+
+// A variant can fix the bounce settings at compile time. Otherwise they
+// come from the frame uniforms.
+#ifdef FIXED_MAX_BOUNCES
+#define max_bounces FIXED_MAX_BOUNCES
+#else
+#define max_bounces frame.max_bounces
+#endif
+#ifdef FIXED_INCLUDE_FIRST_BOUNCE
+#define include_first_bounce FIXED_INCLUDE_FIRST_BOUNCE
+#else
+#define include_first_bounce frame.include_first_bounce
+#endif
 
 struct BoxObject
 {
@@ -40,29 +76,40 @@ layout(std430, binding = 4) buffer layoutName3
 {
     int cube_states[];
 };
-layout(std430, binding = 5) buffer layoutName4
+// Block textures, a layer per block type and side
+layout(binding = 0) uniform sampler2DArray block_textures;
+layout(std430, binding = 7) coherent buffer layoutName5
 {
-    vec4 textures[];
+    OctreeNode g_oct_buf[];
 };
-layout(std430, binding = 7) buffer layoutName5
-{
-    Octree g_oct_buf[];
-};
-
 
-
-layout(std430, binding = 20) buffer layoutName20
+// Child block allocator for g_oct_buf, kept supplied by MappedOctree on
+// the CPU between frames. New blocks come from the free list first and
+// then from the bump pointer's slab. The free list is a ring whose counts
+// only grow.
+layout(std430, binding = 10) coherent buffer OctreeAllocator
 {
-    vec4 mip_map1[];
-};
-layout(std430, binding = 21) buffer layoutName21
+    int bump;        // first node never handed out
+    int capacity;    // bump allocations stop here
+    int free_count;  // entries ever appended to free_list
+    int free_taken;  // free_list entries handed out so far
+    int free_list[]; // first nodes of free blocks, a ring
+} oct_alloc;
+
+layout(std430, binding = 11) coherent buffer RadianceCacheBuffer
 {
-    vec4 mip_map2[];
+    RadianceCacheEntry radiance_cache[];
 };
-layout(std430, binding = 22) buffer layoutName22
+
+// Lights from LightList, the first light_count entries are in use
+layout(std430, binding = 12) readonly buffer LightListBuffer
 {
-    vec4 mip_map3[];
+    LightSource light_list[];
 };
+uniform int light_count;
+
+
+
 
 layout(binding = 1, rgba32f) uniform image2D out_tex;
 layout(binding = 3, rgba32f) uniform image2D out_tex_bounce_pass;
@@ -99,19 +146,27 @@ struct Ray
 };
 
 // Globals
-    // The camera specification
-uniform vec3 eye;
-uniform vec3 ray00;
-uniform vec3 ray10;
-uniform vec3 ray01;
-uniform vec3 ray11;
-uniform double ttime;
+// The camera and the per frame counters are in frame, see frame_uniforms.glsl
 uniform int cube_count_x;
 uniform int cube_count_y;
 uniform int cube_count_z;
-uniform int tex_width;
-uniform int tex_height;
-uniform int tex_count;
+// Texels across a block texture layer, and the angle a pixel covers
+uniform int tex_size;
+uniform float pixel_spread;
+// Chunk layout. A variant with FIXED_CHUNK_LAYOUT defined gets them as
+// constants instead, from CHUNK_SIZE_X etc.
+#ifdef FIXED_CHUNK_LAYOUT
+const int chunk_count = CHUNK_COUNT;
+const int chunk_size_x = CHUNK_SIZE_X;
+const int chunk_size_y = CHUNK_SIZE_Y;
+const int chunk_size_z = CHUNK_SIZE_Z;
+const int chunk_map_size_x = CHUNK_MAP_SIZE_X;
+const int chunk_map_size_y = CHUNK_MAP_SIZE_Y;
+const int chunk_map_size_z = CHUNK_MAP_SIZE_Z;
+// Ints per chunk in cube_states, full resolution blocks then LOD levels
+const int chunk_stride = CHUNK_STRIDE;
+const int chunk_lod_levels = CHUNK_LOD_LEVELS;
+#else
 uniform int chunk_count;
 uniform int chunk_size_x;
 uniform int chunk_size_y;
@@ -119,8 +174,18 @@ uniform int chunk_size_z;
 uniform int chunk_map_size_x;
 uniform int chunk_map_size_y;
 uniform int chunk_map_size_z;
-uniform int max_bounces;
-uniform int include_first_bounce;
+uniform int chunk_stride;
+uniform int chunk_lod_levels;
+#endif
+// Distance at which chunks switch to their first LOD level, each
+// further level starts at twice the distance of the one before. 0 disables.
+uniform float lod_distance;
+uniform int light_cache_mode;
+// RadianceCache table size - 1, and the entry settings
+uniform int radiance_cache_mask;
+uniform int radiance_cache_max_age;
+uniform float radiance_cache_cell_size;
+uniform float radiance_cache_lod_distance;
 
 struct Lamp
 {
@@ -159,6 +224,8 @@ vec4 default_initial_light = vec4(0.0, 0.0, 0.0, 1.0);
 ChunkTraversals chunk_traverse;
 float ray_margin = 0.0001;
 int try_count = 0;
+// sample_lights() calls so far, so each call draws different lights
+uint light_sample_count = 0;
 
 //// Prototype octree shader \\\\
 
@@ -167,127 +234,239 @@ int try_count = 0;
 //uniform Octree g_oct_buf[MAX_OCTREE_ELEMENTS];
 
 
-int octree_allocate(int parent)
+vec4 octree_value(int index)
 {
-    int out_index;
-    /*
-    int out_index = g_oct_buf[0].children[1];
-    if (g_oct_buf[out_index].parent != -1)
-    {
-        for (int i = 0; i < 8; ++i)
-        {
-            if (g_oct_buf[g_oct_buf[out_index].parent].children[i] == out_index)
-            {
-                g_oct_buf[g_oct_buf[out_index].parent].children[i] = -1;
-            }
-        }
-    }
-    */
-    bool found = false;
-    for (int i = 2; i < MAX_OCTREE_ELEMENTS; ++i)
+    return vec4(unpackHalf2x16(g_oct_buf[index].value_rg), unpackHalf2x16(g_oct_buf[index].value_ba));
+}
+
+void octree_store_value(int index, vec4 val)
+{
+    g_oct_buf[index].value_rg = packHalf2x16(val.xy);
+    g_oct_buf[index].value_ba = packHalf2x16(val.zw);
+}
+
+// Allocates the 8 children of parent, which start out with its value.
+// O(1) and safe to call from any number of invocations at once.
+// Returns the first child or -1 when the octree is full.
+int octree_allocate_block(int parent)
+{
+    int base = -1;
+    if (oct_alloc.free_taken < oct_alloc.free_count)
     {
-        if (g_oct_buf[i].parent == -1)
+        int slot = atomicAdd(oct_alloc.free_taken, 1);
+        if (slot < oct_alloc.free_count)
         {
-            found = true;
-            out_index = i;
-            break;
+            base = oct_alloc.free_list[slot % oct_alloc.free_list.length()];
         }
-        else if (length(g_oct_buf[i].pos.xyz - eye) > 50 && g_oct_buf[i].size < 30)
+        else
         {
-            out_index = i;
-            found = true;
-            break;
+            // Give the slot back, entries appended later must not be skipped
+            atomicAdd(oct_alloc.free_taken, -1);
         }
     }
-    if (!found)
+    if (base < 0)
     {
-        return -1;
+        // The pointer can run past capacity, the CPU clamps it and
+        // hands out a new slab
+        int index = atomicAdd(oct_alloc.bump, OCTREE_BLOCK_NODES);
+        if (index + OCTREE_BLOCK_NODES > oct_alloc.capacity)
+        {
+            return -1;
+        }
+        base = index;
     }
-    g_oct_buf[out_index].parent = parent;
-    for (int i = 0; i < 8; ++i)
+    for (int i = 0; i < OCTREE_BLOCK_NODES; ++i)
     {
-        g_oct_buf[out_index].children[i] = -1;
+        g_oct_buf[base + i].child_base = OCTREE_NO_CHILDREN;
+        g_oct_buf[base + i].parent = parent;
+        g_oct_buf[base + i].value_rg = g_oct_buf[parent].value_rg;
+        g_oct_buf[base + i].value_ba = g_oct_buf[parent].value_ba;
+        g_oct_buf[base + i].last_touched = frame.octree_frame;
     }
-    //g_oct_buf[0].children[1] = (g_oct_buf[0].children[1] + 1);
 
-    return out_index;
+    return base;
 }
 
-int octree_lookup(int depth, vec3 coord, vec4 in_val, bool allocate, bool set)
+// bounds gets the floor corner and side size of the node returned
+int octree_lookup(int depth, vec3 coord, vec4 in_val, bool allocate, bool set, out vec4 bounds)
 {
     int current_index = 0;
-    int last_index = 0;
+    bounds = vec4(0, 0, 0, OCTREE_ROOT_SIZE);
     for (int i = 0; i < depth; ++i)
     {
-        vec3 node_center = g_oct_buf[current_index].pos.xyz + vec3(g_oct_buf[current_index].size/2.0);
+        g_oct_buf[current_index].last_touched = frame.octree_frame;
+        vec3 node_center = bounds.xyz + vec3(bounds.w / 2.0);
         int x_index = int(coord.x > node_center.x);
         int y_index = int(coord.y > node_center.y);
         int z_index = int(coord.z > node_center.z);
         int child_index = x_index + y_index * 2 + z_index * 4;
 
-        if (g_oct_buf[current_index].children[child_index] < 0)
+        if (g_oct_buf[current_index].child_base < 0)
         {
-            if (allocate)
+            // Claim the block by swapping in OCTREE_CHILDREN_CLAIMED so only
+            // one invocation builds it. The rest stop here as if it didn't
+            // exist yet.
+            if (!allocate ||
+                atomicCompSwap(g_oct_buf[current_index].child_base,
+                    OCTREE_NO_CHILDREN, OCTREE_CHILDREN_CLAIMED) != OCTREE_NO_CHILDREN)
             {
-                int new_index = octree_allocate(current_index);
-                if (new_index == -1)
-                {
-                    return current_index;
-                }
-                g_oct_buf[current_index].children[child_index] = new_index;
-                g_oct_buf[new_index].size =
-                    g_oct_buf[current_index].size / 2.0;
-                g_oct_buf[new_index].pos.xyz =
-                    g_oct_buf[current_index].pos.xyz + vec3(x_index, y_index, z_index) *
-                    g_oct_buf[current_index].size / 2.0;
+                return current_index;
             }
-            else
+            int base = octree_allocate_block(current_index);
+            if (base == -1)
             {
+                atomicExchange(g_oct_buf[current_index].child_base, OCTREE_NO_CHILDREN);
                 return current_index;
             }
+            memoryBarrierBuffer();
+            atomicExchange(g_oct_buf[current_index].child_base, base);
         }
-        //else if (g_oct_buf[g_oct_buf[current_index].children[child_index]].value.x < -999)
-        {
-            //return current_index;
-        }
-        last_index = current_index;
+        int child_base = g_oct_buf[current_index].child_base;
         if (set)
         {
             vec4 sum_val = vec4(0);
-            int count = 0;
-            for (int j = 0; j < 8; ++j)
+            for (int j = 0; j < OCTREE_BLOCK_NODES; ++j)
             {
-                if (g_oct_buf[current_index].children[child_index] >= 0)
-                {
-                    sum_val += g_oct_buf[g_oct_buf[current_index].children[child_index]].value;
-                    count += 1;
-                }
+                sum_val += octree_value(child_base + j);
             }
-            g_oct_buf[current_index].value = sum_val/count;
-            //g_oct_buf[current_index].parent = last_index;
+            octree_store_value(current_index, sum_val / OCTREE_BLOCK_NODES);
         }
-        current_index = g_oct_buf[current_index].children[child_index];
-        
+        bounds.w /= 2.0;
+        bounds.xyz += vec3(x_index, y_index, z_index) * bounds.w;
+        current_index = child_base + child_index;
     }
-    
+    g_oct_buf[current_index].last_touched = frame.octree_frame;
+
     return current_index;
 }
 
+int octree_lookup(int depth, vec3 coord, vec4 in_val, bool allocate, bool set)
+{
+    vec4 bounds;
+    return octree_lookup(depth, coord, in_val, allocate, set, bounds);
+}
+
 int octree_set(int depth, vec3 coord, valtype val)
 {
     int current_index = octree_lookup(depth, coord, val, false, true);
-    g_oct_buf[current_index].value = val;
+    octree_store_value(current_index, val);
     return current_index;
 }
 
 valtype octree_get(int depth, vec3 coord, inout int ind)
 {
-    int current_index = octree_lookup(depth, coord, vec4(0), false, false);
+    vec4 bounds;
+    int current_index = octree_lookup(depth, coord, vec4(0), false, false, bounds);
     ind = current_index;
-    return vec4(g_oct_buf[current_index].value.xyz, g_oct_buf[current_index].size);
+    return vec4(octree_value(current_index).xyz, bounds.w);
 }
 //// Octree \\\\\
 
+//// Radiance cache \\\\
+
+uint radiance_cache_hash(uint x)
+{
+    // PCG output permutation
+    uint state = x * 747796405u + 2891336963u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Table slot hash and fingerprint of the cell around pos. Cells double
+// in size every time the distance doubles past radiance_cache_lod_distance
+// and are split by which axis the normal points along.
+void radiance_cache_key(vec3 pos, vec3 norm, float dist, out uint slot_hash, out uint fingerprint)
+{
+    int lod = clamp(int(log2(max(dist / radiance_cache_lod_distance, 1.0))), 0, 15);
+    float cell_size = radiance_cache_cell_size * float(1 << lod);
+    vec3 abs_norm = abs(norm);
+    int axis = abs_norm.x > abs_norm.y ? (abs_norm.x > abs_norm.z ? 0 : 2) : (abs_norm.y > abs_norm.z ? 1 : 2);
+    uint normal_bucket = uint(axis * 2 + int(norm[axis] > 0));
+    // Hits lie on block faces; step off the face so they don't flicker between cells
+    ivec3 cell = ivec3(floor((pos + norm * 0.5 * cell_size) / cell_size));
+
+    uint h = radiance_cache_hash(uint(lod) * 8u + normal_bucket);
+    h = radiance_cache_hash(h + uint(cell.x));
+    h = radiance_cache_hash(h + uint(cell.y));
+    h = radiance_cache_hash(h + uint(cell.z));
+    slot_hash = h;
+    // A second hash so slots sharing slot_hash can tell keys apart
+    fingerprint = max(radiance_cache_hash(h ^ 0x9e3779b9u), 1u);
+}
+
+// Finds the slot of the cell around pos. With insert, claims an empty
+// slot or one untouched for radiance_cache_max_age frames if the cell
+// isn't there. Returns -1 if it isn't found, or no slot could be claimed
+// within RADIANCE_CACHE_PROBES probes.
+int radiance_cache_find_slot(vec3 pos, vec3 norm, float dist, bool insert, out bool inserted)
+{
+    inserted = false;
+    uint slot_hash;
+    uint fingerprint;
+    radiance_cache_key(pos, norm, dist, slot_hash, fingerprint);
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; ++probe)
+    {
+        int slot = int((slot_hash + uint(probe)) & uint(radiance_cache_mask));
+        uint key = radiance_cache[slot].key;
+        if (key == fingerprint)
+        {
+            atomicMax(radiance_cache[slot].last_frame, frame.cache_frame);
+            return slot;
+        }
+        // Slots are never emptied, so the key can't be further along
+        if (key == RADIANCE_CACHE_EMPTY && !insert)
+        {
+            return -1;
+        }
+        bool stale = frame.cache_frame - radiance_cache[slot].last_frame > radiance_cache_max_age;
+        if (insert && (key == RADIANCE_CACHE_EMPTY || stale))
+        {
+            uint previous = atomicCompSwap(radiance_cache[slot].key, key, fingerprint);
+            if (previous == key || previous == fingerprint)
+            {
+                atomicMax(radiance_cache[slot].last_frame, frame.cache_frame);
+                inserted = previous == key;
+                return slot;
+            }
+        }
+    }
+    return -1;
+}
+
+bool radiance_cache_get(vec3 pos, vec3 norm, float dist, out vec4 val)
+{
+    bool inserted;
+    int slot = radiance_cache_find_slot(pos, norm, dist, false, inserted);
+    if (slot < 0)
+    {
+        val = vec4(0);
+        return false;
+    }
+    val = vec4(unpackHalf2x16(radiance_cache[slot].value_rg), unpackHalf2x16(radiance_cache[slot].value_ba));
+    return true;
+}
+
+// Blends val into the cell around pos. The two halves of the value are
+// plain stores: when invocations race on a slot one sample is lost.
+void radiance_cache_update(vec3 pos, vec3 norm, float dist, vec4 val, float alpha)
+{
+    bool inserted;
+    int slot = radiance_cache_find_slot(pos, norm, dist, true, inserted);
+    if (slot < 0)
+    {
+        return;
+    }
+    if (!inserted)
+    {
+        vec4 old_val = vec4(unpackHalf2x16(radiance_cache[slot].value_rg),
+            unpackHalf2x16(radiance_cache[slot].value_ba));
+        val = mix(old_val, val, alpha);
+    }
+    radiance_cache[slot].value_rg = packHalf2x16(val.xy);
+    radiance_cache[slot].value_ba = packHalf2x16(val.zw);
+}
+//// Radiance cache \\\\
+
 //// CircularRayBuffer \\\\
 
 struct CircularRayBuffer
@@ -342,18 +521,12 @@ int proc_next_ray()
 
 //// CircularRayBuffer ////
 
-vec4 get_tex_val(float x, float y, int tex_index)
+// Compute shaders have no derivatives, so the mip level comes from how
+// many texels a pixel's footprint covers at distance
+vec4 get_tex_val(float x, float y, int tex_index, float distance)
 {
-    int x_int = int(x * tex_width);
-    int y_int = int(y * tex_height);
-    return textures[x_int + tex_width * y_int + tex_width * tex_height * tex_index];
-}
-
-vec4 get_mip_map1_val(float x, float y, int tex_index)
-{
-    int x_int = int(x * tex_width/(2*2));
-    int y_int = int(y * tex_height/(2*2));
-    return mip_map2[x_int + tex_width * y_int/(2*2) + tex_width * tex_height * tex_index/(2*2*2*2)];
+    float lod = log2(max(distance * pixel_spread * float(tex_size), 1.0));
+    return textureLod(block_textures, vec3(x, y, float(tex_index)), lod);
 }
 
 float random(vec2 st) {
@@ -376,13 +549,40 @@ float random3(vec2 st) {
 
 int cube_type(vec3 in_pos, ChunkInfo in_chunk)
 {
-    return cube_states[(chunk_block_count * in_chunk.index +
+    return cube_states[(chunk_stride * in_chunk.index +
         (int(floor(in_pos.x - in_chunk.coord.x))) +
         chunk_size_x * (int(floor(in_pos.y - in_chunk.coord.y))) +
         chunk_size_y * chunk_size_x * (int(floor(in_pos.z - in_chunk.coord.z))))];
 
 }
 
+int chunk_lod(float distance)
+{
+    if (lod_distance <= 0 || distance < lod_distance)
+    {
+        return 0;
+    }
+    return min(int(log2(distance / lod_distance)) + 1, chunk_lod_levels);
+}
+
+// Block type of the LOD cell containing in_pos. Level 0 is full resolution.
+int cube_type_lod(vec3 in_pos, ChunkInfo in_chunk, int lod)
+{
+    if (lod == 0)
+    {
+        return cube_type(in_pos, in_chunk);
+    }
+    int offset = 0;
+    for (int i = 0; i < lod; ++i)
+    {
+        offset += chunk_block_count >> (3 * i);
+    }
+    ivec3 dims = ivec3(chunk_size_x, chunk_size_y, chunk_size_z) >> lod;
+    ivec3 cell = ivec3(floor(in_pos - in_chunk.coord.xyz)) >> lod;
+    return cube_states[chunk_stride * in_chunk.index + offset +
+        cell.x + dims.x * cell.y + dims.x * dims.y * cell.z];
+}
+
 vec2 intersect_box_scale_full(vec3 origin, vec3 dir, const vec3 box_origin, vec3 scale)
 {
     vec3 b_min = box_origin;
@@ -409,25 +609,33 @@ vec2 intersect_box(vec3 origin, vec3 dir, const vec3 box_origin) {
     return vec2(tNear,tFar);
 }
 
+int wrap_index(int a, int size)
+{
+    return a - size * int(floor(float(a) / float(size)));
+}
+
+// ref is the lowest chunk coordinate of the map window. Chunks
+// are stored at their coordinate modulo the map size.
 int get_map_chunk_index(ivec3 ref,
     ivec3 pos)
 {
     ivec3 rel = pos - ref;
-    ivec3 adj = pos;//% ivec3(chunk_scale);
-    int out_index = adj.x + adj.y * chunk_map_size_x + adj.z * chunk_map_size_x * chunk_map_size_y;
-
-    if (pos.y >= chunk_map_size_y || pos.x >= chunk_map_size_x || pos.z >= chunk_map_size_z ||
-        pos.y < 0 || pos.x < 0 || pos.z < 0)
+    if (rel.y >= chunk_map_size_y || rel.x >= chunk_map_size_x || rel.z >= chunk_map_size_z ||
+        rel.y < 0 || rel.x < 0 || rel.z < 0)
     {
         return -2;
     }
 
+    ivec3 adj = ivec3(wrap_index(pos.x, chunk_map_size_x),
+        wrap_index(pos.y, chunk_map_size_y),
+        wrap_index(pos.z, chunk_map_size_z));
+    int out_index = adj.x + adj.y * chunk_map_size_x + adj.z * chunk_map_size_x * chunk_map_size_y;
+
     return out_index;
 }
 
 int chunk_map_lookup(vec3 origin, vec3 dir, float start_d, inout ChunkTraversal ct)
 {
-    vec3 ref = floor(origin / chunk_scale);
     float d = 0;// ray_margin;
     float short_d = d;
 
@@ -439,7 +647,7 @@ int chunk_map_lookup(vec3 origin, vec3 dir, float start_d, inout ChunkTraversal
     vec3 fake_cur_chunk_coord = floor(fake_loc / chunk_scale);
     vec3 fake_cur_chunk_block_coord = fake_cur_chunk_coord * chunk_scale;
 
-    int index = get_map_chunk_index(ivec3(ref), ivec3(cur_chunk_coord));
+    int index = get_map_chunk_index(frame.chunk_map_origin.xyz, ivec3(cur_chunk_coord));
 
     vec2 limits = intersect_box_scale_full(fake_origin,
         dir,
@@ -447,7 +655,7 @@ int chunk_map_lookup(vec3 origin, vec3 dir, float start_d, inout ChunkTraversal
         chunk_scale);
 
     ct.info.coord = vec4(cur_chunk_block_coord, 0.0);
-    ct.info.index = chunk_map[index];
+    ct.info.index = index >= 0 ? chunk_map[index] : -1;
     ct.limits = limits;
 
     return index;
@@ -455,7 +663,6 @@ int chunk_map_lookup(vec3 origin, vec3 dir, float start_d, inout ChunkTraversal
 
 void chunks_map_lookup(vec3 origin, vec3 dir, int max_num)
 {
-    vec3 ref = floor(origin / chunk_scale);
     float d = 0;// ray_margin;
     float short_d = d;
     int add_count = 0;
@@ -471,7 +678,7 @@ void chunks_map_lookup(vec3 origin, vec3 dir, int max_num)
         vec3 fake_cur_chunk_coord = floor(fake_loc / chunk_scale);
         vec3 fake_cur_chunk_block_coord = fake_cur_chunk_coord * chunk_scale;
 
-        int index = get_map_chunk_index(ivec3(ref), ivec3(cur_chunk_coord));
+        int index = get_map_chunk_index(frame.chunk_map_origin.xyz, ivec3(cur_chunk_coord));
         
         vec2 limits = intersect_box_scale_full(fake_origin,
             dir,
@@ -479,7 +686,7 @@ void chunks_map_lookup(vec3 origin, vec3 dir, int max_num)
             chunk_scale);
         
         chunk_traverse.infos[add_count].info.coord = vec4(cur_chunk_block_coord, 0.0);
-        chunk_traverse.infos[add_count].info.index = chunk_map[index];
+        chunk_traverse.infos[add_count].info.index = index >= 0 ? chunk_map[index] : -1;
         chunk_traverse.infos[add_count].limits = limits;
         
         d = limits.y + ray_margin/100;
@@ -621,7 +828,9 @@ void test_intersect_boxes(vec3 origin, vec3 dir, float max_distance, inout HitIn
 }
 */
 
-void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout HitInfo hit_info, bool pass_transparent)
+// any_hit stops at the first block boundary within max_distance and
+// leaves everything but hit and distance unset, for shadow rays
+void intersect_boxes_mode(vec3 origin, vec3 dir, float max_distance, int seed, inout HitInfo hit_info, bool pass_transparent, bool any_hit)
 {
     //HitInfo hit_info;
     hit_info.hit = false;
@@ -652,6 +861,10 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
     {
         ct.info.index = -1;
         int retval = chunk_map_lookup(origin, dir, current_d, ct);
+        if (any_hit && ct.limits.x > max_distance)
+        {
+            return;
+        }
         current_d = ct.limits.y + 50*ray_margin;
         if (retval < 0)
         {
@@ -661,6 +874,12 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
             }
             continue;
         }
+        // Empty slot, nothing loaded here yet. Treat it as air.
+        if (ct.info.index < 0)
+        {
+            prev_cube_type = 0;
+            continue;
+        }
 
         if (k == 0)
         {
@@ -689,6 +908,10 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
             chunk_dist = ct.limits.y - (ct.limits.x);
         }
 
+        // Distant chunks are stepped through at a coarser LOD
+        int lod = chunk_lod(start_d);
+        float lod_scale = float(1 << lod);
+
         // If the current distance is more than the already hit
         // minimum, give up on this chunk
         //if (start_d > min_total_d)
@@ -701,23 +924,29 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
         for (int i = 0; i < int(2 * chunk_size_x); ++i)
         {
             
-            vec3 fake_start = (start_loc - floor(start_loc));
+            vec3 fake_start = (start_loc - floor(start_loc / lod_scale) * lod_scale);
             vec3 rel_loc = fake_start + dir * float(long_d);
-            vec3 rel_box = floor(rel_loc);
+            vec3 rel_box = floor(rel_loc / lod_scale) * lod_scale;
             vec3 loc = start_loc + dir * float(long_d);
-            vec3 cur_box = floor(loc);
-            int cube_type = cube_type(cur_box, ct.info);
+            vec3 cur_box = floor(loc / lod_scale) * lod_scale;
+            int cube_type = cube_type_lod(cur_box, ct.info, lod);
             float total_d = start_d + long_d;
             // Should collect light pass right through water? Water could affect color.
             // If we decide it should, uncomment the end of this line
             if ((cube_type != prev_cube_type) &&  total_d <= min_total_d)// && (!pass_transparent || (cube_type !=0 && cube_type != 4)))
             {
+                if (any_hit)
+                {
+                    hit_info.hit = total_d <= max_distance;
+                    hit_info.distance = float(total_d);
+                    return;
+                }
                 
                 hit_info.position = start_loc + dir * float(short_d);
                 hit_info.hit = true;
                 if (hit_info.hit)
                 {
-                    hit_info.cube_center = cur_box + vec3(0.5, 0.5, 0.5);
+                    hit_info.cube_center = cur_box + vec3(0.5 * lod_scale);
                     hit_info.incident = dir;
                     hit_info.distance = float(total_d);
                     hit_info.block_type = cube_type;
@@ -735,7 +964,7 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
                     }
                     else if (cube_type != 20)
                     {
-                        hit_info.reflect_color = get_tex_val(hit_info.tex_coords.x, hit_info.tex_coords.y, tex_index) * out_color;
+                        hit_info.reflect_color = get_tex_val(hit_info.tex_coords.x, hit_info.tex_coords.y, tex_index, hit_info.distance) * out_color;
                         hit_info.refract_color = vec4(0, 0, 0, 0);
                     }
                     else if (cube_type == 20)
@@ -757,7 +986,14 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
             
             prev_cube_type = cube_type;
             vec2 box_limits;
-            box_limits = intersect_box(fake_start, dir, rel_box);
+            if (lod == 0)
+            {
+                box_limits = intersect_box(fake_start, dir, rel_box);
+            }
+            else
+            {
+                box_limits = intersect_box_scale_full(fake_start, dir, rel_box, vec3(lod_scale));
+            }
             d = box_limits[1];
             /*
             vec3 p = fake_start + dir * d;
@@ -780,6 +1016,112 @@ void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout
     //return hit_info;
 }
 
+void intersect_boxes(vec3 origin, vec3 dir, float max_distance, int seed, inout HitInfo hit_info, bool pass_transparent)
+{
+    intersect_boxes_mode(origin, dir, max_distance, seed, hit_info, pass_transparent, false);
+}
+
+// True if a block is in the way within max_distance
+bool occluded(vec3 origin, vec3 dir, float max_distance)
+{
+    HitInfo hit_info;
+    intersect_boxes_mode(origin, dir, max_distance, 0, hit_info, true, true);
+    return hit_info.hit;
+}
+
+//// Light list \\\\
+
+float light_random(inout uint state)
+{
+    state = radiance_cache_hash(state);
+    return float(state >> 8) / 16777216.0;
+}
+
+// Light whose power_sum interval holds u of the total, so lights are
+// found in proportion to their intensity
+int find_light(float u)
+{
+    float target = u * light_list[light_count - 1].power_sum.x;
+    int lo = 0;
+    int hi = light_count - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (light_list[mid].power_sum.x <= target)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Unshadowed light from light_list[index], with the same falloff as the lamps
+vec3 light_contribution(int index, vec3 in_loc, vec3 in_direction, float distance)
+{
+    LightSource light = light_list[index];
+    vec3 to_light = light.position.xyz - in_loc;
+    float d = length(to_light) + distance;
+    return max(0, dot(in_direction, normalize(to_light))) * light.color.rgb * light.color.w / float(d * d);
+}
+
+// Light from the whole list at a fixed cost. LIGHT_CANDIDATES lights are
+// drawn by intensity, one of them is kept by resampled importance
+// sampling on its unshadowed contribution, and only that one gets a
+// shadow ray. The result is weighted to stay unbiased.
+vec3 sample_lights(vec3 in_loc, vec3 in_direction, float distance)
+{
+    if (light_count <= 0)
+    {
+        return vec3(0);
+    }
+    uint state = radiance_cache_hash(gl_GlobalInvocationID.x ^ radiance_cache_hash(gl_GlobalInvocationID.y ^
+        radiance_cache_hash(uint(frame.cache_frame) ^ radiance_cache_hash(light_sample_count))));
+    light_sample_count += 1;
+
+    float total_power = light_list[light_count - 1].power_sum.x;
+    int chosen = -1;
+    vec3 chosen_light = vec3(0);
+    float chosen_target = 0;
+    float weight_sum = 0;
+    for (int i = 0; i < LIGHT_CANDIDATES; ++i)
+    {
+        int index = find_light(light_random(state));
+        float intensity = light_list[index].color.w;
+        if (intensity <= 0)
+        {
+            continue;
+        }
+        vec3 light = light_contribution(index, in_loc, in_direction, distance);
+        float target = dot(light, vec3(0.2126, 0.7152, 0.0722));
+        // Target over the chance of drawing this light
+        float weight = target * total_power / intensity;
+        weight_sum += weight;
+        if (weight > 0 && light_random(state) * weight_sum < weight)
+        {
+            chosen = index;
+            chosen_light = light;
+            chosen_target = target;
+        }
+    }
+    if (chosen < 0)
+    {
+        return vec3(0);
+    }
+
+    vec3 to_light = light_list[chosen].position.xyz - in_loc;
+    float light_distance = length(to_light);
+    if (occluded(in_loc, to_light / light_distance, light_distance - light_list[chosen].position.w))
+    {
+        return vec3(0);
+    }
+    return chosen_light / chosen_target * weight_sum / float(LIGHT_CANDIDATES);
+}
+//// Light list \\\\
+
 ivec2 create_rays_from_hit(inout HitInfo hit)
 {
     int refract_ray = -1;
@@ -814,12 +1156,12 @@ vec4 collect_light(vec3 in_loc, vec3 in_direction, float distance)
         float d = length(lamps[i].loc.xyz - in_loc) + distance;
         vec3 dir = normalize(lamps[i].loc.xyz - in_loc);
         //hit_info = intersect_boxes(in_loc, dir, 10000);
-        intersect_boxes(in_loc, dir, 100, 0, hit_info, true);
-        if (!hit_info.hit)
+        if (!occluded(in_loc, dir, length(lamps[i].loc.xyz - in_loc)))
         {
             csum += max(0,dot(in_direction, dir)) * (lamps[i].color) * (lamps[i].intensity) / float(d * d);
         }
     }
+    csum.rgb += sample_lights(in_loc, in_direction, distance);
     return csum;
 }
 
@@ -976,7 +1318,7 @@ void main()
     
     // temporary
     lamps[0].color = vec4(1.0, 1.0, 1.0, 1.0);
-    lamps[0].loc = vec4(7000 * cos(1 * 2 * 3.14159 * (int(ttime + 150) % 300) / 600.0), 7000 * sin(1 * 2 * 3.14159 * (int(ttime + 150) % 300) / 600.0), 10, 0.0);
+    lamps[0].loc = vec4(7000 * cos(1 * 2 * 3.14159 * (int(frame.ttime + 150) % 300) / 600.0), 7000 * sin(1 * 2 * 3.14159 * (int(frame.ttime + 150) % 300) / 600.0), 10, 0.0);
     //lamps[0].loc = vec4(7000, 7000, 10000, 0.0);
     //lamps[0].loc = vec3(5000, 1, 10000);
     lamps[0].intensity = 100000000;
@@ -984,20 +1326,20 @@ void main()
 
     uint chunk_num = gl_GlobalInvocationID.z;
     ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
-    ivec2 size = imageSize(out_tex);
-    ivec2 hi_res_size = imageSize(out_tex);
+    ivec2 size = frame.render_size.xy;
+    ivec2 hi_res_size = frame.render_size.xy;
     float draw, draw2, draw3;
     vec3 rand_vec = vec3(0);
     if (!(include_first_bounce > 0))
     {
-        size = imageSize(out_tex_low_res);
-        float draw = 2 * random(mod(gl_GlobalInvocationID.xy * ((int(ttime * 100) % 200) ^ 1234), 1024) / vec2(1024, 1024)) - 1;
-        float draw2 = 2 * random2(mod(gl_GlobalInvocationID.xy * (((int(ttime * 100) % 200) + 1) ^ 4356), 1024) / vec2(1024, 1024)) - 1;
-        float draw3 = 2 * random3(mod(gl_GlobalInvocationID.xy * (((int(ttime * 100) % 200) + 2) ^ 7890), 1024) / vec2(1024, 1024)) - 1;
+        size = frame.render_size.zw;
+        float draw = 2 * random(mod(gl_GlobalInvocationID.xy * ((int(frame.ttime * 100) % 200) ^ 1234), 1024) / vec2(1024, 1024)) - 1;
+        float draw2 = 2 * random2(mod(gl_GlobalInvocationID.xy * (((int(frame.ttime * 100) % 200) + 1) ^ 4356), 1024) / vec2(1024, 1024)) - 1;
+        float draw3 = 2 * random3(mod(gl_GlobalInvocationID.xy * (((int(frame.ttime * 100) % 200) + 2) ^ 7890), 1024) / vec2(1024, 1024)) - 1;
         float mix_val = 0.7;
         //rand_vec = 0.075 * normalize(vec3(draw, draw2, draw3));
     }
-    ivec2 low_res_size = imageSize(out_tex_low_res);
+    ivec2 low_res_size = frame.render_size.zw;
     ivec2 pix_low_res = ivec2(int(low_res_size.x * float(pix.x * 1.0) / size.x), int(low_res_size.y * float(pix.y * 1.0) / size.y));
     ivec2 pix_high_res = ivec2(int(hi_res_size.x * float(pix.x * 1.0) / low_res_size.x), int(hi_res_size.y * float(pix.y * 1.0) / low_res_size.y));
     vec2 pix_low_res_exact = vec2((low_res_size.x * float(pix.x * 1.0) / size.x), (low_res_size.y * float(pix.y * 1.0) / size.y));
@@ -1024,12 +1366,12 @@ void main()
     //}
     //if (length(high_res_norm.xyz) >= 0.9)
     {               
-        vec3 dir = mix(mix(ray00, ray01, float(pos_y)), mix(ray10, ray11, pos.y), float(pos_x)) + rand_vec;
+        vec3 dir = mix(mix(frame.ray00.xyz, frame.ray01.xyz, float(pos_y)), mix(frame.ray10.xyz, frame.ray11.xyz, pos.y), float(pos_x)) + rand_vec;
         dir = normalize(dir);
         vec4 norm;
         vec3 hit_loc;
         float reactivity = 0;
-        vec4 ret = trace(eye, dir, norm, hit_loc);
+        vec4 ret = trace(frame.eye.xyz, dir, norm, hit_loc);
         if (include_first_bounce > 0)
         {
             /*
@@ -1047,8 +1389,8 @@ void main()
             int y = 0;
             vec4 out_color = vec4(0.0);
             float factors = 0;
-            int oct_depth;// = int(clamp(1000000 / (length(eye - hit_loc) * length(eye - hit_loc)), 1, 10));
-            float dist = length(eye - hit_loc);
+            int oct_depth;// = int(clamp(1000000 / (length(frame.eye.xyz - hit_loc) * length(frame.eye.xyz - hit_loc)), 1, 10));
+            float dist = length(frame.eye.xyz - hit_loc);
             if (dist < 10)
             {
                 oct_depth = 15;
@@ -1092,6 +1434,8 @@ void main()
             }
             out_color /= factors;
             */
+            // Nearest low resolution texel; gi_upsample.glsl replaces it
+            // with a normal and depth aware blend afterwards
             if (oct_depth < 10)
             {
                 out_color = imageLoad(out_tex_low_res, pix_low_res);
@@ -1114,7 +1458,7 @@ void main()
                 //    pix_low_res_exact.y - pix_low_res.y);
                 //out_color = octree_get(oct_depth, hit_loc, ind);
                 /*
-                vec4 center = g_oct_buf[ind].pos + vec4(g_oct_buf[ind].size / 2.0);
+                vec4 center = vec4(bounds.xyz + vec3(bounds.w / 2.0), 0);
                 vec4 out_color1 = octree_get(oct_depth, (center + vect3*out_color.w).xyz, ind);
                 vec4 out_color2 = octree_get(oct_depth, (center - vect3 * out_color.w).xyz, ind);
                 vec4 out_color3 = octree_get(oct_depth, (center + vect4 * out_color.w).xyz, ind);
@@ -1138,6 +1482,12 @@ void main()
                     //out_color = vec4(0);
                 }
             }
+            vec4 cached;
+            if (light_cache_mode == LIGHT_CACHE_HASH && length(norm.xyz) > 0.1 &&
+                radiance_cache_get(hit_loc, norm.xyz, dist, cached))
+            {
+                out_color = cached;
+            }
             out_color.w = dist;
             
         
@@ -1147,8 +1497,8 @@ void main()
         }
         else
         {
-            int oct_depth;// = int(clamp(1000000 / (length(eye - hit_loc) * length(eye - hit_loc)), 1, 10));
-            float dist = length(eye - hit_loc);
+            int oct_depth;// = int(clamp(1000000 / (length(frame.eye.xyz - hit_loc) * length(frame.eye.xyz - hit_loc)), 1, 10));
+            float dist = length(frame.eye.xyz - hit_loc);
             if (dist < 10)
             {
                 oct_depth = 15;
@@ -1170,19 +1520,27 @@ void main()
                 oct_depth = 2;
             }
             vec4 avg = vec4(0);
-            if (false)//length(norm) > 0.1)
+            if (light_cache_mode == LIGHT_CACHE_OCTREE && frame.octree_writes != 0 && length(norm.xyz) > 0.1)
             {
-                int index = octree_lookup(oct_depth, hit_loc, ret, false, false);
+                // Builds the path down to oct_depth where it's missing, so
+                // the tree grows at every pixel of this pass
+                vec4 bounds;
+                int index = octree_lookup(oct_depth, hit_loc, ret, true, false, bounds);
                 float factor = 0;
-                if (g_oct_buf[index].size < 1.0)
+                if (bounds.w < 1.0)
                 {
                     factor = 0.05;
                 }
-                avg = (ret * (1 - factor) + g_oct_buf[index].value * factor);
+                avg = (ret * (1 - factor) + octree_value(index) * factor);
 
                 octree_set(oct_depth, hit_loc, avg);
                 //octree_set(oct_depth, hit_loc, vec4(hit_loc, 0) / 1000.0);
             }
+            if (light_cache_mode == LIGHT_CACHE_HASH && length(norm.xyz) > 0.1)
+            {
+                // Stored encoded the same way as out_tex_low_res, which it stands in for
+                radiance_cache_update(hit_loc, norm.xyz, dist, log(1.5 * ret + 1), 0.1);
+            }
             //int ind = -1;
             //vec4 oct = octree_get(oct_depth - 4, hit_loc, ind);
             imageStore(out_tex_low_res, pix, log(1.5 * ret + 1));
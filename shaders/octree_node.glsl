@@ -0,0 +1,37 @@
+// Light octree node. Included by both multi_ray.glsl and
+// include/octree_node.h, so it has to stay valid GLSL and C++.
+//
+// The 8 children of a node are allocated together as consecutive nodes
+// starting at child_base. Position and size aren't stored; they follow
+// from the path down from the root, which covers OCTREE_ROOT_SIZE on
+// each side starting at the origin.
+#ifndef OCTREE_NODE_GLSL_
+#define OCTREE_NODE_GLSL_
+
+#define OCTREE_ROOT_SIZE 1000.0
+#define OCTREE_NODE_BYTES 32
+#define OCTREE_BLOCK_NODES 8
+
+// child_base values other than a node index
+#define OCTREE_NO_CHILDREN -1
+#define OCTREE_CHILDREN_CLAIMED -2  // a lookup is allocating the block
+
+#ifdef __cplusplus
+#define OCTREE_UINT uint32_t
+#else
+#define OCTREE_UINT uint
+#endif
+
+struct OctreeNode
+{
+    int child_base;
+    int parent;
+    OCTREE_UINT value_rg;  // RGBA16F value, packHalf2x16
+    OCTREE_UINT value_ba;
+    int last_touched;  // octree_frame of the last lookup through this node
+    int bucket_generation;  // LRU bucket of the block, set on its first node. CPU only
+    int pad0;
+    int pad1;
+};
+
+#endif  // OCTREE_NODE_GLSL_
@@ -0,0 +1,31 @@
+// Radiance cache slot. Included by both multi_ray.glsl and
+// include/radiance_cache.h, so it has to stay valid GLSL and C++.
+//
+// The cache is an open addressing hash table keyed by a fingerprint of
+// the quantized position, level of detail and normal direction. A key
+// of 0 marks a slot that was never used; slots are never emptied again,
+// only taken over once they haven't been touched for a while.
+#ifndef RADIANCE_CACHE_ENTRY_GLSL_
+#define RADIANCE_CACHE_ENTRY_GLSL_
+
+#define RADIANCE_CACHE_ENTRY_BYTES 16
+#define RADIANCE_CACHE_EMPTY 0u
+
+// Slots a lookup probes before giving up
+#define RADIANCE_CACHE_PROBES 8
+
+#ifdef __cplusplus
+#define RADIANCE_CACHE_UINT uint32_t
+#else
+#define RADIANCE_CACHE_UINT uint
+#endif
+
+struct RadianceCacheEntry
+{
+    RADIANCE_CACHE_UINT key;
+    int last_frame;  // cache_frame of the last lookup or update
+    RADIANCE_CACHE_UINT value_rg;  // RGBA16F radiance, packHalf2x16
+    RADIANCE_CACHE_UINT value_ba;
+};
+
+#endif  // RADIANCE_CACHE_ENTRY_GLSL_
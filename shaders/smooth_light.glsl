@@ -0,0 +1,56 @@
+#version 460 core
+
+#define GROUP_SIZE_X 8
+#define GROUP_SIZE_Y 8
+#define GROUP_SIZE_Z 1
+
+layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
+
+// Averages each pixel with the neighbours within radius that face the
+// same way and are at about the same distance. src_tex is a copy of
+// color_tex taken before the pass. smooth_light_cpu() in light_smoothing.h
+// does the same sums in the same order; keep the two in step.
+layout(binding = 1, rgba32f) uniform image2D color_tex;
+layout(binding = 2, rgba32f) uniform image2D norm_tex;
+layout(binding = 4, rgba32f) uniform image2D src_tex;
+
+uniform int radius;
+
+#include "frame_uniforms.glsl"
+
+void main()
+{
+	ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = frame.render_size.xy;
+	if (pix.x >= size.x || pix.y >= size.y)
+	{
+		return;
+	}
+
+	vec4 n1 = imageLoad(norm_tex, pix);
+	precise vec4 sum = vec4(0);
+	int count = 0;
+	for (int y_offset = -radius; y_offset <= radius; ++y_offset)
+	{
+		for (int x_offset = -radius; x_offset <= radius; ++x_offset)
+		{
+			ivec2 other = pix + ivec2(x_offset, y_offset);
+			if (other.x < 0 || other.y < 0 || other.x >= size.x || other.y >= size.y)
+			{
+				continue;
+			}
+			vec4 n2 = imageLoad(norm_tex, other);
+			precise float facing = n1.x * n2.x + n1.y * n2.y + n1.z * n2.z;
+			if (facing > 0.1 && abs(n1.w - n2.w) < 0.5)
+			{
+				sum += imageLoad(src_tex, other);
+				count += 1;
+			}
+		}
+	}
+	// The center always passes unless its normal is zero
+	if (count > 0)
+	{
+		imageStore(color_tex, pix, sum / float(count));
+	}
+}
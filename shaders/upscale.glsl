@@ -0,0 +1,72 @@
+#version 460 core
+
+#define GROUP_SIZE_X 8
+#define GROUP_SIZE_Y 8
+#define GROUP_SIZE_Z 1
+
+layout(local_size_x = GROUP_SIZE_X, local_size_y = GROUP_SIZE_Y, local_size_z = GROUP_SIZE_Z) in;
+
+// Scales the traced area of color_tex, frame.render_size.xy, up to the
+// whole of dst_tex. Bilinear, except that taps on another surface than
+// the nearest one are weighted down by their normal and depth, so block
+// edges and silhouettes stay sharp instead of smearing into each other.
+layout(binding = 1, rgba32f) uniform image2D color_tex;
+layout(binding = 2, rgba32f) uniform image2D norm_tex;
+layout(binding = 5, rgba32f) uniform image2D dst_tex;
+
+#include "frame_uniforms.glsl"
+
+uniform float normal_phi;
+uniform float depth_phi;
+
+bool has_surface(vec4 norm)
+{
+	return dot(norm.xyz, norm.xyz) > 0.5;
+}
+
+void main()
+{
+	ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(dst_tex);
+	if (pix.x >= size.x || pix.y >= size.y)
+	{
+		return;
+	}
+
+	// Same pixel to ray mapping as the trace, pix / size
+	ivec2 src_size = frame.render_size.xy;
+	vec2 src = vec2(pix) * vec2(src_size) / vec2(size);
+	ivec2 base = ivec2(floor(src));
+	vec2 f = src - vec2(base);
+	ivec2 nearest = min(ivec2(src + 0.5), src_size - 1);
+	vec4 guide = imageLoad(norm_tex, nearest);
+	bool guide_surface = has_surface(guide);
+
+	vec3 sum = vec3(0);
+	float weight_sum = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 tap = min(base + offset, src_size - 1);
+		vec4 tap_norm = imageLoad(norm_tex, tap);
+		float weight = (offset.x == 1 ? f.x : 1 - f.x) * (offset.y == 1 ? f.y : 1 - f.y);
+		if (guide_surface != has_surface(tap_norm))
+		{
+			continue;
+		}
+		if (guide_surface)
+		{
+			weight *= pow(max(dot(guide.xyz, tap_norm.xyz), 0), normal_phi);
+			weight *= exp(-abs(guide.w - tap_norm.w) / (depth_phi * guide.w + 0.0001));
+		}
+		sum += imageLoad(color_tex, tap).rgb * weight;
+		weight_sum += weight;
+	}
+	// The nearest tap always passes, but its bilinear weight can be tiny
+	vec4 result = imageLoad(color_tex, nearest);
+	if (weight_sum > 0.0001)
+	{
+		result.rgb = sum / weight_sum;
+	}
+	imageStore(dst_tex, pix, result);
+}
@@ -32,11 +32,9 @@ namespace graphics
 
     void set_program(std::shared_ptr<Program> in_program)
     {
-        if (in_program != active_program_ptr)
-        {
-            active_program_ptr = in_program;
-            glUseProgram(in_program->get_program_name());
-        }
+        // Through the GLuint version so both agree on what is bound
+        active_program_ptr = in_program;
+        set_program(in_program->get_program_name());
     }
 
     void set_active_camera(std::shared_ptr<Camera> in_cam)
@@ -46,8 +44,9 @@ namespace graphics
 
     void set_camera_matrices(std::shared_ptr<Camera> in_camera)
     {
-        active_program_ptr->set_uniform_mat4(VIEW_MAT_NAME, in_camera->get_view());
-        active_program_ptr->set_uniform_mat4(PROJECTION_MAT_NAME, in_camera->get_projection());
+        const CommonUniforms& uniforms = active_program_ptr->common_uniforms();
+        active_program_ptr->set_uniform_mat4(uniforms.view_mat, in_camera->get_view());
+        active_program_ptr->set_uniform_mat4(uniforms.projection_mat, in_camera->get_projection());
         /*
         GLuint view_mat_loc = glGetUniformLocation(active_program, VIEW_MAT_NAME.c_str());
         GLuint projection_mat_loc = glGetUniformLocation(active_program, PROJECTION_MAT_NAME.c_str());
@@ -60,8 +59,9 @@ namespace graphics
 
     void set_camera_matrices(const Camera* in_camera)
     {
-        active_program_ptr->set_uniform_mat4(VIEW_MAT_NAME, in_camera->get_view());
-        active_program_ptr->set_uniform_mat4(PROJECTION_MAT_NAME, in_camera->get_projection());
+        const CommonUniforms& uniforms = active_program_ptr->common_uniforms();
+        active_program_ptr->set_uniform_mat4(uniforms.view_mat, in_camera->get_view());
+        active_program_ptr->set_uniform_mat4(uniforms.projection_mat, in_camera->get_projection());
         /*
         GLuint view_mat_loc = glGetUniformLocation(active_program, VIEW_MAT_NAME.c_str());
         GLuint projection_mat_loc = glGetUniformLocation(active_program, PROJECTION_MAT_NAME.c_str());
@@ -149,9 +149,10 @@ namespace graphics
     {
         set_program(in_object->get_program());
         in_object->bind();
-        in_object->get_program()->set_uniform_mat4("model_mat", in_object->get_transform());
-        in_object->get_program()->set_uniform_int("x_res", x_res);
-        in_object->get_program()->set_uniform_int("y_res", y_res);
+        const CommonUniforms& uniforms = in_object->get_program()->common_uniforms();
+        in_object->get_program()->set_uniform_mat4(uniforms.model_mat, in_object->get_transform());
+        in_object->get_program()->set_uniform_int(uniforms.x_res, x_res);
+        in_object->get_program()->set_uniform_int(uniforms.y_res, y_res);
         //GLuint model_mat_loc = glGetUniformLocation(
         //    in_object->get_program()->get_program_name(), "model_mat");
         //glm::mat4 model_mat = in_object->get_transform();
@@ -177,7 +178,8 @@ namespace graphics
         set_program(in_object->get_program());
         set_camera_matrices(in_camera);
         in_object->bind();
-        in_object->get_program()->set_uniform_mat4("model_mat", in_object->get_transform());
+        in_object->get_program()->set_uniform_mat4(
+            in_object->get_program()->common_uniforms().model_mat, in_object->get_transform());
         //GLuint model_mat_loc = glGetUniformLocation(
         //    in_object->get_program()->get_program_name(), "model_mat");
         //glm::mat4 model_mat = in_object->get_transform();
@@ -212,7 +214,8 @@ namespace graphics
         set_program(in_object->get_program());
         set_camera_matrices(in_camera);
         in_object->bind();
-        in_object->get_program()->set_uniform_mat4("model_mat", in_object->get_transform());
+        in_object->get_program()->set_uniform_mat4(
+            in_object->get_program()->common_uniforms().model_mat, in_object->get_transform());
         //GLuint model_mat_loc = glGetUniformLocation(
         //    in_object->get_program()->get_program_name(), "model_mat");
         //glm::mat4 model_mat = in_object->get_transform();